@@ -0,0 +1,106 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <vector>
+
+#include <spdlog/fmt/fmt.h>
+#include <workserver/job_queue.hpp>
+#include <workserver/pow_kernels.hpp>
+
+namespace
+{
+/** Hashes \p count_a nonces on a single thread with each supported kernel and prints the hashrate */
+void bench_kernels (uint64_t count_a)
+{
+	std::array<uint8_t, 32> root;
+	for (size_t i = 0; i < root.size (); ++i)
+	{
+		root[i] = static_cast<uint8_t> (i * 7 + 1);
+	}
+	auto const words (nano_pow::to_root_words (root));
+
+	std::cout << fmt::format ("{:<16} {:>6} {:>10}", "kernel", "lanes", "MH/s") << std::endl;
+	for (auto const & kernel : nano_pow::supported_kernels ())
+	{
+		uint64_t result;
+		auto const start (std::chrono::steady_clock::now ());
+		// No nonce meets the maximum difficulty, so every kernel hashes the full count
+		kernel.search (words.data (), 0, count_a, std::numeric_limits<uint64_t>::max (), result);
+		std::chrono::duration<double> const elapsed (std::chrono::steady_clock::now () - start);
+		std::cout << fmt::format ("{:<16} {:>6} {:>10.2f}", kernel.name, kernel.lanes, count_a / elapsed.count () / 1e6) << std::endl;
+	}
+}
+
+/**
+ * Measures the cost of cancelling a queued root at several queue depths, for the indexed job queue and for
+ * rebuilding a std::priority_queue without the root, which is how cancellation used to work
+ */
+void bench_queue_cancel ()
+{
+	constexpr unsigned cancels = 256;
+	std::cout << fmt::format ("{:>8} {:>16} {:>16}", "depth", "indexed us", "rebuild us") << std::endl;
+	for (unsigned depth : { 1024, 4096, 16384, 65536 })
+	{
+		std::vector<nano_pow_server::job_handle> jobs (depth);
+		for (unsigned i = 0; i < depth; ++i)
+		{
+			jobs[i] = std::make_shared<nano_pow_server::job> ();
+			jobs[i]->request.root_hash = nano_pow_server::u256 (i);
+			jobs[i]->set_priority (i % 4);
+		}
+
+		nano_pow_server::job_queue indexed;
+		std::priority_queue<nano_pow_server::job_handle, std::vector<nano_pow_server::job_handle>, nano_pow_server::job::comparator> rebuilt;
+		for (auto const & job : jobs)
+		{
+			indexed.push (job);
+			rebuilt.push (job);
+		}
+
+		// Every cancelled job is queued again, so the depth stays the same
+		auto const start_indexed (std::chrono::steady_clock::now ());
+		for (unsigned i = 0; i < cancels; ++i)
+		{
+			auto const & job (jobs[(i * 7919) % depth]);
+			indexed.remove (job->request.root_hash);
+			indexed.push (job);
+		}
+		std::chrono::duration<double> const elapsed_indexed (std::chrono::steady_clock::now () - start_indexed);
+
+		auto const start_rebuilt (std::chrono::steady_clock::now ());
+		for (unsigned i = 0; i < cancels; ++i)
+		{
+			auto const & job (jobs[(i * 7919) % depth]);
+			decltype (rebuilt) filtered;
+			while (!rebuilt.empty ())
+			{
+				if (!(rebuilt.top ()->request.root_hash == job->request.root_hash))
+				{
+					filtered.push (rebuilt.top ());
+				}
+				rebuilt.pop ();
+			}
+			rebuilt.swap (filtered);
+			rebuilt.push (job);
+		}
+		std::chrono::duration<double> const elapsed_rebuilt (std::chrono::steady_clock::now () - start_rebuilt);
+
+		std::cout << fmt::format ("{:>8} {:>16.2f} {:>16.2f}", depth, elapsed_indexed.count () * 1e6 / cancels, elapsed_rebuilt.count () * 1e6 / cancels) << std::endl;
+	}
+}
+}
+
+int main (int argc, char * argv[])
+{
+	uint64_t count = 1 << 22;
+	if (argc > 1)
+	{
+		count = std::strtoull (argv[1], nullptr, 10);
+	}
+	bench_kernels (count);
+	std::cout << std::endl;
+	bench_queue_cancel ();
+	return EXIT_SUCCESS;
+}
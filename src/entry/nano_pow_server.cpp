@@ -78,17 +78,45 @@ int main (int argc, char * argv[])
 		web::config web_conf;
 		web_conf.static_pages_allow = conf.admin.enable;
 		web_conf.static_pages_allow_remote = conf.admin.allow_remote;
+		for (auto const & client : conf.clients)
+		{
+			web_conf.api_keys.insert (client.key);
+		}
 		web::webserver ws (web_conf, conf.server.threads);
 
 		auto work_endpoint_handler = [&](std::string body, std::vector<std::string>, std::shared_ptr<web::http_session> session) {
-			work_handler.handle_request_async (body, [session](std::string response) {
+			auto respond = [session](std::string response) {
 				session->write_json_response (response);
-			});
+			};
+			auto reject = [session](std::string response, std::chrono::seconds retry_after) {
+				session->write_unavailable_response (response, retry_after);
+			};
+			work_handler.handle_request_async (body, respond, session->client_key (), reject);
 		};
 
 		auto work_endpoint_handler_websockets = [&](std::string body, std::shared_ptr<web::websocket_session> session) {
-			work_handler.handle_request_async (body, [session](std::string response) {
+			auto respond = [session](std::string response) {
 				session->write_response (response);
+			};
+			work_handler.handle_request_async (body, respond, session->client_key ());
+		};
+
+		auto work_status_endpoint_handler = [&](std::string, std::vector<std::string> args, std::shared_ptr<web::http_session> session) {
+			// Long-polling clients pass the longest time to wait for the job in milliseconds
+			std::chrono::milliseconds wait (0);
+			try
+			{
+				auto const timeout (session->query_parameter ("timeout"));
+				if (!timeout.empty ())
+				{
+					wait = std::chrono::milliseconds (std::stoul (timeout));
+				}
+			}
+			catch (std::logic_error const &)
+			{
+			}
+			work_handler.handle_status_request (args.front (), wait, [session](std::string response) {
+				session->write_json_response (response);
 			});
 		};
 
@@ -98,6 +126,12 @@ int main (int argc, char * argv[])
 			});
 		};
 
+		auto work_cache_endpoint_handler = [&](std::string, std::vector<std::string>, std::shared_ptr<web::http_session> session) {
+			work_handler.handle_cache_request ([session](std::string response) {
+				session->write_json_response (response);
+			});
+		};
+
 		auto work_queue_delete_endpoint_handler = [&](std::string, std::vector<std::string>, std::shared_ptr<web::http_session> session) {
 			work_handler.handle_queue_delete_request ([session](std::string response) {
 				session->write_json_response (response);
@@ -131,12 +165,17 @@ int main (int argc, char * argv[])
 		ws.add_post_endpoint ("/api/v1/work", work_endpoint_handler);
 		ws.add_get_endpoint ("/api/v1/work/queue", work_queue_endpoint_handler);
 		ws.add_delete_endpoint ("/api/v1/work/queue", work_queue_delete_endpoint_handler);
+		ws.add_get_endpoint ("/api/v1/work/cache", work_cache_endpoint_handler);
+		// Registered after the other work endpoints, as the job id matches any path segment
+		ws.add_get_endpoint ("/api/v1/work/?", work_status_endpoint_handler);
 		ws.add_get_endpoint ("/api/v1/ping", ping_handler);
 		ws.add_get_endpoint ("/api/v1/stop", stop_handler);
 		ws.add_get_endpoint ("/api/v1/version", version_handler);
 		ws.add_websocket_endpoint ("/websocket", work_endpoint_handler_websockets);
 
 		logger->info ("Nano PoW Server version {}", version_string_full);
+		auto const & kernel (nano_pow::best_kernel ());
+		logger->info ("CPU work kernel: {} ({} nonces per iteration)", kernel.name, kernel.lanes);
 		ws.start (conf.server.bind_address, conf.server.port, conf.admin.doc_root);
 	}
 	catch (std::runtime_error const & err)
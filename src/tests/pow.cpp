@@ -0,0 +1,294 @@
+#include <gtest/gtest.h>
+
+#include <limits>
+#include <thread>
+
+#include <workserver/blake2b.hpp>
+#include <workserver/pow.hpp>
+#include <workserver/pow_table.hpp>
+#include <workserver/util.hpp>
+
+namespace
+{
+nano_pow::root test_root ()
+{
+	return nano_pow_server::u256 ("718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2").bytes;
+}
+}
+
+TEST (blake2b, vector)
+{
+	nano_pow::blake2b hash (64);
+	hash.update ("abc", 3);
+	std::array<uint8_t, 64> digest;
+	hash.final (digest.data ());
+	nano_pow_server::u512 expected ("ba80a53f981c4d0d6a2797b69f12f6e94c212f14685ac4b74b12bb6fdbffa2d17d87c5392aab792dc252d5de4533cc9518d38aa8dbf1925ab92386edd4009923");
+	ASSERT_EQ (expected.bytes, digest);
+}
+
+TEST (pow, difficulty)
+{
+	auto root (test_root ());
+	ASSERT_EQ (0x6b90c9aab5d66034ULL, nano_pow::difficulty (root, 0));
+	ASSERT_EQ (0x262eb7eda3cf3f86ULL, nano_pow::difficulty (root, 0x2feaeaa000000000ULL));
+	ASSERT_EQ (0xda95547bf4baac32ULL, nano_pow::difficulty (root, 0x123456789abcdef0ULL));
+	ASSERT_TRUE (nano_pow::passes (root, 0, 0x6b90c9aab5d66034ULL));
+	ASSERT_FALSE (nano_pow::passes (root, 0, 0x6b90c9aab5d66035ULL));
+}
+
+TEST (pow, cpp_driver_solve)
+{
+	auto root (test_root ());
+	nano_pow::cpp_driver driver (2);
+	ASSERT_EQ (2, driver.threads_get ());
+	driver.difficulty_set (0xff00000000000000ULL);
+	std::atomic<bool> stop{ false };
+	auto solution (driver.solve (root, stop));
+	ASSERT_TRUE (solution.is_initialized ());
+	ASSERT_GE (nano_pow::difficulty (root, *solution), 0xff00000000000000ULL);
+}
+
+TEST (pow, cpp_driver_cancel)
+{
+	nano_pow::cpp_driver driver (2);
+	driver.difficulty_set (std::numeric_limits<uint64_t>::max ());
+	std::atomic<bool> stop{ false };
+	std::thread canceller ([&stop] {
+		std::this_thread::sleep_for (std::chrono::milliseconds (100));
+		stop = true;
+	});
+	auto solution (driver.solve (test_root (), stop));
+	canceller.join ();
+	ASSERT_FALSE (solution.is_initialized ());
+
+	// A solve with the stop token already set returns immediately
+	ASSERT_FALSE (driver.solve (test_root (), stop).is_initialized ());
+}
+
+TEST (pow, cpp_driver_unsearched)
+{
+	nano_pow::cpp_driver driver (2);
+	driver.difficulty_set (std::numeric_limits<uint64_t>::max ());
+	std::atomic<bool> stop{ false };
+	std::thread canceller ([&stop] {
+		std::this_thread::sleep_for (std::chrono::milliseconds (100));
+		stop = true;
+	});
+	nano_pow::nonce_range const range{ 1000, 1ULL << 40 };
+	std::vector<nano_pow::nonce_range> unsearched;
+	ASSERT_FALSE (driver.solve_range (test_root (), stop, range, &unsearched).is_initialized ());
+	canceller.join ();
+
+	// Each thread reports the rest of its share, which lies within the requested range
+	ASSERT_EQ (2, unsearched.size ());
+	uint64_t remaining (0);
+	for (auto const & range_l : unsearched)
+	{
+		ASSERT_GE (range_l.begin, range.begin);
+		ASSERT_LE (range_l.begin + range_l.size, range.begin + range.size);
+		remaining += range_l.size;
+	}
+	ASSERT_GT (remaining, 0);
+	ASSERT_LT (remaining, range.size);
+}
+
+TEST (pow, cpp_driver_unsearched_full)
+{
+	// A full range stopped before any nonce was searched is left unsearched as a whole
+	for (unsigned threads : { 1, 3 })
+	{
+		nano_pow::cpp_driver driver (threads);
+		std::atomic<bool> stop{ true };
+		nano_pow::nonce_range range;
+		range.begin = 1000;
+		range.full = true;
+		std::vector<nano_pow::nonce_range> unsearched;
+		ASSERT_FALSE (driver.solve_range (test_root (), stop, range, &unsearched).is_initialized ());
+		ASSERT_EQ (threads, unsearched.size ());
+		uint64_t next (range.begin);
+		uint64_t total (0);
+		for (auto const & range_l : unsearched)
+		{
+			ASSERT_EQ (next, range_l.begin);
+			ASSERT_EQ (threads == 1, range_l.full);
+			next += range_l.size;
+			total += range_l.size;
+		}
+		ASSERT_EQ (0, total);
+	}
+}
+
+TEST (pow, cpp_driver_unsearched_solution)
+{
+	auto root (test_root ());
+	nano_pow::cpp_driver driver (1);
+	driver.difficulty_set (0xff00000000000000ULL);
+	std::atomic<bool> stop{ false };
+	nano_pow::nonce_range const range{ 1000, 1ULL << 40 };
+	std::vector<nano_pow::nonce_range> unsearched;
+	auto solution (driver.solve_range (root, stop, range, &unsearched));
+	ASSERT_TRUE (solution.is_initialized ());
+
+	// The search can resume right after a rejected solution
+	ASSERT_EQ (1, unsearched.size ());
+	ASSERT_EQ (*solution + 1, unsearched[0].begin);
+	ASSERT_EQ (range.begin + range.size, unsearched[0].begin + unsearched[0].size);
+	unsearched.clear ();
+	auto next (driver.solve_range (root, stop, nano_pow::nonce_range{ *solution + 1, range.begin + range.size - *solution - 1 }, &unsearched));
+	ASSERT_TRUE (next.is_initialized ());
+	ASSERT_GT (*next, *solution);
+}
+
+TEST (pow, cpp_driver_difficulty_change)
+{
+	auto root (test_root ());
+	nano_pow::cpp_driver driver (2);
+	driver.difficulty_set (std::numeric_limits<uint64_t>::max ());
+	std::atomic<bool> stop{ false };
+	// The running search picks up the new difficulty instead of searching until it is stopped
+	std::thread changer ([&driver] {
+		std::this_thread::sleep_for (std::chrono::milliseconds (100));
+		driver.difficulty_set (0xff00000000000000ULL);
+	});
+	auto solution (driver.solve (root, stop));
+	changer.join ();
+	ASSERT_TRUE (solution.is_initialized ());
+	ASSERT_GE (nano_pow::difficulty (root, *solution), 0xff00000000000000ULL);
+}
+
+TEST (pow, partition)
+{
+	auto const begin (std::numeric_limits<uint64_t>::max () - 10);
+	auto ranges (nano_pow::partition (begin, { 3.0, 1.0 }));
+	ASSERT_EQ (2, ranges.size ());
+	ASSERT_EQ (begin, ranges[0].begin);
+	// Ranges are contiguous, wrap around and cover all 2^64 nonces, whose count wraps around to 0
+	ASSERT_EQ (static_cast<uint64_t> (begin + ranges[0].size), ranges[1].begin);
+	ASSERT_EQ (0, static_cast<uint64_t> (ranges[0].size + ranges[1].size));
+	ASSERT_FALSE (ranges[0].full || ranges[1].full);
+	ASSERT_EQ (3ULL << 62, ranges[0].size);
+
+	// Without any weight the space is split equally
+	auto equal (nano_pow::partition (0, { 0.0, 0.0, 0.0, 0.0 }));
+	ASSERT_EQ (4, equal.size ());
+	ASSERT_EQ (equal[0].size, equal[1].size);
+	ASSERT_EQ (equal[1].size, equal[2].size);
+	ASSERT_EQ (1ULL << 62, equal[0].size);
+	ASSERT_EQ (1ULL << 62, equal[3].size);
+
+	// A single range holds every nonce
+	auto whole (nano_pow::partition (begin, { 1.0 }));
+	ASSERT_EQ (1, whole.size ());
+	ASSERT_EQ (begin, whole[0].begin);
+	ASSERT_TRUE (whole[0].full);
+}
+
+TEST (pow, kernels)
+{
+	auto root (test_root ());
+	auto words (nano_pow::to_root_words (root));
+	ASSERT_FALSE (nano_pow::supported_kernels ().empty ());
+	ASSERT_EQ (std::string ("scalar-generic"), nano_pow::supported_kernels ().back ().name);
+	for (auto const & kernel : nano_pow::supported_kernels ())
+	{
+		// Every nonce passes the lowest difficulty, so the first lane must be reported
+		uint64_t result (0);
+		ASSERT_TRUE (kernel.search (words.data (), 100, kernel.lanes, 0, result)) << kernel.name;
+		ASSERT_EQ (100, result) << kernel.name;
+
+		// Each kernel must find the same first solution as a search with the reference hash
+		uint64_t const difficulty (0xf000000000000000ULL);
+		uint64_t expected (0);
+		while (nano_pow::difficulty (root, expected) < difficulty)
+		{
+			++expected;
+		}
+		ASSERT_TRUE (kernel.search (words.data (), 0, 1024, difficulty, result)) << kernel.name;
+		ASSERT_EQ (expected, result) << kernel.name;
+
+		// A solution in the last lane of an iteration is found
+		if (kernel.lanes > 1 && expected >= kernel.lanes)
+		{
+			ASSERT_TRUE (kernel.search (words.data (), expected - kernel.lanes + 1, kernel.lanes, difficulty, result)) << kernel.name;
+			ASSERT_EQ (expected, result) << kernel.name;
+		}
+		ASSERT_FALSE (kernel.search (words.data (), 0, 16, std::numeric_limits<uint64_t>::max (), result)) << kernel.name;
+
+		// Hashing independent pairs, including a partial final group, matches the reference hash
+		std::vector<nano_pow::root> roots;
+		std::vector<uint64_t> pair_words;
+		std::vector<uint64_t> nonces;
+		for (unsigned i = 0; i < 37; ++i)
+		{
+			roots.push_back (root);
+			roots.back ()[i % 32] ^= static_cast<uint8_t> (i + 1);
+			auto const root_words (nano_pow::to_root_words (roots.back ()));
+			pair_words.insert (pair_words.end (), root_words.begin (), root_words.end ());
+			nonces.push_back (0x123456789abcdef0ULL * (i + 1));
+		}
+		std::vector<uint64_t> values (nonces.size ());
+		kernel.values (pair_words.data (), nonces.data (), nonces.size (), values.data ());
+		for (size_t i = 0; i < nonces.size (); ++i)
+		{
+			ASSERT_EQ (nano_pow::difficulty (roots[i], nonces[i]), values[i]) << kernel.name << " pair " << i;
+		}
+
+		nano_pow::cpp_driver driver (1, kernel);
+		driver.difficulty_set (difficulty);
+		std::atomic<bool> stop{ false };
+		auto solution (driver.solve (root, stop));
+		ASSERT_TRUE (solution.is_initialized ()) << kernel.name;
+		ASSERT_GE (nano_pow::difficulty (root, *solution), difficulty) << kernel.name;
+	}
+}
+
+TEST (pow, siphash)
+{
+	// Reference test vector for an 8 byte message with key 000102...0f
+	nano_pow::table_key key{ { 0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL } };
+	ASSERT_EQ (0x93f5f5799a932462ULL, nano_pow::siphash (key, 0x0706050403020100ULL));
+}
+
+TEST (pow, arena)
+{
+	nano_pow::arena arena (3 * 1024 * 1024 + 1);
+	ASSERT_GE (arena.size (), 3 * 1024 * 1024 + 1);
+	auto data (static_cast<uint8_t *> (arena.data ()));
+	ASSERT_EQ (0, data[0]);
+	ASSERT_EQ (0, data[arena.size () - 1]);
+	data[0] = 1;
+	data[arena.size () - 1] = 1;
+	ASSERT_FALSE (arena.pages_as_string ().empty ());
+}
+
+TEST (pow, table_driver_solve)
+{
+	auto root (test_root ());
+	nano_pow::table_driver driver (2);
+	driver.memory_set (1024 * 1024);
+	// Brute force would need about 2^40 attempts, while the table needs about 2^22 lookups
+	uint64_t const difficulty (0xffffffffff000000ULL);
+	driver.difficulty_set (difficulty);
+	std::atomic<bool> stop{ false };
+	auto solution (driver.solve (root, stop));
+	ASSERT_TRUE (solution.is_initialized ());
+	ASSERT_GE (nano_pow::table_difficulty (root, *solution), difficulty);
+	ASSERT_GT (driver.hashrate (), 0);
+
+	// Another search for the same root uses the table as it is filled
+	solution = driver.solve (root, stop);
+	ASSERT_TRUE (solution.is_initialized ());
+	ASSERT_GE (nano_pow::table_difficulty (root, *solution), difficulty);
+
+	// The table is reused for another root
+	root[0] ^= 1;
+	driver.difficulty_set (0xfff0000000000000ULL);
+	solution = driver.solve (root, stop);
+	ASSERT_TRUE (solution.is_initialized ());
+	ASSERT_GE (nano_pow::table_difficulty (root, *solution), 0xfff0000000000000ULL);
+
+	// Too little memory for a table
+	nano_pow::table_driver small (1);
+	small.memory_set (1024);
+	ASSERT_THROW (small.solve (root, stop), std::runtime_error);
+}
@@ -1,8 +1,14 @@
 #include <gtest/gtest.h>
 
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/property_tree/json_parser.hpp>
 
+#include <cmath>
+#include <future>
 #include <iostream>
+#include <set>
 #include <vector>
 
 #include <workserver/util.hpp>
@@ -38,34 +44,38 @@ TEST (queue, priority)
 
 	constexpr unsigned count = 10;
 	constexpr unsigned count_priority_boosted = 4;
-	std::vector<nano_pow_server::job> jobs (count);
+	std::vector<nano_pow_server::job_handle> jobs (count);
+	for (auto & job : jobs)
+	{
+		job = std::make_shared<nano_pow_server::job> ();
+	}
 	for (unsigned i = 0; i < count; i++)
 	{
-		jobs[i].request.root_hash = nano_pow_server::u256 (i);
+		jobs[i]->request.root_hash = nano_pow_server::u256 (i);
 
 		// Increase priority on the last N items, make sure they're sorted first,
 		// yet stable-sorted on job id (i.e. jobs are FIFO within priority)
-		jobs[i].set_priority (i >= (count - count_priority_boosted) ? 100 : i);
+		jobs[i]->set_priority (i >= (count - count_priority_boosted) ? 100 : i);
 		handler.push_job (jobs[i]);
 	}
 
 	unsigned prev_id = 0;
 	for (unsigned i = 0; i < count; i++)
 	{
-		auto job (*handler.pop_job ());
+		auto job (handler.pop_job ());
 		if (i < count_priority_boosted)
 		{
-			ASSERT_EQ (100, job.get_priority ());
+			ASSERT_EQ (100, job->get_priority ());
 			if (i > 0)
 			{
-				ASSERT_GT (job.get_job_id (), prev_id);
+				ASSERT_GT (job->get_job_id (), prev_id);
 			}
 		}
 		else
 		{
-			ASSERT_GT (100, job.get_priority ());
+			ASSERT_GT (100, job->get_priority ());
 		}
-		prev_id = job.get_job_id ();
+		prev_id = job->get_job_id ();
 	}
 }
 
@@ -75,10 +85,14 @@ TEST (queue, remove)
 	nano_pow_server::work_handler handler (config, nullptr);
 
 	constexpr unsigned count = 10;
-	std::vector<nano_pow_server::job> jobs (count);
+	std::vector<nano_pow_server::job_handle> jobs (count);
+	for (auto & job : jobs)
+	{
+		job = std::make_shared<nano_pow_server::job> ();
+	}
 	for (unsigned i = 0; i < count; i++)
 	{
-		jobs[i].request.root_hash = nano_pow_server::u256 (i);
+		jobs[i]->request.root_hash = nano_pow_server::u256 (i);
 		handler.push_job (jobs[i]);
 	}
 
@@ -87,6 +101,1313 @@ TEST (queue, remove)
 	ASSERT_EQ (handler.get_queue ().size (), 9);
 }
 
+TEST (queue, index)
+{
+	nano_pow_server::job_queue queue;
+	std::vector<nano_pow_server::job_handle> jobs (6);
+	for (auto & job : jobs)
+	{
+		job = std::make_shared<nano_pow_server::job> ();
+	}
+	for (unsigned i = 0; i < jobs.size (); i++)
+	{
+		jobs[i]->request.root_hash = nano_pow_server::u256 (i % 3);
+		jobs[i]->set_priority (i % 2);
+		ASSERT_TRUE (queue.push (jobs[i]));
+	}
+	ASSERT_FALSE (queue.push (jobs[0]));
+	ASSERT_TRUE (queue.contains (nano_pow_server::u256 (2)));
+	ASSERT_FALSE (queue.contains (nano_pow_server::u256 (3)));
+	ASSERT_EQ (nano_pow_server::u256 (1), queue.find (nano_pow_server::u256 (1))->request.root_hash);
+
+	// Both jobs for root 1 are removed, the rest keep their priority and FIFO order
+	ASSERT_EQ (2, queue.remove (nano_pow_server::u256 (1)).size ());
+	ASSERT_FALSE (queue.contains (nano_pow_server::u256 (1)));
+	ASSERT_EQ (4, queue.size ());
+	std::vector<unsigned> expected{ jobs[3]->get_job_id (), jobs[5]->get_job_id (), jobs[0]->get_job_id (), jobs[2]->get_job_id () };
+	std::vector<unsigned> iterated;
+	for (auto const & job : queue)
+	{
+		iterated.push_back (job->get_job_id ());
+	}
+	ASSERT_EQ (expected, iterated);
+	for (auto id : expected)
+	{
+		ASSERT_EQ (id, queue.pop ()->get_job_id ());
+	}
+	ASSERT_EQ (nullptr, queue.pop ());
+	ASSERT_TRUE (queue.empty ());
+}
+
+TEST (queue, deadline)
+{
+	nano_pow_server::job_queue queue;
+	auto const now (std::chrono::system_clock::now ());
+	std::vector<nano_pow_server::job_handle> jobs (4);
+	for (auto & job : jobs)
+	{
+		job = std::make_shared<nano_pow_server::job> ();
+	}
+	jobs[0]->set_deadline (now + std::chrono::seconds (3));
+	jobs[2]->set_deadline (now + std::chrono::seconds (1));
+	jobs[3]->set_deadline (now + std::chrono::seconds (2));
+	jobs[3]->set_priority (1);
+	for (auto & job : jobs)
+	{
+		ASSERT_TRUE (queue.push (job));
+	}
+
+	// Earliest deadline first within a priority, and jobs without a deadline last
+	for (auto i : { 3, 2, 0, 1 })
+	{
+		ASSERT_EQ (jobs[i]->get_job_id (), queue.pop ()->get_job_id ());
+	}
+
+	// Only the waiters past their deadline expire, and the job is closed once none is left
+	nano_pow_server::job job;
+	job.attach ({ boost::none, [](std::string) {}, now - std::chrono::seconds (1) }, job.request.difficulty, 1.0);
+	job.attach ({ boost::none, [](std::string) {}, now + std::chrono::seconds (1) }, job.request.difficulty, 1.0);
+	ASSERT_EQ (1, job.expire (now).size ());
+	ASSERT_FALSE (job.closed ());
+	ASSERT_EQ (1, job.expire (now + std::chrono::seconds (2)).size ());
+	ASSERT_TRUE (job.closed ());
+}
+
+TEST (queue, fair)
+{
+	nano_pow_server::client_rounds rounds;
+	nano_pow_server::job_queue queue;
+	auto push = [&](std::string const & client_a, unsigned weight_a) {
+		auto job (std::make_shared<nano_pow_server::job> ());
+		job->set_client (client_a);
+		job->set_round (rounds.assign (client_a, weight_a));
+		queue.push (job);
+	};
+
+	// A burst from one client does not hold up the jobs of a client queued after it
+	for (int i = 0; i < 100; ++i)
+	{
+		push ("flood", 1);
+	}
+	push ("wallet", 2);
+	push ("wallet", 2);
+	push ("wallet", 2);
+	std::vector<std::string> dispatched;
+	for (int i = 0; i < 4; ++i)
+	{
+		auto job (queue.pop ());
+		rounds.dispatched (job->get_round ());
+		dispatched.push_back (job->get_client ());
+	}
+	std::vector<std::string> expected{ "flood", "wallet", "wallet", "flood" };
+	ASSERT_EQ (expected, dispatched);
+	ASSERT_EQ ("wallet", queue.pop ()->get_client ());
+
+	// An idle client joins the current round instead of the round it left off at
+	ASSERT_EQ (rounds.current (), rounds.assign ("idle", 1));
+	rounds.dispatched (10);
+	ASSERT_EQ (10, rounds.assign ("idle", 1));
+}
+
+TEST (queue, sharded)
+{
+	constexpr unsigned producers = 4;
+	constexpr unsigned per_producer = 500;
+	nano_pow_server::sharded_job_queue queue (producers * per_producer);
+	auto no_attach = [](nano_pow_server::job_handle const &) { return false; };
+
+	std::vector<std::thread> threads;
+	for (unsigned p = 0; p < producers; ++p)
+	{
+		threads.emplace_back ([&queue, &no_attach, p]() {
+			for (unsigned i = 0; i < per_producer; ++i)
+			{
+				auto job (std::make_shared<nano_pow_server::job> ());
+				job->request.root_hash = nano_pow_server::u256 (p * per_producer + i);
+				job->set_priority (i % 3);
+				queue.push (job, no_attach);
+			}
+		});
+	}
+	for (auto & thread : threads)
+	{
+		thread.join ();
+	}
+	ASSERT_EQ (producers * per_producer, queue.size ());
+	// At difficulty zero, every job is solved by its first attempt
+	ASSERT_DOUBLE_EQ (producers * per_producer, queue.attempts ());
+
+	// The queue is full, and a request for a queued root is offered the queued job
+	auto extra (std::make_shared<nano_pow_server::job> ());
+	extra->request.root_hash = nano_pow_server::u256 (7);
+	ASSERT_EQ (nano_pow_server::sharded_job_queue::push_result::full, queue.push (extra, no_attach));
+	bool offered (false);
+	ASSERT_EQ (nano_pow_server::sharded_job_queue::push_result::attached, queue.push (extra, [&offered](nano_pow_server::job_handle const & queued_a) {
+		offered = queued_a != nullptr;
+		return true;
+	}));
+	ASSERT_TRUE (offered);
+
+	// Jobs from all shards come out in priority order, and FIFO within a priority
+	ASSERT_EQ (producers * per_producer, queue.jobs ().size ());
+	auto previous (queue.pop ());
+	for (unsigned i = 1; i < producers * per_producer; ++i)
+	{
+		auto next (queue.pop ());
+		ASSERT_NE (nullptr, next);
+		ASSERT_FALSE (nano_pow_server::job::comparator () (*previous, *next));
+		previous = next;
+	}
+	ASSERT_EQ (nullptr, queue.pop ());
+	ASSERT_EQ (0, queue.size ());
+	ASSERT_DOUBLE_EQ (0, queue.attempts ());
+}
+
+TEST (queue, registry)
+{
+	nano_pow_server::job_registry registry (2);
+	std::vector<nano_pow_server::job_handle> jobs;
+	for (unsigned i = 0; i < 4; ++i)
+	{
+		jobs.push_back (registry.create ());
+		jobs.back ()->request.root_hash = nano_pow_server::u256 (i % 3);
+		registry.add (jobs.back ());
+	}
+	ASSERT_EQ (4, registry.size ());
+	ASSERT_EQ (jobs[1], registry.find (jobs[1]->get_job_id ()));
+	// The latest job for a root is found by the root, and an earlier one ending does not hide it
+	ASSERT_EQ (jobs[3], registry.find (jobs[0]->request.root_hash));
+	registry.remove (*jobs[0]);
+	ASSERT_EQ (jobs[3], registry.find (jobs[0]->request.root_hash));
+	ASSERT_EQ (nullptr, registry.find (jobs[0]->get_job_id ()));
+
+	// Solved jobs stay indexed until they leave the history
+	registry.complete (jobs[1]);
+	registry.complete (jobs[2]);
+	ASSERT_EQ (jobs[1], registry.find (nano_pow_server::u256 (1)));
+	registry.complete (jobs[3]);
+	ASSERT_EQ (nullptr, registry.find (nano_pow_server::u256 (1)));
+	ASSERT_EQ (nullptr, registry.find (jobs[1]->get_job_id ()));
+	auto const history (registry.history ());
+	std::vector<nano_pow_server::job_handle> expected{ jobs[2], jobs[3] };
+	ASSERT_EQ (expected, history);
+
+	// Released records are reused instead of growing the slab
+	nano_pow_server::slab_allocator<nano_pow_server::job> allocator (std::make_shared<nano_pow_server::slab> (4));
+	for (int i = 0; i < 100; ++i)
+	{
+		auto job (std::allocate_shared<nano_pow_server::job> (allocator));
+	}
+	ASSERT_EQ (4, allocator.slab->capacity ());
+}
+
+TEST (queue, journal)
+{
+	auto const path ((boost::filesystem::temp_directory_path () / boost::filesystem::unique_path ()).string ());
+	std::vector<nano_pow_server::job_handle> jobs;
+	{
+		nano_pow_server::job_journal journal (path, 2);
+		for (unsigned i = 0; i < 1500; ++i)
+		{
+			jobs.push_back (std::make_shared<nano_pow_server::job> ());
+			jobs.back ()->request.root_hash = nano_pow_server::u256 (i + 1);
+			jobs.back ()->set_client ("client");
+			journal.enqueued (*jobs.back ());
+		}
+		// The journal is compacted and grown in the background once it is half full
+		auto const timeout (std::chrono::steady_clock::now () + std::chrono::seconds (10));
+		while (journal.capacity () <= 1024 && std::chrono::steady_clock::now () < timeout)
+		{
+			std::this_thread::sleep_for (std::chrono::milliseconds (1));
+		}
+		ASSERT_LT (1024, journal.capacity ());
+		// A queued job raised by a coalesced request is restored as raised
+		jobs[1]->request.difficulty = nano_pow_server::u128 ("fff0000000000000");
+		jobs[1]->set_priority (2);
+		journal.updated (*jobs[1]);
+		journal.dispatched (*jobs[1]);
+		jobs[0]->result.work = nano_pow_server::u128 ("2feaeaa000000000");
+		journal.completed (*jobs[0]);
+		for (unsigned i = 2; i < jobs.size (); ++i)
+		{
+			journal.cancelled (*jobs[i]);
+		}
+	}
+
+	// Replaying the journal restores the pending and solved jobs
+	nano_pow_server::job_journal journal (path, 2);
+	auto const pending (journal.pending ());
+	ASSERT_EQ (1, pending.size ());
+	ASSERT_EQ (jobs[1]->get_job_id (), pending.front ().job_id);
+	ASSERT_EQ (jobs[1]->request.root_hash, pending.front ().root_hash);
+	ASSERT_EQ ("client", pending.front ().client);
+	ASSERT_EQ (0xfff0000000000000, pending.front ().difficulty.number ());
+	ASSERT_EQ (2, pending.front ().priority);
+	ASSERT_TRUE (pending.front ().dispatched);
+	auto const solved (journal.solved ());
+	ASSERT_EQ (1, solved.size ());
+	ASSERT_EQ (jobs[0]->result.work, solved.front ().work);
+
+	// Events of jobs that are not pending are ignored
+	journal.completed (*jobs[2]);
+	ASSERT_EQ (1, journal.solved ().size ());
+	boost::filesystem::remove (path);
+}
+
+namespace
+{
+boost::property_tree::ptree parse (std::string const & json_a)
+{
+	std::stringstream istream (json_a);
+	boost::property_tree::ptree tree;
+	boost::property_tree::read_json (istream, tree);
+	return tree;
+}
+
+/** Returns the number of jobs in the given section of the queue request output */
+size_t queue_count (nano_pow_server::work_handler & handler_a, std::string const & section_a)
+{
+	size_t count (0);
+	handler_a.handle_queue_request ([&count, &section_a](std::string response) {
+		count = parse (response).get_child (section_a).size ();
+	});
+	return count;
+}
+}
+
+TEST (queue, cancel_active)
+{
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	// The maximum difficulty keeps the device busy until the job is cancelled
+	std::promise<std::string> generate_response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": "ffffffffffffffff", "id": "1"})",
+	    [&generate_response](std::string response) { generate_response.set_value (response); });
+	while (queue_count (handler, "active") == 0)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (1));
+	}
+
+	std::string cancel_response;
+	handler.handle_request_async (R"({"action": "work_cancel", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "id": "2"})",
+	    [&cancel_response](std::string response) { cancel_response = response; });
+	ASSERT_EQ ("cancelled", parse (cancel_response).get<std::string> ("status"));
+
+	auto future (generate_response.get_future ());
+	ASSERT_EQ (std::future_status::ready, future.wait_for (std::chrono::seconds (10)));
+	auto response (parse (future.get ()));
+	ASSERT_EQ ("cancelled", response.get<std::string> ("status"));
+	ASSERT_EQ ("1", response.get<std::string> ("id"));
+	ASSERT_EQ (0, queue_count (handler, "active"));
+}
+
+TEST (queue, split)
+{
+	nano_pow_server::config config;
+	config.work.split_multiplier = 1.0;
+	for (int i = 0; i < 2; ++i)
+	{
+		config.devices.emplace_back ();
+		config.devices.back ().threads = 1;
+	}
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	std::promise<std::string> generate_response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": "fff0000000000000", "id": "1"})",
+	    [&generate_response](std::string response) { generate_response.set_value (response); });
+
+	auto future (generate_response.get_future ());
+	ASSERT_EQ (std::future_status::ready, future.wait_for (std::chrono::seconds (30)));
+	auto response (parse (future.get ()));
+	ASSERT_EQ ("1", response.get<std::string> ("id"));
+	nano_pow_server::u128 work;
+	work.from_hex (response.get<std::string> ("work"));
+	nano_pow_server::u256 root ("718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2");
+	ASSERT_TRUE (nano_pow::passes (root.bytes, static_cast<uint64_t> (work.number ()), 0xfff0000000000000));
+	ASSERT_EQ (0, queue_count (handler, "active"));
+}
+
+TEST (queue, steal)
+{
+	nano_pow_server::config config;
+	for (int i = 0; i < 2; ++i)
+	{
+		config.devices.emplace_back ();
+		config.devices.back ().threads = 1;
+	}
+	config.work.device_queue = 16;
+	config.cache.size = 0;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	// Requests at the maximum difficulty keep a device busy until cancelled
+	auto generate = [&handler](std::string const & hash_a, std::string const & difficulty_a, std::promise<std::string> & response_a) {
+		handler.handle_request_async (R"({"action": "work_generate", "hash": ")" + hash_a + R"(", "difficulty": ")" + difficulty_a + R"("})",
+		    [&response_a](std::string response) { response_a.set_value (response); });
+	};
+	auto cancel = [&handler](std::string const & hash_a) {
+		handler.handle_request_async (R"({"action": "work_cancel", "hash": ")" + hash_a + R"("})", [](std::string) {});
+	};
+	auto wait_active = [&handler](size_t count_a) {
+		while (queue_count (handler, "active") != count_a)
+		{
+			std::this_thread::sleep_for (std::chrono::milliseconds (1));
+		}
+	};
+	std::string const blocker1 ("2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C");
+	std::string const blocker2 ("718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2");
+	std::string const blocker3 ("4A1D5F1E6B2C8A9D0E3F7B6C5A4D3E2F1A0B9C8D7E6F5A4B3C2D1E0F9A8B7C6D");
+	std::promise<std::string> blocker1_response, blocker2_response, blocker3_response, response1, response2;
+	generate (blocker1, "ffffffffffffffff", blocker1_response);
+	wait_active (1);
+	generate (blocker2, "ffffffffffffffff", blocker2_response);
+	wait_active (2);
+
+	// Once the first device is free it takes all three queued jobs, and runs the blocker first
+	generate (blocker3, "ffffffffffffffff", blocker3_response);
+	generate ("0000000000000000000000000000000000000000000000000000000000000001", "8000000000000000", response1);
+	generate ("0000000000000000000000000000000000000000000000000000000000000002", "8000000000000000", response2);
+	ASSERT_EQ (3, queue_count (handler, "queued"));
+	cancel (blocker1);
+	ASSERT_EQ (std::future_status::ready, blocker1_response.get_future ().wait_for (std::chrono::seconds (10)));
+	wait_active (2);
+	auto const & devices (handler.get_devices ());
+	ASSERT_EQ (2, devices[0].local_size () + devices[1].local_size ());
+	ASSERT_EQ (0, handler.get_queue ().size ());
+
+	// The second device steals both local jobs while the first is still busy
+	cancel (blocker2);
+	ASSERT_EQ (std::future_status::ready, blocker2_response.get_future ().wait_for (std::chrono::seconds (10)));
+	for (auto & promise : { std::ref (response1), std::ref (response2) })
+	{
+		auto future (promise.get ().get_future ());
+		ASSERT_EQ (std::future_status::ready, future.wait_for (std::chrono::seconds (30)));
+		ASSERT_TRUE (parse (future.get ()).get_optional<std::string> ("work").is_initialized ());
+	}
+	auto blocker3_future (blocker3_response.get_future ());
+	ASSERT_EQ (std::future_status::timeout, blocker3_future.wait_for (std::chrono::seconds (0)));
+	cancel (blocker3);
+	ASSERT_EQ (std::future_status::ready, blocker3_future.wait_for (std::chrono::seconds (10)));
+}
+
+TEST (queue, expire)
+{
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	// A deadline that has already passed is rejected right away
+	std::promise<std::string> past_response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "deadline_ms": "1000"})",
+	    [&past_response](std::string response) { past_response.set_value (response); });
+	ASSERT_EQ ("Work request expired", parse (past_response.get_future ().get ()).get<std::string> ("error"));
+
+	// Keeps the only device busy until the queued request has expired
+	std::promise<std::string> blocker_response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C", "difficulty": "ffffffffffffffff"})",
+	    [&blocker_response](std::string response) { blocker_response.set_value (response); });
+	while (queue_count (handler, "active") == 0)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (1));
+	}
+
+	std::promise<std::string> response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "timeout": "50", "id": "1"})",
+	    [&response](std::string response_a) { response.set_value (response_a); });
+	ASSERT_EQ (1, queue_count (handler, "queued"));
+	std::this_thread::sleep_for (std::chrono::milliseconds (100));
+	handler.handle_request_async (R"({"action": "work_cancel", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C"})", [](std::string) {});
+	ASSERT_EQ (std::future_status::ready, blocker_response.get_future ().wait_for (std::chrono::seconds (10)));
+
+	auto future (response.get_future ());
+	ASSERT_EQ (std::future_status::ready, future.wait_for (std::chrono::seconds (10)));
+	auto expired (parse (future.get ()));
+	ASSERT_EQ ("Work request expired", expired.get<std::string> ("error"));
+	ASSERT_EQ ("1", expired.get<std::string> ("id"));
+	ASSERT_EQ (0, queue_count (handler, "queued"));
+	ASSERT_EQ (0, queue_count (handler, "active"));
+}
+
+TEST (queue, shortest)
+{
+	ASSERT_DOUBLE_EQ (1.0, nano_pow_server::expected_attempts (nano_pow_server::u128 ("0")));
+	ASSERT_DOUBLE_EQ (4096.0, nano_pow_server::expected_attempts (nano_pow_server::u128 ("fff0000000000000")));
+	ASSERT_DOUBLE_EQ (18446744073709551616.0, nano_pow_server::expected_attempts (nano_pow_server::u128 ("ffffffffffffffff")));
+	ASSERT_TRUE (std::isinf (nano_pow_server::expected_attempts (nano_pow_server::u128 ("10000000000000000"))));
+
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	config.work.scheduling = nano_pow_server::config::work::scheduling_policy::shortest;
+	config.cache.size = 0;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	std::mutex mutex;
+	std::vector<std::string> answered;
+	std::promise<void> done;
+	auto generate = [&](std::string const & hash_a, std::string const & difficulty_a, std::string const & id_a) {
+		handler.handle_request_async (R"({"action": "work_generate", "hash": ")" + hash_a + R"(", "difficulty": ")" + difficulty_a + R"(", "id": ")" + id_a + R"("})",
+		    [&](std::string response) {
+			    std::lock_guard<std::mutex> lk (mutex);
+			    answered.push_back (parse (response).get<std::string> ("id"));
+			    if (answered.size () == 3)
+			    {
+				    done.set_value ();
+			    }
+		    });
+	};
+
+	// Keeps the only device busy while the other jobs are queued
+	generate ("2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C", "ffffffffffffffff", "blocker");
+	while (queue_count (handler, "active") == 0)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (1));
+	}
+	generate ("718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "fff0000000000000", "expensive");
+	generate ("0000000000000000000000000000000000000000000000000000000000000001", "8000000000000000", "cheap");
+	handler.handle_request_async (R"({"action": "work_cancel", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C"})", [](std::string) {});
+
+	// The cheaper job is dispatched first, although it was queued later
+	ASSERT_EQ (std::future_status::ready, done.get_future ().wait_for (std::chrono::seconds (30)));
+	std::vector<std::string> expected{ "blocker", "cheap", "expensive" };
+	ASSERT_EQ (expected, answered);
+}
+
+TEST (queue, aging)
+{
+	nano_pow_server::job_queue queue;
+	auto const now (std::chrono::system_clock::now ());
+	std::vector<nano_pow_server::job_handle> jobs (4);
+	for (auto & job : jobs)
+	{
+		job = std::make_shared<nano_pow_server::job> ();
+	}
+	jobs[0]->set_priority (0);
+	jobs[0]->queued_time = now - std::chrono::seconds (100);
+	jobs[1]->set_priority (2);
+	jobs[2]->set_priority (3);
+	jobs[3]->set_priority (0);
+	for (auto & job : jobs)
+	{
+		job->set_aging (0.1, 3);
+		ASSERT_TRUE (queue.push (job));
+	}
+
+	// After 100 seconds at 0.1 levels per second, the first job ranks above priority 2, but not above the cap
+	for (auto i : { 2, 0, 1, 3 })
+	{
+		ASSERT_EQ (jobs[i]->get_job_id (), queue.pop ()->get_job_id ());
+	}
+
+	// Dispatched jobs are counted in the wait statistics of their priority
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+	std::promise<std::string> response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": "8000000000000000"})",
+	    [&response](std::string response_a) { response.set_value (response_a); });
+	ASSERT_EQ (std::future_status::ready, response.get_future ().wait_for (std::chrono::seconds (10)));
+	std::promise<std::string> queue_response;
+	handler.handle_queue_request ([&queue_response](std::string response_a) { queue_response.set_value (response_a); });
+	auto waits (parse (queue_response.get_future ().get ()).get_child ("wait"));
+	ASSERT_EQ (1, waits.size ());
+	ASSERT_EQ (0, waits.front ().second.get<unsigned> ("priority"));
+	ASSERT_EQ (1, waits.front ().second.get<unsigned> ("count"));
+}
+
+TEST (queue, aging_default_cap)
+{
+	// Under the default cap, every priority a request can ask for ages
+	nano_pow_server::config config;
+	nano_pow_server::job_queue queue;
+	auto const now (std::chrono::system_clock::now ());
+	auto low (std::make_shared<nano_pow_server::job> ());
+	low->set_priority (0);
+	low->queued_time = now;
+	low->set_aging (1.0, config.server.priority_aging_cap);
+	ASSERT_TRUE (queue.push (low));
+
+	// A continuous stream of priority 1 requests, one per second, only holds back the priority 0 request for a second
+	unsigned dispatched (0);
+	for (; dispatched < 10; ++dispatched)
+	{
+		auto high (std::make_shared<nano_pow_server::job> ());
+		high->set_priority (1);
+		high->queued_time = now + std::chrono::seconds (dispatched);
+		high->set_aging (1.0, config.server.priority_aging_cap);
+		ASSERT_TRUE (queue.push (high));
+		if (queue.pop () == low)
+		{
+			break;
+		}
+	}
+	ASSERT_EQ (1, dispatched);
+}
+
+TEST (queue, deadline_flood)
+{
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	config.cache.size = 0;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	std::promise<std::string> blocker_response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C", "difficulty": "ffffffffffffffff"})",
+	    [&blocker_response](std::string response) { blocker_response.set_value (response); });
+	while (queue_count (handler, "active") == 0)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (1));
+	}
+
+	std::mutex mutex;
+	std::vector<std::string> answered;
+	std::promise<void> done;
+	auto generate = [&](std::string const & hash_a, std::string const & extra_a, std::string const & id_a, std::string const & client_a) {
+		handler.handle_request_async (R"({"action": "work_generate", "hash": ")" + hash_a + R"(", "difficulty": "8000000000000000", )" + extra_a + R"("id": ")" + id_a + R"("})",
+		    [&](std::string response) {
+			    std::lock_guard<std::mutex> lk (mutex);
+			    answered.push_back (parse (response).get<std::string> ("id"));
+			    if (answered.size () == 5)
+			    {
+				    done.set_value ();
+			    }
+		    },
+		    client_a);
+	};
+
+	// One client floods the queue with requests that all have a deadline. The deadlines do not move its jobs out of
+	// their rounds, so the other client's job without a deadline is still worked on in the first round.
+	for (unsigned i = 0; i < 4; ++i)
+	{
+		nano_pow_server::u256 root (i + 1);
+		generate (root.to_hex (), R"("timeout": ")" + std::to_string (30000 - i * 1000) + R"(", )", "flood" + std::to_string (i), "flood");
+	}
+	generate ("718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "", "other", "other");
+	handler.handle_request_async (R"({"action": "work_cancel", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C"})", [](std::string) {});
+	ASSERT_EQ (std::future_status::ready, done.get_future ().wait_for (std::chrono::seconds (10)));
+	ASSERT_EQ ((std::vector<std::string>{ "flood0", "other", "flood1", "flood2", "flood3" }), answered);
+}
+
+TEST (queue, preempt)
+{
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	config.server.allow_prioritization = true;
+	config.work.preemption = true;
+	config.cache.size = 0;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	std::promise<std::string> low_response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C", "difficulty": "ffffffffffffffff", "priority": "0"})",
+	    [&low_response](std::string response) { low_response.set_value (response); });
+	while (queue_count (handler, "active") == 0)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (1));
+	}
+
+	// The urgent request takes over the only device, and the preempted request is queued again
+	std::promise<std::string> urgent_response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": "8000000000000000", "priority": "1"})",
+	    [&urgent_response](std::string response) { urgent_response.set_value (response); });
+	auto urgent_future (urgent_response.get_future ());
+	ASSERT_EQ (std::future_status::ready, urgent_future.wait_for (std::chrono::seconds (10)));
+	ASSERT_EQ (1, parse (urgent_future.get ()).count ("work"));
+	auto low_future (low_response.get_future ());
+	ASSERT_EQ (std::future_status::timeout, low_future.wait_for (std::chrono::milliseconds (0)));
+
+	// The resumed request can still be cancelled
+	while (queue_count (handler, "active") == 0)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (1));
+	}
+	handler.handle_request_async (R"({"action": "work_cancel", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C"})", [](std::string) {});
+	ASSERT_EQ (std::future_status::ready, low_future.wait_for (std::chrono::seconds (10)));
+	ASSERT_EQ ("cancelled", parse (low_future.get ()).get<std::string> ("status"));
+
+	// The resumed request only waited in the queue once, before it was first dispatched
+	std::promise<std::string> queue_response;
+	handler.handle_queue_request ([&queue_response](std::string response_a) { queue_response.set_value (response_a); });
+	auto waits (parse (queue_response.get_future ().get ()).get_child ("wait"));
+	ASSERT_EQ (2, waits.size ());
+	for (auto const & wait : waits)
+	{
+		ASSERT_EQ (1, wait.second.get<unsigned> ("count"));
+	}
+}
+
+TEST (queue, preempt_idle)
+{
+	nano_pow_server::config config;
+	for (auto i (0); i < 2; ++i)
+	{
+		config.devices.emplace_back ();
+		config.devices.back ().threads = 1;
+	}
+	config.server.allow_prioritization = true;
+	config.work.preemption = true;
+	config.cache.size = 0;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	auto generate = [&handler](std::string const & hash_a, std::string const & difficulty_a, unsigned priority_a) {
+		auto response (std::make_shared<std::promise<std::string>> ());
+		handler.handle_request_async (boost::str (boost::format (R"({"action": "work_generate", "hash": "%1%", "difficulty": "%2%", "priority": "%3%"})") % hash_a % difficulty_a % priority_a),
+		    [response](std::string response_a) { response->set_value (response_a); });
+		return response->get_future ();
+	};
+	auto cancel = [&handler](std::string const & hash_a) {
+		handler.handle_request_async (R"({"action": "work_cancel", "hash": ")" + hash_a + R"("})", [](std::string) {});
+	};
+	auto wait_active = [&handler](size_t count_a) {
+		auto const timeout (std::chrono::steady_clock::now () + std::chrono::seconds (10));
+		while (queue_count (handler, "active") != count_a && std::chrono::steady_clock::now () < timeout)
+		{
+			std::this_thread::sleep_for (std::chrono::milliseconds (1));
+		}
+		return queue_count (handler, "active");
+	};
+
+	// A device freed by a cancellation while the other is preempted races for the requeued job. Whichever device
+	// runs it, it stays active and can be cancelled.
+	for (unsigned i = 0; i < 10; ++i)
+	{
+		auto const hash_a (boost::str (boost::format ("%064X") % (3 * i + 1)));
+		auto const hash_b (boost::str (boost::format ("%064X") % (3 * i + 2)));
+		auto const hash_urgent (boost::str (boost::format ("%064X") % (3 * i + 3)));
+		auto low_a (generate (hash_a, "ffffffffffffffff", 0));
+		auto low_b (generate (hash_b, "ffffffffffffffff", 0));
+		ASSERT_EQ (2, wait_active (2));
+		auto urgent (generate (hash_urgent, "8000000000000000", 1));
+		cancel (hash_b);
+		ASSERT_EQ (std::future_status::ready, urgent.wait_for (std::chrono::seconds (10)));
+		ASSERT_EQ (std::future_status::ready, low_b.wait_for (std::chrono::seconds (10)));
+		ASSERT_EQ (1, wait_active (1));
+		cancel (hash_a);
+		ASSERT_EQ (std::future_status::ready, low_a.wait_for (std::chrono::seconds (10)));
+		ASSERT_EQ ("cancelled", parse (low_a.get ()).get<std::string> ("status"));
+		ASSERT_EQ (0, wait_active (0));
+	}
+}
+
+TEST (queue, admission)
+{
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	config.server.admission_control = true;
+	config.cache.size = 0;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	// Requests are admitted until the devices have measured their hashrate
+	std::promise<std::string> first_response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": "8000000000000000"})",
+	    [&first_response](std::string response) { first_response.set_value (response); });
+	ASSERT_EQ (std::future_status::ready, first_response.get_future ().wait_for (std::chrono::seconds (10)));
+
+	std::promise<std::string> blocker_response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C", "difficulty": "ffffffffffffffff"})",
+	    [&blocker_response](std::string response) { blocker_response.set_value (response); });
+	while (queue_count (handler, "active") == 0)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (1));
+	}
+
+	// The active job cannot be solved before the deadline, so the request is rejected with an estimate
+	std::string rejection;
+	std::chrono::seconds retry_after (0);
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "0CF0CB1C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2AB", "difficulty": "8000000000000000", "timeout": "60000"})",
+	    [](std::string) { FAIL (); }, "", [&rejection, &retry_after](std::string response, std::chrono::seconds retry_after_a) {
+		    rejection = response;
+		    retry_after = retry_after_a;
+	    });
+	auto response (parse (rejection));
+	ASSERT_EQ ("Work server overloaded", response.get<std::string> ("error"));
+	ASSERT_GT (response.get<uint64_t> ("eta_ms"), 60000);
+	ASSERT_EQ (retry_after.count (), response.get<int64_t> ("retry_after"));
+	ASSERT_GE (retry_after.count (), 1);
+	ASSERT_EQ (0, handler.get_queue ().size ());
+
+	// A request that an existing job answers is attached regardless
+	std::promise<std::string> attached_response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C", "difficulty": "ffffffffffffffff", "timeout": "60000"})",
+	    [&attached_response](std::string response) { attached_response.set_value (response); }, "", [](std::string, std::chrono::seconds) { FAIL (); });
+	handler.handle_request_async (R"({"action": "work_cancel", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C"})", [](std::string) {});
+	ASSERT_EQ (std::future_status::ready, blocker_response.get_future ().wait_for (std::chrono::seconds (10)));
+	ASSERT_EQ (std::future_status::ready, attached_response.get_future ().wait_for (std::chrono::seconds (10)));
+}
+
+TEST (queue, completion)
+{
+	nano_pow_server::config config;
+	for (auto i = 0; i < 2; ++i)
+	{
+		config.devices.emplace_back ();
+		config.devices.back ().threads = 1;
+	}
+	config.server.allow_prioritization = true;
+	config.work.device_queue = 4;
+	config.cache.size = 0;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	// Requests from several clients and priorities are reordered in the queue, but each is answered with its own work
+	constexpr unsigned request_count = 64;
+	std::vector<std::promise<std::string>> promises (request_count);
+	std::vector<std::thread> clients;
+	for (unsigned client = 0; client < 4; ++client)
+	{
+		clients.emplace_back ([&handler, &promises, client]() {
+			for (unsigned i = client; i < request_count; i += 4)
+			{
+				auto const body (boost::str (boost::format (R"({"action": "work_generate", "hash": "%1%", "difficulty": "fff0000000000000", "priority": "%2%", "id": "%3%"})")
+				    % nano_pow_server::u256 (i + 1).to_hex () % (i % 3) % i));
+				auto & promise (promises[i]);
+				handler.handle_request_async (body, [&promise](std::string response_a) { promise.set_value (response_a); }, std::to_string (client));
+			}
+		});
+	}
+	for (auto & client : clients)
+	{
+		client.join ();
+	}
+	for (unsigned i = 0; i < request_count; ++i)
+	{
+		auto future (promises[i].get_future ());
+		ASSERT_EQ (std::future_status::ready, future.wait_for (std::chrono::seconds (30)));
+		auto response (parse (future.get ()));
+		ASSERT_EQ (std::to_string (i), response.get<std::string> ("id"));
+		nano_pow_server::u128 work (response.get<std::string> ("work"));
+		ASSERT_TRUE (nano_pow::passes (nano_pow_server::u256 (i + 1).bytes, static_cast<uint64_t> (work.number ()), 0xfff0000000000000));
+	}
+}
+
+TEST (queue, coalesce_queued)
+{
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	config.cache.size = 0;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	// Keeps the only device busy while the duplicate requests are queued
+	std::promise<std::string> blocker_response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C", "difficulty": "ffffffffffffffff", "id": "0"})",
+	    [&blocker_response](std::string response) { blocker_response.set_value (response); });
+	while (queue_count (handler, "active") == 0)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (1));
+	}
+
+	std::promise<std::string> response1, response2;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": "8000000000000000", "id": "1"})",
+	    [&response1](std::string response) { response1.set_value (response); });
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": "fff0000000000000", "id": "2"})",
+	    [&response2](std::string response) { response2.set_value (response); });
+	ASSERT_EQ (1, queue_count (handler, "queued"));
+
+	handler.handle_request_async (R"({"action": "work_cancel", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C"})", [](std::string) {});
+	ASSERT_EQ (std::future_status::ready, blocker_response.get_future ().wait_for (std::chrono::seconds (10)));
+
+	// One solve answers both requests at the higher difficulty
+	nano_pow_server::u256 root ("718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2");
+	std::string work;
+	for (auto & promise : { std::ref (response1), std::ref (response2) })
+	{
+		auto future (promise.get ().get_future ());
+		ASSERT_EQ (std::future_status::ready, future.wait_for (std::chrono::seconds (30)));
+		auto response (parse (future.get ()));
+		ASSERT_TRUE (work.empty () || work == response.get<std::string> ("work"));
+		work = response.get<std::string> ("work");
+		nano_pow_server::u128 work_l (work);
+		ASSERT_TRUE (nano_pow::passes (root.bytes, static_cast<uint64_t> (work_l.number ()), 0xfff0000000000000));
+		ASSERT_EQ (&promise.get () == &response1 ? "1" : "2", response.get<std::string> ("id"));
+	}
+}
+
+TEST (queue, coalesce_priority)
+{
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	config.server.allow_prioritization = true;
+	config.cache.size = 0;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	std::promise<std::string> blocker_response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C", "difficulty": "ffffffffffffffff"})",
+	    [&blocker_response](std::string response) { blocker_response.set_value (response); });
+	while (queue_count (handler, "active") == 0)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (1));
+	}
+
+	std::mutex mutex;
+	std::vector<std::string> answered;
+	std::promise<void> done;
+	auto generate = [&](std::string const & hash_a, std::string const & priority_a, std::string const & id_a) {
+		handler.handle_request_async (R"({"action": "work_generate", "hash": ")" + hash_a + R"(", "difficulty": "8000000000000000", "priority": ")" + priority_a + R"(", "id": ")" + id_a + R"("})",
+		    [&](std::string response) {
+			    std::lock_guard<std::mutex> lk (mutex);
+			    answered.push_back (parse (response).get<std::string> ("id"));
+			    if (answered.size () == 3)
+			    {
+				    done.set_value ();
+			    }
+		    });
+	};
+
+	// The urgent request for a root queued at a lower priority takes the queued job ahead of the others
+	generate ("0000000000000000000000000000000000000000000000000000000000000001", "1", "other");
+	generate ("718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "0", "low");
+	generate ("718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "2", "urgent");
+	ASSERT_EQ (2, queue_count (handler, "queued"));
+	handler.handle_request_async (R"({"action": "work_cancel", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C"})", [](std::string) {});
+	ASSERT_EQ (std::future_status::ready, done.get_future ().wait_for (std::chrono::seconds (10)));
+	ASSERT_EQ ("other", answered.back ());
+}
+
+TEST (queue, coalesce_active)
+{
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	std::promise<std::string> response1, response2;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": "ffffffffffffffff", "id": "1"})",
+	    [&response1](std::string response) { response1.set_value (response); });
+	while (queue_count (handler, "active") == 0)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (1));
+	}
+
+	// The active job already searches for a higher difficulty, so the request waits for it
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": "fff0000000000000", "id": "2"})",
+	    [&response2](std::string response) { response2.set_value (response); });
+	ASSERT_EQ (0, queue_count (handler, "queued"));
+
+	handler.handle_request_async (R"({"action": "work_cancel", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2"})", [](std::string) {});
+	for (auto & promise : { std::ref (response1), std::ref (response2) })
+	{
+		auto future (promise.get ().get_future ());
+		ASSERT_EQ (std::future_status::ready, future.wait_for (std::chrono::seconds (10)));
+		auto response (parse (future.get ()));
+		ASSERT_EQ ("cancelled", response.get<std::string> ("status"));
+		ASSERT_EQ (&promise.get () == &response1 ? "1" : "2", response.get<std::string> ("id"));
+	}
+}
+
+TEST (queue, raise_active)
+{
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	std::promise<std::string> response1, response2;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": "fffffffff0000000", "id": "1"})",
+	    [&response1](std::string response) { response1.set_value (response); });
+	while (queue_count (handler, "active") == 0)
+	{
+		std::this_thread::sleep_for (std::chrono::milliseconds (1));
+	}
+
+	// The higher difficulty is applied to the running search instead of queueing another job
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": "ffffffffff000000", "id": "2"})",
+	    [&response2](std::string response) { response2.set_value (response); });
+	ASSERT_EQ (0, queue_count (handler, "queued"));
+
+	handler.handle_request_async (R"({"action": "work_cancel", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2"})", [](std::string) {});
+	for (auto & promise : { std::ref (response1), std::ref (response2) })
+	{
+		auto future (promise.get ().get_future ());
+		ASSERT_EQ (std::future_status::ready, future.wait_for (std::chrono::seconds (10)));
+		ASSERT_EQ ("cancelled", parse (future.get ()).get<std::string> ("status"));
+	}
+}
+
+TEST (generate, batch)
+{
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	config.server.allow_prioritization = true;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	// The last item repeats the first root, and is answered by the same job
+	boost::property_tree::ptree request;
+	request.put ("action", "work_generate_batch");
+	request.put ("difficulty", "8000000000000000");
+	request.put ("id", "batch");
+	boost::property_tree::ptree items;
+	std::vector<nano_pow_server::u256> roots;
+	for (unsigned i = 0; i < 8; ++i)
+	{
+		roots.emplace_back (i % 7 + 1);
+		boost::property_tree::ptree item;
+		item.put ("hash", roots.back ().to_hex ());
+		if (i == 1)
+		{
+			item.put ("difficulty", "f000000000000000");
+			item.put ("priority", "1");
+		}
+		items.push_back (std::make_pair ("", item));
+	}
+	request.add_child ("items", items);
+	std::stringstream ostream;
+	boost::property_tree::write_json (ostream, request);
+
+	std::promise<std::string> promise;
+	handler.handle_request_async (ostream.str (), [&promise](std::string response_a) { promise.set_value (response_a); });
+	auto future (promise.get_future ());
+	ASSERT_EQ (std::future_status::ready, future.wait_for (std::chrono::seconds (30)));
+	auto response (parse (future.get ()));
+	ASSERT_EQ ("batch", response.get<std::string> ("id"));
+	auto const & results (response.get_child ("results"));
+	ASSERT_EQ (roots.size (), results.size ());
+	unsigned i (0);
+	for (auto const & result : results)
+	{
+		ASSERT_EQ (roots[i].to_hex (), result.second.get<std::string> ("hash"));
+		nano_pow_server::u128 work (result.second.get<std::string> ("work"));
+		// The second item overrides the batch difficulty
+		auto const difficulty (i == 1 ? 0xf000000000000000 : 0x8000000000000000);
+		ASSERT_TRUE (nano_pow::passes (roots[i].bytes, static_cast<uint64_t> (work.number ()), difficulty));
+		++i;
+	}
+
+	// Incremental results are sent as each item completes, cached ones included
+	request.put ("incremental", true);
+	request.put ("id", "incremental");
+	std::stringstream incremental_stream;
+	boost::property_tree::write_json (incremental_stream, request);
+	std::mutex mutex;
+	std::vector<std::string> responses;
+	std::promise<void> done;
+	handler.handle_request_async (incremental_stream.str (), [&](std::string response_a) {
+		std::lock_guard<std::mutex> lk (mutex);
+		responses.push_back (response_a);
+		if (responses.size () == roots.size ())
+		{
+			done.set_value ();
+		}
+	});
+	ASSERT_EQ (std::future_status::ready, done.get_future ().wait_for (std::chrono::seconds (30)));
+	std::set<unsigned> indices;
+	for (auto const & response_l : responses)
+	{
+		auto const result (parse (response_l));
+		ASSERT_EQ ("incremental", result.get<std::string> ("id"));
+		auto const index (result.get<unsigned> ("index"));
+		ASSERT_EQ (roots[index].to_hex (), result.get<std::string> ("hash"));
+		ASSERT_EQ (1, result.count ("work"));
+		indices.insert (index);
+	}
+	ASSERT_EQ (roots.size (), indices.size ());
+
+	// An invalid item fails the whole batch before anything is queued
+	std::promise<std::string> invalid;
+	handler.handle_request_async (R"({"action": "work_generate_batch", "items": [{"hash": "1"}, {"difficulty": "1"}]})", [&invalid](std::string response_a) { invalid.set_value (response_a); });
+	ASSERT_EQ ("work_generate failed: missing hash value", parse (invalid.get_future ().get ()).get<std::string> ("error"));
+}
+
+TEST (generate, async)
+{
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	config.cache.size = 0;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+	auto status = [&handler](std::string const & id_a, std::chrono::milliseconds wait_a) {
+		std::promise<std::string> promise;
+		handler.handle_status_request (id_a, wait_a, [&promise](std::string response_a) { promise.set_value (response_a); });
+		auto future (promise.get_future ());
+		EXPECT_EQ (std::future_status::ready, future.wait_for (std::chrono::seconds (30)));
+		return parse (future.get ());
+	};
+
+	// The request is answered with its job right away
+	std::promise<std::string> submitted;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C", "difficulty": "ffffffffffffffff", "async": true, "id": "1"})",
+	    [&submitted](std::string response_a) { submitted.set_value (response_a); });
+	auto submitted_future (submitted.get_future ());
+	ASSERT_EQ (std::future_status::ready, submitted_future.wait_for (std::chrono::seconds (10)));
+	auto response (parse (submitted_future.get ()));
+	ASSERT_EQ ("1", response.get<std::string> ("id"));
+	auto const id (response.get<std::string> ("job_id"));
+	ASSERT_FALSE (response.get_optional<std::string> ("work").is_initialized ());
+
+	// A poll of a pending job reports its status, also once a long poll times out
+	ASSERT_EQ (id, status (id, std::chrono::milliseconds (0)).get<std::string> ("job_id"));
+	ASSERT_EQ ("2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C", status (id, std::chrono::milliseconds (0)).get<std::string> ("hash"));
+	ASSERT_NE ("", status (id, std::chrono::milliseconds (50)).get<std::string> ("status"));
+	ASSERT_EQ ("Job not found", status ("unknown", std::chrono::milliseconds (0)).get<std::string> ("error"));
+
+	// A long poll is answered when the job is
+	std::promise<std::string> polled;
+	handler.handle_status_request (id, std::chrono::seconds (30), [&polled](std::string response_a) { polled.set_value (response_a); });
+	handler.handle_request_async (R"({"action": "work_cancel", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C"})", [](std::string) {});
+	auto polled_future (polled.get_future ());
+	ASSERT_EQ (std::future_status::ready, polled_future.wait_for (std::chrono::seconds (10)));
+	ASSERT_EQ ("cancelled", parse (polled_future.get ()).get<std::string> ("status"));
+	ASSERT_EQ ("Job not found", status (id, std::chrono::milliseconds (0)).get<std::string> ("error"));
+
+	// A solved job is reported with its work until it leaves the history
+	std::promise<std::string> solved;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": "8000000000000000", "async": true})",
+	    [&solved](std::string response_a) { solved.set_value (response_a); });
+	// The job id is reported even if the job is solved before the request is answered
+	auto const solved_id (parse (solved.get_future ().get ()).get<std::string> ("job_id"));
+	auto const work (status (solved_id, std::chrono::seconds (30)).get<std::string> ("work"));
+	ASSERT_EQ ("718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", status (solved_id, std::chrono::milliseconds (0)).get<std::string> ("hash"));
+	ASSERT_EQ (work, status (solved_id, std::chrono::milliseconds (0)).get<std::string> ("work"));
+}
+
+TEST (queue, restore)
+{
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	config.cache.size = 0;
+	config.server.journal = (boost::filesystem::temp_directory_path () / boost::filesystem::unique_path ()).string ();
+	auto submit = [](nano_pow_server::work_handler & handler_a, std::string const & hash_a, std::string const & difficulty_a) {
+		std::promise<std::string> promise;
+		handler_a.handle_request_async (R"({"action": "work_generate", "async": true, "hash": ")" + hash_a + R"(", "difficulty": ")" + difficulty_a + R"("})",
+		    [&promise](std::string response_a) { promise.set_value (response_a); });
+		return parse (promise.get_future ().get ()).get<std::string> ("job_id");
+	};
+	auto status = [](nano_pow_server::work_handler & handler_a, std::string const & id_a) {
+		std::promise<std::string> promise;
+		handler_a.handle_status_request (id_a, std::chrono::seconds (30), [&promise](std::string response_a) { promise.set_value (response_a); });
+		return parse (promise.get_future ().get ());
+	};
+
+	std::string solved_id, pending_id;
+	std::string work;
+	{
+		nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+		solved_id = submit (handler, "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "8000000000000000");
+		work = status (handler, solved_id).get<std::string> ("work");
+		pending_id = submit (handler, "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C", "ffffffffffffffff");
+	}
+
+	// After a restart, the pending job is queued again and the solved job can still be collected
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+	ASSERT_EQ (work, status (handler, solved_id).get<std::string> ("work"));
+	std::promise<std::string> polled;
+	handler.handle_status_request (pending_id, std::chrono::seconds (30), [&polled](std::string response_a) { polled.set_value (response_a); });
+	handler.handle_request_async (R"({"action": "work_cancel", "hash": "2387767168F9453DB0A5D8C1D9B5A7C30F0A5DD5C7C7E18E0A17A24B6F0A6E2C"})", [](std::string) {});
+	ASSERT_EQ ("cancelled", parse (polled.get_future ().get ()).get<std::string> ("status"));
+	boost::filesystem::remove (config.server.journal);
+}
+
+TEST (validate, single)
+{
+	nano_pow_server::config config;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	// The work value of this pair is 262eb7eda3cf3f86
+	std::string response;
+	handler.handle_request_async (R"({"action": "work_validate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "work": "2feaeaa000000000", "id": "1"})",
+	    [&response](std::string response_a) { response = response_a; });
+	auto tree (parse (response));
+	ASSERT_EQ ("1", tree.get<std::string> ("valid"));
+	nano_pow_server::u128 difficulty;
+	difficulty.from_hex (tree.get<std::string> ("difficulty"));
+	ASSERT_EQ (0x262eb7eda3cf3f86, difficulty.number ());
+	ASSERT_NEAR (nano_pow_server::to_multiplier (difficulty, config.work.base_difficulty), tree.get<double> ("multiplier"), 1e-5);
+	ASSERT_EQ ("1", tree.get<std::string> ("id"));
+
+	handler.handle_request_async (R"({"action": "work_validate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "work": "2feaeaa000000000", "difficulty": "3000000000000000"})",
+	    [&response](std::string response_a) { response = response_a; });
+	ASSERT_EQ ("0", parse (response).get<std::string> ("valid"));
+}
+
+TEST (validate, batch)
+{
+	nano_pow_server::config config;
+	config.work.validation_threads = 2;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	// Enough pairs for several validation tasks, each with a different root
+	boost::property_tree::ptree request;
+	request.put ("action", "work_validate_batch");
+	request.put ("difficulty", "8000000000000000");
+	request.put ("id", "batch");
+	boost::property_tree::ptree pairs;
+	std::vector<nano_pow_server::u256> roots;
+	for (unsigned i = 0; i < 2500; ++i)
+	{
+		roots.emplace_back (i + 1);
+		boost::property_tree::ptree pair;
+		pair.put ("hash", roots.back ().to_hex ());
+		pair.put ("work", nano_pow_server::u128 (i).to_hex ());
+		if (i == 0)
+		{
+			pair.put ("difficulty", "0");
+		}
+		pairs.push_back (std::make_pair ("", pair));
+	}
+	request.add_child ("pairs", pairs);
+	std::stringstream ostream;
+	boost::property_tree::write_json (ostream, request);
+
+	std::promise<std::string> promise;
+	handler.handle_request_async (ostream.str (), [&promise](std::string response_a) { promise.set_value (response_a); });
+	auto future (promise.get_future ());
+	ASSERT_EQ (std::future_status::ready, future.wait_for (std::chrono::seconds (10)));
+	auto response (parse (future.get ()));
+	ASSERT_EQ ("batch", response.get<std::string> ("id"));
+	auto const & results (response.get_child ("results"));
+	ASSERT_EQ (roots.size (), results.size ());
+	unsigned i (0);
+	for (auto const & result : results)
+	{
+		ASSERT_EQ (roots[i].to_hex (), result.second.get<std::string> ("hash"));
+		auto const expected (nano_pow::difficulty (roots[i].bytes, i));
+		nano_pow_server::u128 difficulty;
+		difficulty.from_hex (result.second.get<std::string> ("difficulty"));
+		ASSERT_EQ (expected, difficulty.number ());
+		// The first pair overrides the batch difficulty
+		bool const valid (i == 0 || expected >= 0x8000000000000000);
+		ASSERT_EQ (valid ? "1" : "0", result.second.get<std::string> ("valid"));
+		++i;
+	}
+}
+
+TEST (validate, memory_hard)
+{
+	nano_pow_server::config config;
+	config.work.memory_hard = true;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	config.devices.back ().memory = 1;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	std::promise<std::string> generate_response;
+	handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": "fffff00000000000"})",
+	    [&generate_response](std::string response) { generate_response.set_value (response); });
+	auto future (generate_response.get_future ());
+	ASSERT_EQ (std::future_status::ready, future.wait_for (std::chrono::seconds (30)));
+	auto work (parse (future.get ()).get<std::string> ("work"));
+
+	std::string response;
+	handler.handle_request_async (R"({"action": "work_validate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": "fffff00000000000", "work": ")" + work + R"("})",
+	    [&response](std::string response_a) { response = response_a; });
+	ASSERT_EQ ("1", parse (response).get<std::string> ("valid"));
+}
+
+TEST (cache, lru)
+{
+	nano_pow_server::work_cache cache (2);
+	nano_pow_server::u256 root1 (1), root2 (2), root3 (3);
+	cache.insert (root1, { 10, 0x1000 });
+	cache.insert (root2, { 20, 0x2000 });
+	ASSERT_EQ (2, cache.size ());
+
+	// Found only up to the cached difficulty
+	ASSERT_TRUE (cache.find (root1, 0x1000).is_initialized ());
+	ASSERT_EQ (10, cache.find (root1, 0x800)->work);
+	ASSERT_FALSE (cache.find (root1, 0x1001).is_initialized ());
+	ASSERT_EQ (2, cache.hits ());
+	ASSERT_EQ (1, cache.misses ());
+
+	// root2 is the least recently used entry
+	cache.insert (root3, { 30, 0x3000 });
+	ASSERT_EQ (2, cache.size ());
+	ASSERT_EQ (1, cache.evictions ());
+	ASSERT_FALSE (cache.find (root2, 0).is_initialized ());
+	ASSERT_TRUE (cache.find (root3, 0).is_initialized ());
+
+	// Lower difficulty work does not replace better cached work
+	cache.insert (root3, { 31, 0x100 });
+	ASSERT_EQ (30, cache.find (root3, 0)->work);
+	cache.insert (root3, { 32, 0x4000 });
+	ASSERT_EQ (32, cache.find (root3, 0)->work);
+
+	nano_pow_server::work_cache disabled (0);
+	disabled.insert (root1, { 10, 0x1000 });
+	ASSERT_EQ (0, disabled.size ());
+}
+
+TEST (cache, disk)
+{
+	auto const path ((boost::filesystem::temp_directory_path () / boost::filesystem::unique_path ()).string ());
+	nano_pow_server::u256 root1 (1), root2 (2), root3 (3);
+	{
+		nano_pow_server::work_cache cache (1, path, 16);
+		ASSERT_EQ (16, cache.disk_capacity ());
+		cache.insert (root1, { 10, 0x1000 });
+		cache.insert (root2, { 20, 0x2000 });
+		// root1 is evicted from memory, and found in the file
+		ASSERT_EQ (10, cache.find (root1, 0x1000)->work);
+		ASSERT_EQ (1, cache.disk_hits ());
+		cache.insert (root2, { 21, 0x100 });
+	}
+
+	// The file is kept across restarts, also without a cache in memory
+	{
+		nano_pow_server::work_cache cache (0, path, 16);
+		ASSERT_EQ (10, cache.find (root1, 0x800)->work);
+		ASSERT_EQ (20, cache.find (root2, 0)->work);
+		ASSERT_FALSE (cache.find (root1, 0x1001).is_initialized ());
+		ASSERT_FALSE (cache.find (root3, 0).is_initialized ());
+		ASSERT_EQ (2, cache.disk_hits ());
+		ASSERT_EQ (2, cache.misses ());
+
+		// Once the probed slots are taken, the entry of lowest difficulty is replaced
+		for (uint64_t i (0); i < 64; ++i)
+		{
+			cache.insert (nano_pow_server::u256 (i + 4), { i, 0x10000 + i });
+		}
+		ASSERT_EQ (63, cache.find (nano_pow_server::u256 (67), 0)->work);
+	}
+
+	// A file of another capacity or proof of work is discarded
+	{
+		nano_pow_server::work_cache cache (0, path, 16, 1);
+		ASSERT_FALSE (cache.find (nano_pow_server::u256 (67), 0).is_initialized ());
+	}
+	boost::filesystem::remove (path);
+}
+
+TEST (cache, work_generate)
+{
+	nano_pow_server::config config;
+	config.devices.emplace_back ();
+	config.devices.back ().threads = 1;
+	nano_pow_server::work_handler handler (config, std::make_shared<spdlog::logger> ("test"));
+
+	auto generate = [&handler](std::string const & difficulty_a) {
+		std::promise<std::string> promise;
+		handler.handle_request_async (R"({"action": "work_generate", "hash": "718CC2121C3E641059BC1C2CFC45666C99E8AE922F7A807B7D07B62C995D79E2", "difficulty": ")" + difficulty_a + R"("})",
+		    [&promise](std::string response_a) { promise.set_value (response_a); });
+		auto future (promise.get_future ());
+		EXPECT_EQ (std::future_status::ready, future.wait_for (std::chrono::seconds (30)));
+		return parse (future.get ());
+	};
+	auto cache_stat = [&handler](std::string const & name_a) {
+		uint64_t value (0);
+		handler.handle_cache_request ([&value, &name_a](std::string response_a) { value = parse (response_a).get<uint64_t> (name_a); });
+		return value;
+	};
+
+	auto first (generate ("f000000000000000"));
+	ASSERT_EQ (1, cache_stat ("misses"));
+
+	// Answered from the cache, without another job
+	auto second (generate ("f000000000000000"));
+	ASSERT_EQ (first.get<std::string> ("work"), second.get<std::string> ("work"));
+	ASSERT_EQ (first.get<std::string> ("difficulty"), second.get<std::string> ("difficulty"));
+	ASSERT_EQ (1, cache_stat ("hits"));
+	ASSERT_EQ (1, cache_stat ("misses"));
+	ASSERT_EQ (1, cache_stat ("size"));
+}
+
 TEST (difficulty, low)
 {
 	double expected_multiplier = 1.0;
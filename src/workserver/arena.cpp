@@ -0,0 +1,101 @@
+#include <cstdint>
+#include <new>
+
+#include <workserver/arena.hpp>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+/** Size of the huge pages requested on Linux, which is the default huge page size on x86-64 and arm64 */
+constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+size_t round_up (size_t size_a, size_t multiple_a)
+{
+	return (size_a + multiple_a - 1) / multiple_a * multiple_a;
+}
+}
+
+nano_pow::arena::arena (size_t size_a)
+{
+#if defined(_WIN32)
+	// Large pages need the "Lock pages in memory" privilege, which most accounts do not have
+	auto const large_page_size (GetLargePageMinimum ());
+	if (large_page_size > 0)
+	{
+		size_ = round_up (size_a, large_page_size);
+		data_ = VirtualAlloc (nullptr, size_, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		pages_ = page_type::huge;
+	}
+	if (data_ == nullptr)
+	{
+		size_ = size_a;
+		data_ = VirtualAlloc (nullptr, size_, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		pages_ = page_type::normal;
+	}
+	if (data_ == nullptr)
+	{
+		throw std::bad_alloc ();
+	}
+#else
+	size_ = round_up (size_a, huge_page_size);
+#if defined(MAP_HUGETLB)
+	// Explicit huge pages must have been reserved by the administrator, e.g. through vm.nr_hugepages
+	auto result (mmap (nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0));
+	if (result != MAP_FAILED)
+	{
+		data_ = result;
+		pages_ = page_type::huge;
+		return;
+	}
+#endif
+	// Transparent huge pages are only used for aligned 2 MB ranges, so map an extra page and trim the ends
+	auto const mapped_size (size_ + huge_page_size);
+	auto mapped (mmap (nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (mapped == MAP_FAILED)
+	{
+		throw std::bad_alloc ();
+	}
+	auto const begin (reinterpret_cast<uintptr_t> (mapped));
+	auto const aligned (round_up (begin, huge_page_size));
+	if (aligned > begin)
+	{
+		munmap (mapped, aligned - begin);
+	}
+	munmap (reinterpret_cast<void *> (aligned + size_), begin + mapped_size - aligned - size_);
+	data_ = reinterpret_cast<void *> (aligned);
+	pages_ = page_type::normal;
+#if defined(MADV_HUGEPAGE)
+	if (madvise (data_, size_, MADV_HUGEPAGE) == 0)
+	{
+		pages_ = page_type::transparent_huge;
+	}
+#endif
+#endif
+}
+
+nano_pow::arena::~arena ()
+{
+#if defined(_WIN32)
+	VirtualFree (data_, 0, MEM_RELEASE);
+#else
+	munmap (data_, size_);
+#endif
+}
+
+std::string nano_pow::arena::pages_as_string () const
+{
+	switch (pages_)
+	{
+		case page_type::huge:
+			return "huge pages";
+		case page_type::transparent_huge:
+			return "transparent huge pages";
+		default:
+			return "normal pages";
+	}
+}
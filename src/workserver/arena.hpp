@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace nano_pow
+{
+/**
+ * A large, zero filled allocation taken directly from the OS. Huge pages are preferred, since table lookups
+ * are random and would otherwise miss the TLB on almost every access. The arena falls back to transparent
+ * huge pages, and then to normal pages, if explicit huge pages are not available.
+ */
+class arena
+{
+public:
+	enum class page_type
+	{
+		huge,
+		transparent_huge,
+		normal
+	};
+
+	/** Allocates at least \p size_a bytes. Throws std::bad_alloc if no memory is available. */
+	explicit arena (size_t size_a);
+	~arena ();
+	arena (arena const &) = delete;
+	arena & operator= (arena const &) = delete;
+
+	void * data () const
+	{
+		return data_;
+	}
+	size_t size () const
+	{
+		return size_;
+	}
+	page_type pages () const
+	{
+		return pages_;
+	}
+	std::string pages_as_string () const;
+
+private:
+	void * data_{ nullptr };
+	size_t size_{ 0 };
+	page_type pages_{ page_type::normal };
+};
+}
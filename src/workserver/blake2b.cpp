@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include <workserver/blake2b.hpp>
+
+constexpr std::array<uint64_t, 8> nano_pow::blake2b::iv;
+
+uint8_t const nano_pow::blake2b::sigma[12][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+	{ 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+	{ 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+	{ 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+	{ 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+	{ 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+	{ 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+	{ 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+	{ 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 }
+};
+
+namespace
+{
+inline uint64_t rotr64 (uint64_t value_a, unsigned bits_a)
+{
+	return (value_a >> bits_a) | (value_a << (64 - bits_a));
+}
+
+inline uint64_t load64 (uint8_t const * src_a)
+{
+	uint64_t result = 0;
+	for (int i = 7; i >= 0; --i)
+	{
+		result = (result << 8) | src_a[i];
+	}
+	return result;
+}
+
+inline void store64 (uint8_t * dst_a, uint64_t value_a)
+{
+	for (int i = 0; i < 8; ++i)
+	{
+		dst_a[i] = static_cast<uint8_t> (value_a >> (8 * i));
+	}
+}
+}
+
+nano_pow::blake2b::blake2b (size_t out_bytes_a)
+    : h (iv)
+    , out_bytes (out_bytes_a)
+{
+	assert (out_bytes > 0 && out_bytes <= max_out_bytes);
+	// Parameter block: digest length, no key, fanout and depth of 1
+	h[0] ^= 0x01010000ULL ^ out_bytes;
+}
+
+void nano_pow::blake2b::update (void const * data_a, size_t size_a)
+{
+	auto data (static_cast<uint8_t const *> (data_a));
+	while (size_a > 0)
+	{
+		// The last block must be kept in the buffer since final () compresses it with the last-block flag
+		if (buffer_size == block_bytes)
+		{
+			counter += block_bytes;
+			compress (h, buffer.data (), counter, false);
+			buffer_size = 0;
+		}
+		auto count (std::min (size_a, block_bytes - buffer_size));
+		std::memcpy (buffer.data () + buffer_size, data, count);
+		buffer_size += count;
+		data += count;
+		size_a -= count;
+	}
+}
+
+void nano_pow::blake2b::final (void * out_a)
+{
+	counter += buffer_size;
+	std::memset (buffer.data () + buffer_size, 0, block_bytes - buffer_size);
+	compress (h, buffer.data (), counter, true);
+
+	std::array<uint8_t, max_out_bytes> digest;
+	for (size_t i = 0; i < h.size (); ++i)
+	{
+		store64 (digest.data () + i * 8, h[i]);
+	}
+	std::memcpy (out_a, digest.data (), out_bytes);
+}
+
+void nano_pow::blake2b::compress (std::array<uint64_t, 8> & h_a, uint8_t const * block_a, uint64_t counter_a, bool last_a)
+{
+	uint64_t m[16];
+	for (int i = 0; i < 16; ++i)
+	{
+		m[i] = load64 (block_a + i * 8);
+	}
+
+	uint64_t v[16];
+	for (int i = 0; i < 8; ++i)
+	{
+		v[i] = h_a[i];
+		v[i + 8] = iv[i];
+	}
+	// Messages are limited to 2^64 bytes, so the high counter word is always zero
+	v[12] ^= counter_a;
+	if (last_a)
+	{
+		v[14] = ~v[14];
+	}
+
+	auto g = [&v, &m](int a, int b, int c, int d, uint8_t x, uint8_t y) {
+		v[a] = v[a] + v[b] + m[x];
+		v[d] = rotr64 (v[d] ^ v[a], 32);
+		v[c] = v[c] + v[d];
+		v[b] = rotr64 (v[b] ^ v[c], 24);
+		v[a] = v[a] + v[b] + m[y];
+		v[d] = rotr64 (v[d] ^ v[a], 16);
+		v[c] = v[c] + v[d];
+		v[b] = rotr64 (v[b] ^ v[c], 63);
+	};
+
+	for (int round = 0; round < 12; ++round)
+	{
+		auto const * s (sigma[round]);
+		g (0, 4, 8, 12, s[0], s[1]);
+		g (1, 5, 9, 13, s[2], s[3]);
+		g (2, 6, 10, 14, s[4], s[5]);
+		g (3, 7, 11, 15, s[6], s[7]);
+		g (0, 5, 10, 15, s[8], s[9]);
+		g (1, 6, 11, 12, s[10], s[11]);
+		g (2, 7, 8, 13, s[12], s[13]);
+		g (3, 4, 9, 14, s[14], s[15]);
+	}
+
+	for (int i = 0; i < 8; ++i)
+	{
+		h_a[i] ^= v[i] ^ v[i + 8];
+	}
+}
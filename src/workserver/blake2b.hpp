@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace nano_pow
+{
+/**
+ * Portable, unkeyed Blake2b (RFC 7693). This is the generic implementation used for validation
+ * and as the reference for the specialized nonce search kernels.
+ */
+class blake2b
+{
+public:
+	static constexpr size_t block_bytes = 128;
+	static constexpr size_t max_out_bytes = 64;
+
+	/** Initial chaining values, shared with the search kernels */
+	static constexpr std::array<uint64_t, 8> iv{ { 0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+	    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL, 0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL } };
+
+	/** Message word permutation for each of the 12 rounds */
+	static const uint8_t sigma[12][16];
+
+	/** Initializes the hash state for a digest of \p out_bytes bytes (1 to 64) */
+	explicit blake2b (size_t out_bytes_a);
+
+	void update (void const * data_a, size_t size_a);
+
+	/** Writes the digest to \p out_a, which must hold at least the number of bytes given to the constructor */
+	void final (void * out_a);
+
+	/** The Blake2b compression function F, exposed for the search kernels */
+	static void compress (std::array<uint64_t, 8> & h_a, uint8_t const * block_a, uint64_t counter_a, bool last_a);
+
+private:
+	std::array<uint64_t, 8> h;
+	std::array<uint8_t, block_bytes> buffer;
+	size_t buffer_size{ 0 };
+	uint64_t counter{ 0 };
+	size_t out_bytes;
+};
+}
@@ -3,7 +3,9 @@
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
 
+#include <algorithm>
 #include <fstream>
+#include <limits>
 #include <memory>
 #include <sstream>
 #include <thread>
@@ -32,12 +34,25 @@ public:
 		uint16_t threads{ static_cast<uint16_t> (std::thread::hardware_concurrency ()) };
 		/** The maximum size of the request queue. Attempt to request work when full will result in an error reply */
 		uint32_t request_limit{ 1024 * 16 };
+		/** If true, work requests that are not expected to be solved in time are rejected */
+		bool admission_control{ false };
+		/** With admission control, the longest expected time in milliseconds to solve all queued work including a new request. Zero for no limit. */
+		uint32_t drain_limit{ 0 };
 		/** If true, the work server will honor the priority field in requests */
 		bool allow_prioritization{ false };
+		/** Priority levels a queued job gains per second of waiting. Zero disables aging. */
+		double priority_aging_rate{ 0 };
+		/**
+		 * Aging raises jobs below this priority up to it, but never past jobs requested at this priority or higher.
+		 * By default every priority but the highest ages, so that no stream of requests holds back others forever.
+		 */
+		uint32_t priority_aging_cap{ std::numeric_limits<uint32_t>::max () };
 		/** If true, allow control requests, such as clearing the queue */
 		bool allow_control{ false };
 		/** If true, log to stderr in addition to file */
 		bool log_to_stderr{ false };
+		/** Path of the journal from which queued work requests are restored after a restart. Empty disables the journal. */
+		std::string journal;
 	} server;
 
 	/** Device settings */
@@ -71,6 +86,16 @@ public:
 	};
 	std::vector<device> devices;
 
+	/** Fair queuing weight of a client, identified by the X-API-Key header of its requests or else its remote address */
+	class client
+	{
+	public:
+		std::string key;
+		/** Number of jobs the client may have in each fair queuing round. Clients not configured have weight 1. */
+		uint16_t weight{ 1 };
+	};
+	std::vector<client> clients;
+
 	/** Work related settings */
 	class work
 	{
@@ -82,8 +107,59 @@ public:
 		u128 base_difficulty;
 		/** If set, the work_generate RPC will not attempt real work generation but simply return mock data. This is useful testing. */
 		uint16_t mock_work_generation_delay{ 0 };
+		/** If non-zero, requests with at least this multiplier are split across all idle devices */
+		double split_multiplier{ 0 };
+		/** Number of threads validating work_validate_batch requests. Zero means one per hardware thread. */
+		uint16_t validation_threads{ 0 };
+		/** If set, work is generated and validated with the memory-hard, table based proof of work */
+		bool memory_hard{ false };
+		/** Maximum number of jobs the fastest device takes from the queue at a time. Idle devices steal the surplus. */
+		uint16_t device_queue{ 1 };
+
+		/** How jobs of the same priority are ordered, beyond fair queuing among clients */
+		enum class scheduling_policy
+		{
+			/** In order of submission, or deadline if set */
+			fifo,
+			/** Lowest expected solve cost first. Expensive jobs may wait indefinitely under load. */
+			shortest,
+			/** By submission time plus expected solve time, so that cheap jobs overtake expensive ones for a bounded time */
+			hybrid
+		};
+		scheduling_policy scheduling{ scheduling_policy::fifo };
+		/** Jobs whose expected finish times fall in the same window of this many milliseconds are equal under hybrid scheduling */
+		uint32_t aging_window{ 1000 };
+		/** If non-zero, jobs with at least this multiplier only run on devices of the fastest device type */
+		double route_multiplier{ 0 };
+		/** If set, a job preempts a running job of lower priority when all devices are busy */
+		bool preemption{ false };
+
+		std::string scheduling_as_string () const
+		{
+			switch (scheduling)
+			{
+				case scheduling_policy::shortest:
+					return "shortest";
+				case scheduling_policy::hybrid:
+					return "hybrid";
+				default:
+					return "fifo";
+			}
+		}
 	} work;
 
+	/** Completed work cache settings */
+	class cache
+	{
+	public:
+		/** Maximum number of cached solutions. Zero disables the cache. */
+		uint32_t size{ 1024 * 16 };
+		/** Path of a file that keeps solutions across restarts. Empty disables the file. */
+		std::string path;
+		/** Minimum number of solutions the file has room for */
+		uint32_t disk_size{ 1024 * 1024 };
+	} cache;
+
 	/** Admin UI settings */
 	class admin
 	{
@@ -104,9 +180,14 @@ public:
 			server.port = server_l->get_as<uint16_t> ("port").value_or (server.port);
 			server.threads = server_l->get_as<uint16_t> ("threads").value_or (server.threads);
 			server.allow_prioritization = server_l->get_as<bool> ("allow_prioritization").value_or (server.allow_prioritization);
+			server.priority_aging_rate = server_l->get_as<double> ("priority_aging_rate").value_or (server.priority_aging_rate);
+			server.priority_aging_cap = server_l->get_as<uint32_t> ("priority_aging_cap").value_or (server.priority_aging_cap);
 			server.allow_control = server_l->get_as<bool> ("allow_control").value_or (server.allow_control);
 			server.request_limit = server_l->get_as<uint32_t> ("request_limit").value_or (server.request_limit);
 			server.log_to_stderr = server_l->get_as<bool> ("log_to_stderr").value_or (server.log_to_stderr);
+			server.admission_control = server_l->get_as<bool> ("admission_control").value_or (server.admission_control);
+			server.drain_limit = server_l->get_as<uint32_t> ("drain_limit").value_or (server.drain_limit);
+			server.journal = server_l->get_as<std::string> ("journal").value_or (server.journal);
 		}
 
 		if (tree->contains ("work"))
@@ -115,6 +196,38 @@ public:
 			auto base_hex_l = work_l->get_as<std::string> ("base_difficulty").value_or (BASE_DIFFICULTY);
 			work.base_difficulty.from_hex (base_hex_l);
 			work.mock_work_generation_delay = work_l->get_as<uint16_t> ("mock_work_generation_delay").value_or (work.mock_work_generation_delay);
+			work.split_multiplier = work_l->get_as<double> ("split_multiplier").value_or (work.split_multiplier);
+			work.validation_threads = work_l->get_as<uint16_t> ("validation_threads").value_or (work.validation_threads);
+			work.memory_hard = work_l->get_as<bool> ("memory_hard").value_or (work.memory_hard);
+			work.device_queue = std::max<uint16_t> (1, work_l->get_as<uint16_t> ("device_queue").value_or (work.device_queue));
+			std::string scheduling_l (work_l->get_as<std::string> ("scheduling").value_or (work.scheduling_as_string ()));
+			if (scheduling_l == "fifo")
+			{
+				work.scheduling = work::scheduling_policy::fifo;
+			}
+			else if (scheduling_l == "shortest")
+			{
+				work.scheduling = work::scheduling_policy::shortest;
+			}
+			else if (scheduling_l == "hybrid")
+			{
+				work.scheduling = work::scheduling_policy::hybrid;
+			}
+			else
+			{
+				throw std::runtime_error ("config: invalid work scheduling (must be \"fifo\", \"shortest\" or \"hybrid\")");
+			}
+			work.aging_window = std::max<uint32_t> (1, work_l->get_as<uint32_t> ("aging_window").value_or (work.aging_window));
+			work.route_multiplier = work_l->get_as<double> ("route_multiplier").value_or (work.route_multiplier);
+			work.preemption = work_l->get_as<bool> ("preemption").value_or (work.preemption);
+		}
+
+		if (tree->contains ("cache"))
+		{
+			auto cache_l (tree->get_table ("cache"));
+			cache.size = cache_l->get_as<uint32_t> ("size").value_or (cache.size);
+			cache.path = cache_l->get_as<std::string> ("path").value_or (cache.path);
+			cache.disk_size = cache_l->get_as<uint32_t> ("disk_size").value_or (cache.disk_size);
 		}
 
 		if (tree->contains ("device"))
@@ -161,6 +274,40 @@ public:
 				throw std::runtime_error ("device must be a table or table array");
 			}
 		}
+		if (tree->contains ("client"))
+		{
+			auto get_client = [](std::shared_ptr<cpptoml::table> client_a) {
+				client client_l;
+				client_l.key = client_a->get_as<std::string> ("key").value_or (client_l.key);
+				client_l.weight = std::max<uint16_t> (1, client_a->get_as<uint16_t> ("weight").value_or (client_l.weight));
+				return client_l;
+			};
+
+			// Like devices, clients may be a single [client] entry or a table array of [[client]] entries
+			auto client_l = tree->get ("client");
+			// An entry without a key, as left by older sample configs, configures nobody
+			auto add_client = [this](client const & client_a) {
+				if (!client_a.key.empty ())
+				{
+					clients.push_back (client_a);
+				}
+			};
+			if (client_l->is_table ())
+			{
+				add_client (get_client (client_l->as_table ()));
+			}
+			else if (client_l->is_table_array ())
+			{
+				for (auto & table : *client_l->as_table_array ())
+				{
+					add_client (get_client (table));
+				}
+			}
+			else
+			{
+				throw std::runtime_error ("client must be a table or table array");
+			}
+		}
 		if (tree->contains ("admin"))
 		{
 			auto admin_l (tree->get_table ("admin"));
@@ -178,24 +325,45 @@ public:
 		auto root_l = cpptoml::make_table ();
 		auto server_l = cpptoml::make_table ();
 		auto work_l = cpptoml::make_table ();
+		auto cache_l = cpptoml::make_table ();
 		auto admin_l = cpptoml::make_table ();
 		auto device_gpu_l = cpptoml::make_table ();
+		auto client_l = cpptoml::make_table ();
 
 		root_l->insert ("server", server_l);
 		root_l->insert ("work", work_l);
+		root_l->insert ("cache", cache_l);
 		root_l->insert ("device", device_gpu_l);
+		root_l->insert ("client", client_l);
 		root_l->insert ("admin", admin_l);
 
 		put (server_l, "bind", server.bind_address, "Listening address for HTTP and WebSocket connections.\ntype:string,ip");
 		put (server_l, "port", server.port, "Listening port for HTTP and WebSocket connections.\ntype:uint16");
 		put (server_l, "threads", server.threads, "Number of IO threads used by the web server.\ntype:uint16");
 		put (server_l, "allow_prioritization", server.allow_prioritization, "If true, work requests may contain a numeric \"priority\" property to move ahead in the queue.\ntype:bool");
+		put (server_l, "priority_aging_rate", server.priority_aging_rate, "Priority levels a queued work request gains per second of waiting, so that a stream of high priority\nrequests cannot hold back lower priority requests forever. Zero disables aging.\ntype:double");
+		put (server_l, "priority_aging_cap", server.priority_aging_cap, "Aging raises requests below this priority at most up to it, never past requests made at this priority\nor higher. The wait of a request is only bounded if its priority is below the cap, as a stream of requests at\nthe cap or above holds it back for as long as it lasts. The default lets every priority age.\ntype:uint32");
 		put (server_l, "allow_control", server.allow_control, "Administriative REST requests requires this to be true, otherwise an error is returned.\ntype:bool");
 		put (server_l, "request_limit", server.request_limit, "The maximum number of queued work requests. If the queue is full, work requests will result in an error.\ntype:uint32");
+		put (server_l, "admission_control", server.admission_control, "If true, a work request is rejected when the queued work, at the measured hashrate of the devices, is not\nexpected to be solved before the request's deadline or within drain_limit. HTTP clients receive status 503 with\na Retry-After header, WebSocket clients an error with the estimated time to solve.\ntype:bool");
+		put (server_l, "drain_limit", server.drain_limit, "With admission_control, the longest expected time in milliseconds to solve all queued work, including the\nnew request. Zero for no limit beyond each request's deadline.\ntype:uint32");
 		put (server_l, "log_to_stderr", server.log_to_stderr, "Log to standard error in addition to file.\ntype:bool");
+		put (server_l, "journal", server.journal, "Path of a journal of queued work requests. After a restart, requests that were queued or in progress are\nqueued again, and the results of recently solved asynchronous requests can still be collected. Empty disables\nthe journal.\ntype:string,path");
 
 		put (work_l, "base_difficulty", work.base_difficulty.to_hex (), "Base work difficulty\ntype:string,hex");
 		put (work_l, "mock_work_generation_delay", work.mock_work_generation_delay, "If non-zero, the server simulates generating work for N seconds instead of\nusing a work device. Useful during testing of initial setup and debugging.\ntype:uint16");
+		put (work_l, "split_multiplier", work.split_multiplier, "If non-zero, work requests with at least this multiplier have their nonce space split across all idle\ndevices, in proportion to each device's measured hashrate. The first device to find a solution stops the others.\ntype:double");
+		put (work_l, "validation_threads", work.validation_threads, "Number of threads used to validate work_validate_batch requests. If zero, one thread per\nhardware thread is used.\ntype:uint16");
+		put (work_l, "memory_hard", work.memory_hard, "If true, work is generated and validated with the memory-hard proof of work. CPU devices then search\nwith a table that uses the device's memory setting.\ntype:bool");
+		put (work_l, "device_queue", work.device_queue, "Maximum number of jobs a device takes from the queue at a time, scaled down for slower devices by their\nmeasured hashrate. Surplus jobs wait in the device's local queue, from which idle devices steal. Values above 1\nreduce contention on the queue, but let local jobs run ahead of higher priority jobs queued later.\ntype:uint16");
+		put (work_l, "scheduling", work.scheduling_as_string (), "Order of jobs with the same priority, beyond fair queuing among clients. \"fifo\" runs them in order\nof submission, or earliest deadline first. \"shortest\" runs the job with the lowest expected solve cost first,\nwhich minimizes mean latency but may hold back expensive jobs indefinitely. \"hybrid\" orders jobs by submission\ntime plus expected solve time, so cheap jobs overtake expensive ones only until those have waited long enough.\ntype:string,[\"fifo\"|\"shortest\"|\"hybrid\"]");
+		put (work_l, "aging_window", work.aging_window, "Jobs whose expected finish times are within the same window of this many milliseconds are treated as\nequal by hybrid scheduling, and ordered by fair queuing and deadline instead.\ntype:uint32");
+		put (work_l, "route_multiplier", work.route_multiplier, "If non-zero, jobs with at least this multiplier only run on devices of the device type with the highest\nmeasured hashrate, such as GPUs, while other devices take the cheaper jobs.\ntype:double");
+		put (work_l, "preemption", work.preemption, "If true, a work request that arrives while all devices are busy preempts the running request of\nlowest priority, if its own priority is higher. The preempted request is queued again and later resumes its\nsearch where it stopped.\ntype:bool");
+
+		put (cache_l, "size", cache.size, "Maximum number of completed work results kept in memory. Requests for a cached root are answered\nimmediately if the cached work meets the requested difficulty. If zero, the cache is disabled.\ntype:uint32");
+		put (cache_l, "path", cache.path, "Path of a file in which completed work results are also stored, so that requests retried after a restart\nare answered without generating work again. The file is memory mapped, with 56 bytes per result. Empty disables\nthe file.\ntype:string,path");
+		put (cache_l, "disk_size", cache.disk_size, "Number of completed work results the file has room for, rounded up to a power of two. Changing it discards\nthe stored results.\ntype:uint32");
 
 		put (admin_l, "allow_remote", admin.allow_remote, "If true, static files are available remotely, otherwise only to loopback.\ntype:bool");
 		put (admin_l, "enable", admin.enable, "Enable or disable serving static files.\ntype:bool");
@@ -204,8 +372,10 @@ public:
 		put (device_gpu_l, "type", "gpu", "Device type\ntype:string,[\"cpu\"|\"gpu\"]");
 		put (device_gpu_l, "device_id", 0, "Device ID (gpu only)\ntype:uint64_t");
 		put (device_gpu_l, "platform_id", 0, "Platform ID (gpu only)\ntype:uint64_t");
-		put (device_gpu_l, "memory", 0, "Maximum memory to allocate in MB\ntype:uint64_t");
+		put (device_gpu_l, "memory", 0, "Maximum memory to allocate in MB. CPU devices use it for the work table if work.memory_hard is set.\ntype:uint64_t");
 		put (device_gpu_l, "threads", 0, "Number of CPU or GPU threads\ntype:uint64_t");
+		put (client_l, "key", "", "API key sent in the X-API-Key header, or else remote IP address of the client\ntype:string");
+		put (client_l, "weight", 1, "Number of the client's jobs dispatched in each fair queuing round, relative to the weight\nof other clients. Clients without an entry have weight 1.\ntype:uint16");
 
 		std::stringstream ss, ss_processed;
 		cpptoml::toml_writer writer{ ss, "" };
@@ -213,7 +383,8 @@ public:
 		std::string line;
 		while (std::getline (ss, line, '\n'))
 		{
-			if (!line.empty () && line[0] != '#' && line[0] != '[')
+			// The client table is only an example. Left in, it would configure a client with an empty key.
+			if (!line.empty () && line[0] != '#' && (line[0] != '[' || line == "[client]"))
 			{
 				line = "#" + line;
 			}
@@ -0,0 +1,441 @@
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include <workserver/job_journal.hpp>
+
+namespace
+{
+/** Records a new file has room for */
+size_t const initial_capacity (1024);
+
+/** Time after which a failed compaction is tried again */
+std::chrono::seconds const retry_interval (1);
+}
+
+/** A journaled event, in the byte order of the server. Only enqueued, updated and completed events fill in the job. */
+class nano_pow_server::job_journal::record
+{
+public:
+	uint32_t type;
+	uint32_t job_id;
+	uint8_t root_hash[32];
+	uint64_t difficulty;
+	double multiplier;
+	int64_t deadline;
+	uint32_t priority;
+	uint32_t reserved;
+	uint64_t work;
+	uint64_t work_difficulty;
+	double work_multiplier;
+	char client[40];
+	/** Of the bytes before it */
+	uint64_t checksum;
+};
+
+nano_pow_server::job_journal::job_journal (std::string const & path_a, size_t history_a)
+    : path (path_a)
+    , history (history_a)
+{
+	if (!enabled ())
+	{
+		return;
+	}
+	if (!boost::filesystem::exists (path) || boost::filesystem::file_size (path) < sizeof (record))
+	{
+		std::ofstream create (path, std::ios::binary | std::ios::trunc);
+		if (!create)
+		{
+			throw std::runtime_error ("Could not create job journal " + path);
+		}
+		create.close ();
+		boost::filesystem::resize_file (path, initial_capacity * sizeof (record));
+	}
+	boost::interprocess::file_mapping (path.c_str (), boost::interprocess::read_write).swap (file);
+	boost::interprocess::mapped_region (file, boost::interprocess::read_write).swap (region);
+
+	auto const records (static_cast<record const *> (region.get_address ()));
+	auto const capacity_l (region.get_size () / sizeof (record));
+	for (size_t i (0); i < capacity_l; ++i)
+	{
+		auto const & record_l (records[i]);
+		if (static_cast<event> (record_l.type) == event::none || record_l.checksum != nano_pow_server::checksum (&record_l, offsetof (record, checksum)))
+		{
+			break;
+		}
+		apply (record_l);
+	}
+
+	// The replayed jobs are written back compacted, which also drops a torn record at the end
+	std::unique_lock<std::mutex> lk (mutex);
+	compact (lk, capacity_l);
+	lk.unlock ();
+	compaction_thread = std::thread ([this]() { run (); });
+}
+
+nano_pow_server::job_journal::~job_journal ()
+{
+	if (!enabled ())
+	{
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lk (mutex);
+		stopped = true;
+	}
+	condition.notify_all ();
+	compaction_thread.join ();
+	std::unique_lock<std::mutex> lk (mutex);
+	if (lost)
+	{
+		try
+		{
+			compact (lk, region.get_size () / sizeof (record));
+		}
+		catch (std::exception const &)
+		{
+			// The journal misses the events that did not fit, and the jobs are restored as they were last written
+		}
+	}
+	region.flush ();
+}
+
+std::vector<nano_pow_server::job_journal::entry> nano_pow_server::job_journal::pending () const
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	std::vector<entry> result;
+	for (auto const & queued_l : queued)
+	{
+		result.push_back (queued_l.second);
+	}
+	return result;
+}
+
+std::vector<nano_pow_server::job_journal::entry> nano_pow_server::job_journal::solved () const
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	return std::vector<entry> (completed_jobs.begin (), completed_jobs.end ());
+}
+
+void nano_pow_server::job_journal::enqueued (job const & job_a)
+{
+	if (!enabled ())
+	{
+		return;
+	}
+	std::lock_guard<std::mutex> lk (mutex);
+	if (queued.find (job_a.get_job_id ()) == queued.end ())
+	{
+		auto record_l (to_record (event::enqueued, to_entry (job_a)));
+		append (record_l);
+	}
+}
+
+void nano_pow_server::job_journal::updated (job const & job_a)
+{
+	if (!enabled ())
+	{
+		return;
+	}
+	std::lock_guard<std::mutex> lk (mutex);
+	auto existing (queued.find (job_a.get_job_id ()));
+	if (existing != queued.end ())
+	{
+		auto const entry_l (to_entry (job_a));
+		if (entry_l.difficulty.number () != existing->second.difficulty.number () || entry_l.priority != existing->second.priority || entry_l.deadline != existing->second.deadline)
+		{
+			auto record_l (to_record (event::updated, entry_l));
+			append (record_l);
+		}
+	}
+}
+
+void nano_pow_server::job_journal::dispatched (job const & job_a)
+{
+	journal (event::dispatched, job_a);
+}
+
+void nano_pow_server::job_journal::completed (job const & job_a)
+{
+	journal (event::completed, job_a);
+}
+
+void nano_pow_server::job_journal::cancelled (job const & job_a)
+{
+	journal (event::cancelled, job_a);
+}
+
+size_t nano_pow_server::job_journal::capacity () const
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	return region.get_size () / sizeof (record);
+}
+
+void nano_pow_server::job_journal::journal (event event_a, job const & job_a)
+{
+	if (!enabled ())
+	{
+		return;
+	}
+	std::lock_guard<std::mutex> lk (mutex);
+	auto existing (queued.find (job_a.get_job_id ()));
+	if (existing != queued.end ())
+	{
+		auto entry_l (existing->second);
+		entry_l.work = job_a.result.work;
+		entry_l.work_difficulty = job_a.result.difficulty;
+		entry_l.work_multiplier = job_a.result.multiplier;
+		auto record_l (to_record (event_a, entry_l));
+		append (record_l);
+	}
+}
+
+void nano_pow_server::job_journal::append (record & record_a)
+{
+	record_a.checksum = nano_pow_server::checksum (&record_a, offsetof (record, checksum));
+	auto const capacity_l (region.get_size () / sizeof (record));
+	if (count < capacity_l)
+	{
+		std::memcpy (static_cast<record *> (region.get_address ()) + count, &record_a, sizeof (record));
+		++count;
+	}
+	else
+	{
+		lost = true;
+	}
+	if (compacting)
+	{
+		backlog.push_back (record_a);
+	}
+	else if (lost || count * 2 >= capacity_l)
+	{
+		condition.notify_all ();
+	}
+	apply (record_a);
+}
+
+void nano_pow_server::job_journal::apply (record const & record_a)
+{
+	auto existing (queued.find (record_a.job_id));
+	switch (static_cast<event> (record_a.type))
+	{
+		case event::enqueued:
+			if (existing == queued.end ())
+			{
+				queued[record_a.job_id] = to_entry (record_a);
+			}
+			break;
+		case event::updated:
+			if (existing != queued.end ())
+			{
+				auto const entry_l (to_entry (record_a));
+				existing->second.difficulty = entry_l.difficulty;
+				existing->second.multiplier = entry_l.multiplier;
+				existing->second.priority = entry_l.priority;
+				existing->second.deadline = entry_l.deadline;
+			}
+			break;
+		case event::dispatched:
+			if (existing != queued.end ())
+			{
+				existing->second.dispatched = true;
+			}
+			break;
+		case event::completed:
+			if (existing != queued.end ())
+			{
+				auto entry_l (to_entry (record_a));
+				entry_l.dispatched = true;
+				completed_jobs.push_back (entry_l);
+				queued.erase (existing);
+				while (completed_jobs.size () > history)
+				{
+					completed_jobs.pop_front ();
+				}
+			}
+			break;
+		case event::cancelled:
+			if (existing != queued.end ())
+			{
+				queued.erase (existing);
+			}
+			break;
+		case event::none:
+			break;
+	}
+}
+
+void nano_pow_server::job_journal::compact (std::unique_lock<std::mutex> & lock_a, size_t capacity_a)
+{
+	std::vector<record> records;
+	for (auto const & queued_l : queued)
+	{
+		records.push_back (to_record (event::enqueued, queued_l.second));
+		if (queued_l.second.dispatched)
+		{
+			records.push_back (to_record (event::dispatched, queued_l.second));
+		}
+	}
+	// Only pending jobs can be completed
+	for (auto const & completed_l : completed_jobs)
+	{
+		records.push_back (to_record (event::enqueued, completed_l));
+		records.push_back (to_record (event::completed, completed_l));
+	}
+	auto capacity_l (std::max (capacity_a, initial_capacity));
+	while (records.size () * 2 > capacity_l)
+	{
+		capacity_l *= 2;
+	}
+
+	// The compacted journal is written next to the journal and replaces it once complete, so that a failure or a crash
+	// leaves the journal as it was. Events journaled in the meantime are kept in the backlog.
+	compacting = true;
+	backlog.clear ();
+	lock_a.unlock ();
+	auto const temporary (path + ".compact");
+	boost::interprocess::file_mapping file_l;
+	boost::interprocess::mapped_region region_l;
+	try
+	{
+		{
+			std::ofstream stream (temporary, std::ios::binary | std::ios::trunc);
+			for (auto & record_l : records)
+			{
+				record_l.checksum = nano_pow_server::checksum (&record_l, offsetof (record, checksum));
+				stream.write (reinterpret_cast<char const *> (&record_l), sizeof (record));
+			}
+			if (!stream)
+			{
+				throw std::runtime_error ("Could not write job journal " + temporary);
+			}
+		}
+		boost::filesystem::resize_file (temporary, capacity_l * sizeof (record));
+		boost::interprocess::file_mapping (temporary.c_str (), boost::interprocess::read_write).swap (file_l);
+		boost::interprocess::mapped_region (file_l, boost::interprocess::read_write).swap (region_l);
+	}
+	catch (...)
+	{
+		boost::system::error_code ignored;
+		boost::filesystem::remove (temporary, ignored);
+		lock_a.lock ();
+		compacting = false;
+		throw;
+	}
+
+	lock_a.lock ();
+	compacting = false;
+	auto count_l (records.size ());
+	auto lost_l (false);
+	for (auto const & record_l : backlog)
+	{
+		if (count_l < capacity_l)
+		{
+			std::memcpy (static_cast<record *> (region_l.get_address ()) + count_l, &record_l, sizeof (record));
+			++count_l;
+		}
+		else
+		{
+			lost_l = true;
+		}
+	}
+	backlog.clear ();
+	try
+	{
+		boost::filesystem::rename (temporary, path);
+	}
+	catch (...)
+	{
+		boost::system::error_code ignored;
+		boost::filesystem::remove (temporary, ignored);
+		throw;
+	}
+	region.swap (region_l);
+	file.swap (file_l);
+	count = count_l;
+	lost = lost_l;
+}
+
+void nano_pow_server::job_journal::run ()
+{
+	auto needs_compaction = [this]() {
+		return lost || count * 2 >= region.get_size () / sizeof (record);
+	};
+	std::unique_lock<std::mutex> lk (mutex);
+	while (!stopped)
+	{
+		auto failed (false);
+		if (needs_compaction ())
+		{
+			try
+			{
+				compact (lk, region.get_size () / sizeof (record));
+			}
+			catch (std::exception const &)
+			{
+				failed = true;
+			}
+		}
+		if (failed)
+		{
+			// The journal stays as it was, and the compaction is tried again after the interval
+			condition.wait_for (lk, retry_interval, [this]() { return stopped; });
+		}
+		else
+		{
+			condition.wait (lk, [this, &needs_compaction]() { return stopped || needs_compaction (); });
+		}
+	}
+}
+
+nano_pow_server::job_journal::record nano_pow_server::job_journal::to_record (event event_a, entry const & entry_a)
+{
+	static_assert (sizeof (record) == 144, "Journal records must not change size");
+	record result{};
+	result.type = static_cast<uint32_t> (event_a);
+	result.job_id = entry_a.job_id;
+	std::copy (entry_a.root_hash.bytes.begin (), entry_a.root_hash.bytes.end (), result.root_hash);
+	result.difficulty = entry_a.difficulty.number ().convert_to<uint64_t> ();
+	result.multiplier = entry_a.multiplier;
+	result.deadline = entry_a.deadline.count ();
+	result.priority = entry_a.priority;
+	result.work = entry_a.work.number ().convert_to<uint64_t> ();
+	result.work_difficulty = entry_a.work_difficulty.number ().convert_to<uint64_t> ();
+	result.work_multiplier = entry_a.work_multiplier;
+	std::strncpy (result.client, entry_a.client.c_str (), sizeof (result.client) - 1);
+	return result;
+}
+
+nano_pow_server::job_journal::entry nano_pow_server::job_journal::to_entry (record const & record_a)
+{
+	entry result;
+	result.job_id = record_a.job_id;
+	std::copy (std::begin (record_a.root_hash), std::end (record_a.root_hash), result.root_hash.bytes.begin ());
+	result.difficulty = u128 (record_a.difficulty);
+	result.multiplier = record_a.multiplier;
+	result.deadline = std::chrono::milliseconds (record_a.deadline);
+	result.priority = record_a.priority;
+	result.work = u128 (record_a.work);
+	result.work_difficulty = u128 (record_a.work_difficulty);
+	result.work_multiplier = record_a.work_multiplier;
+	result.client.assign (record_a.client, std::find (std::begin (record_a.client), std::end (record_a.client), '\0'));
+	return result;
+}
+
+nano_pow_server::job_journal::entry nano_pow_server::job_journal::to_entry (job const & job_a)
+{
+	entry result;
+	result.job_id = job_a.get_job_id ();
+	result.root_hash = job_a.request.root_hash;
+	result.difficulty = job_a.request.difficulty;
+	result.multiplier = job_a.request.multiplier;
+	result.priority = job_a.get_priority ();
+	if (job_a.has_deadline ())
+	{
+		result.deadline = std::chrono::duration_cast<std::chrono::milliseconds> (job_a.get_deadline ().time_since_epoch ());
+	}
+	result.client = job_a.get_client ();
+	return result;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <workserver/job_queue.hpp>
+
+namespace nano_pow_server
+{
+/**
+ * Append only journal of queued jobs in a memory mapped file, so that the queue survives a restart of the server.
+ * Jobs are journaled when they are queued, dispatched, solved and cancelled. When the journal is opened, it is
+ * replayed to find the jobs that were queued or active, which the server queues again, and the recently solved
+ * jobs, whose results the clients of asynchronous requests can still collect.
+ * Records have a fixed size and a checksum, and the replay stops at a record torn by a crash. Once the file is half
+ * full, a background thread compacts it to the pending jobs and the solved history in a new file, grown if that
+ * would be more than half full, and switches to the new file only once it is complete. Journaling a job never waits
+ * for a compaction. Should the file fill up before the compaction is done, further events are kept in memory
+ * until the next compaction writes them.
+ * Writes go through the page cache, so the journal survives the process but not the machine. Thread safe.
+ */
+class job_journal
+{
+public:
+	/** A journaled job */
+	class entry
+	{
+	public:
+		unsigned job_id{ 0 };
+		u256 root_hash{ "0" };
+		u128 difficulty{ "0" };
+		double multiplier{ 1.0 };
+		unsigned priority{ 0 };
+		/** Since the epoch, zero for a job without a deadline */
+		std::chrono::milliseconds deadline{ 0 };
+		/** The client that queued the job, truncated to the record */
+		std::string client;
+		/** Set once a device started working on the job */
+		bool dispatched{ false };
+		/** The solution of a solved job */
+		u128 work{ "0" };
+		u128 work_difficulty{ "0" };
+		double work_multiplier{ 1.0 };
+	};
+
+	/**
+	 * Opens or creates the journal at \p path_a and replays it. An empty path disables the journal. Compaction keeps
+	 * the last \p history_a solved jobs.
+	 */
+	job_journal (std::string const & path_a, size_t history_a);
+	~job_journal ();
+
+	bool enabled () const
+	{
+		return !path.empty ();
+	}
+
+	/** The jobs queued or active, in the order they were queued */
+	std::vector<entry> pending () const;
+
+	/** The last solved jobs, oldest first */
+	std::vector<entry> solved () const;
+
+	/** Journals \p job_a as queued. A job that is already pending is not journaled again. */
+	void enqueued (job const & job_a);
+
+	/**
+	 * Journals the difficulty, priority and deadline of \p job_a, a pending job that coalesced a request while
+	 * queued. Nothing is journaled if none of them changed.
+	 */
+	void updated (job const & job_a);
+
+	void dispatched (job const & job_a);
+
+	/** Journals the solution of \p job_a. Like cancelled, this ignores jobs that are not pending, such as jobs never queued. */
+	void completed (job const & job_a);
+
+	void cancelled (job const & job_a);
+
+	/** Number of records the file has room for */
+	size_t capacity () const;
+
+private:
+	/** Journaled events. Zero marks the end of the journal, as files are zero filled. */
+	enum class event : uint32_t
+	{
+		none = 0,
+		enqueued,
+		dispatched,
+		completed,
+		cancelled,
+		updated
+	};
+
+	class record;
+
+	static record to_record (event event_a, entry const & entry_a);
+	static entry to_entry (record const & record_a);
+	/** Describes \p job_a as queued */
+	static entry to_entry (job const & job_a);
+
+	/** Journals \p event_a for a pending job */
+	void journal (event event_a, job const & job_a);
+
+	/** Appends \p record_a with the mutex locked. If the file is full, the record is left to the next compaction. */
+	void append (record & record_a);
+
+	/** Applies \p record_a to the pending jobs and the history */
+	void apply (record const & record_a);
+
+	/**
+	 * Rewrites the file with the pending jobs and the history, with room for at least \p capacity_a records.
+	 * The mutex, held by \p lock_a, is released while the new file is written.
+	 */
+	void compact (std::unique_lock<std::mutex> & lock_a, size_t capacity_a);
+
+	/** Compacts the file once it is half full, or when records could not be written */
+	void run ();
+
+	std::string const path;
+	size_t const history;
+	mutable std::mutex mutex;
+	boost::interprocess::file_mapping file;
+	boost::interprocess::mapped_region region;
+	/** Number of records written to the file */
+	size_t count{ 0 };
+	std::map<unsigned, entry> queued;
+	std::deque<entry> completed_jobs;
+	/** Set when a record did not fit in the file, until a compaction writes it */
+	bool lost{ false };
+	/** Set while a compaction writes the new file */
+	bool compacting{ false };
+	/** Records appended while compacting, which are copied to the new file */
+	std::vector<record> backlog;
+	bool stopped{ false };
+	std::condition_variable condition;
+	std::thread compaction_thread;
+};
+}
@@ -0,0 +1,464 @@
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <limits>
+#include <random>
+
+#include <workserver/job_queue.hpp>
+
+namespace
+{
+/**
+ * Job ids start at a random base, so that a client polling with an id from an earlier run of the server is not
+ * answered with an unrelated job. The base leaves room for 2^31 jobs before the ids wrap around.
+ */
+unsigned random_job_id_base ()
+{
+	std::random_device device;
+	return std::uniform_int_distribution<unsigned> (1, std::numeric_limits<unsigned>::max () / 2) (device);
+}
+}
+
+std::atomic<unsigned> nano_pow_server::job::job_id_dispenser{ random_job_id_base () };
+
+nano_pow_server::job::job ()
+    : queued_time (std::chrono::system_clock::now ())
+{
+	job_id = job_id_dispenser.fetch_add (1);
+}
+
+void nano_pow_server::job::restore_id (unsigned job_id_a)
+{
+	job_id = job_id_a;
+	auto next (job_id_dispenser.load ());
+	while (next <= job_id_a && !job_id_dispenser.compare_exchange_weak (next, job_id_a + 1))
+	{
+	}
+}
+
+void nano_pow_server::job::set_aging (double rate_a, unsigned cap_a)
+{
+	if (rate_a > 0 && priority < cap_a)
+	{
+		auto const queued_seconds (std::chrono::duration<double> (queued_time.time_since_epoch ()).count ());
+		priority_key = static_cast<int64_t> (priority) - static_cast<int64_t> (std::floor (rate_a * queued_seconds));
+	}
+}
+
+void nano_pow_server::job::merge (job const & job_a)
+{
+	priority = std::max (priority, job_a.priority);
+	priority_key = std::max (priority_key, job_a.priority_key);
+	deadline = std::min (deadline, job_a.deadline);
+}
+
+nano_pow_server::job::waiter::waiter (boost::optional<std::string> const & correlation_id_a, std::function<void(std::string)> const & response_handler_a, std::chrono::time_point<std::chrono::system_clock> deadline_a, std::function<void(boost::property_tree::ptree const &)> const & result_handler_a)
+    : correlation_id (correlation_id_a)
+    , response_handler (response_handler_a)
+    , deadline (deadline_a)
+    , result_handler (result_handler_a)
+{
+}
+
+bool nano_pow_server::job::attach (waiter const & waiter_a, u128 const & difficulty_a, double multiplier_a)
+{
+	std::lock_guard<std::mutex> lk (coalesced_requests.mutex);
+	auto const raise (difficulty_a.number () > coalesced_requests.difficulty.number ());
+	if (coalesced_requests.closed || (raise && coalesced_requests.solved))
+	{
+		return false;
+	}
+	coalesced_requests.waiters.push_back (waiter_a);
+	if (raise)
+	{
+		coalesced_requests.difficulty = difficulty_a;
+		coalesced_requests.multiplier = multiplier_a;
+		// Difficulties are validated to fit the work value when requested
+		for (auto & driver : coalesced_requests.drivers)
+		{
+			driver->difficulty_set (difficulty_a.number ().convert_to<uint64_t> ());
+		}
+	}
+	return true;
+}
+
+void nano_pow_server::job::update_request ()
+{
+	std::lock_guard<std::mutex> lk (coalesced_requests.mutex);
+	if (coalesced_requests.difficulty.number () > request.difficulty.number ())
+	{
+		request.difficulty = coalesced_requests.difficulty;
+		request.multiplier = coalesced_requests.multiplier;
+		update_attempts ();
+	}
+	else
+	{
+		coalesced_requests.difficulty = request.difficulty;
+		coalesced_requests.multiplier = request.multiplier;
+	}
+}
+
+uint64_t nano_pow_server::job::target () const
+{
+	std::lock_guard<std::mutex> lk (coalesced_requests.mutex);
+	return coalesced_requests.difficulty.number ().convert_to<uint64_t> ();
+}
+
+void nano_pow_server::job::add_driver (std::shared_ptr<nano_pow::driver> const & driver_a)
+{
+	std::lock_guard<std::mutex> lk (coalesced_requests.mutex);
+	driver_a->difficulty_set (coalesced_requests.difficulty.number ().convert_to<uint64_t> ());
+	auto & drivers (coalesced_requests.drivers);
+	if (std::find (drivers.begin (), drivers.end (), driver_a) == drivers.end ())
+	{
+		drivers.push_back (driver_a);
+	}
+}
+
+void nano_pow_server::job::remove_driver (std::shared_ptr<nano_pow::driver> const & driver_a)
+{
+	std::lock_guard<std::mutex> lk (coalesced_requests.mutex);
+	auto & drivers (coalesced_requests.drivers);
+	drivers.erase (std::remove (drivers.begin (), drivers.end (), driver_a), drivers.end ());
+}
+
+bool nano_pow_server::job::finish_search (uint64_t value_a)
+{
+	std::lock_guard<std::mutex> lk (coalesced_requests.mutex);
+	auto const meets (value_a >= coalesced_requests.difficulty.number ());
+	if (meets)
+	{
+		coalesced_requests.solved = true;
+		coalesced_requests.drivers.clear ();
+	}
+	return meets;
+}
+
+std::vector<nano_pow_server::job::waiter> nano_pow_server::job::close ()
+{
+	std::lock_guard<std::mutex> lk (coalesced_requests.mutex);
+	coalesced_requests.closed = true;
+	std::vector<waiter> result;
+	result.swap (coalesced_requests.waiters);
+	return result;
+}
+
+std::vector<nano_pow_server::job::waiter> nano_pow_server::job::expire (std::chrono::time_point<std::chrono::system_clock> now_a)
+{
+	std::lock_guard<std::mutex> lk (coalesced_requests.mutex);
+	auto & waiters (coalesced_requests.waiters);
+	auto expired (std::stable_partition (waiters.begin (), waiters.end (), [now_a](waiter const & waiter_a) { return waiter_a.deadline >= now_a; }));
+	std::vector<waiter> result (expired, waiters.end ());
+	waiters.erase (expired, waiters.end ());
+	if (!result.empty () && waiters.empty ())
+	{
+		coalesced_requests.closed = true;
+	}
+	return result;
+}
+
+void nano_pow_server::job::checkpoint (std::vector<nano_pow::nonce_range> const & unsearched_a)
+{
+	std::lock_guard<std::mutex> lk (search_state.mutex);
+	search_state.unsearched.insert (search_state.unsearched.end (), unsearched_a.begin (), unsearched_a.end ());
+}
+
+std::vector<nano_pow::nonce_range> nano_pow_server::job::take_checkpoint ()
+{
+	std::lock_guard<std::mutex> lk (search_state.mutex);
+	std::vector<nano_pow::nonce_range> result;
+	result.swap (search_state.unsearched);
+	return result;
+}
+
+bool nano_pow_server::job::closed () const
+{
+	std::lock_guard<std::mutex> lk (coalesced_requests.mutex);
+	return coalesced_requests.closed;
+}
+
+uint64_t nano_pow_server::client_rounds::assign (std::string const & client_a, unsigned weight_a)
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	if (clients.size () >= prune_size)
+	{
+		for (auto i (clients.begin ()); i != clients.end ();)
+		{
+			i = i->second.round < current_round ? clients.erase (i) : std::next (i);
+		}
+		prune_size = std::max (prune_size, clients.size () * 2);
+	}
+	auto & client_l (clients[client_a]);
+	if (client_l.round < current_round)
+	{
+		client_l.round = current_round;
+		client_l.used = 0;
+	}
+	auto const result (client_l.round);
+	if (++client_l.used >= std::max (1U, weight_a))
+	{
+		++client_l.round;
+		client_l.used = 0;
+	}
+	return result;
+}
+
+void nano_pow_server::client_rounds::dispatched (uint64_t round_a)
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	current_round = std::max (current_round, round_a);
+}
+
+uint64_t nano_pow_server::client_rounds::current () const
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	return current_round;
+}
+
+bool nano_pow_server::job_queue::push (job_handle const & job_a)
+{
+	auto inserted (jobs.insert (job_a));
+	if (inserted.second)
+	{
+		roots.emplace (job_a->request.root_hash, inserted.first);
+	}
+	return inserted.second;
+}
+
+nano_pow_server::job_handle nano_pow_server::job_queue::pop ()
+{
+	job_handle result;
+	if (!jobs.empty ())
+	{
+		auto next (std::prev (jobs.end ()));
+		auto range (roots.equal_range ((*next)->request.root_hash));
+		for (auto i (range.first); i != range.second; ++i)
+		{
+			if (i->second == next)
+			{
+				roots.erase (i);
+				break;
+			}
+		}
+		result = *next;
+		jobs.erase (next);
+	}
+	return result;
+}
+
+nano_pow_server::job_handle nano_pow_server::job_queue::find (u256 const & root_a) const
+{
+	auto existing (roots.find (root_a));
+	return existing != roots.end () ? *existing->second : nullptr;
+}
+
+std::vector<nano_pow_server::job_handle> nano_pow_server::job_queue::remove (u256 const & root_a)
+{
+	std::vector<job_handle> result;
+	auto range (roots.equal_range (root_a));
+	for (auto i (range.first); i != range.second; ++i)
+	{
+		result.push_back (*i->second);
+		jobs.erase (i->second);
+	}
+	roots.erase (range.first, range.second);
+	return result;
+}
+
+bool nano_pow_server::job_queue::erase (job_handle const & job_a)
+{
+	auto existing (jobs.find (job_a));
+	if (existing == jobs.end ())
+	{
+		return false;
+	}
+	auto range (roots.equal_range (job_a->request.root_hash));
+	for (auto i (range.first); i != range.second; ++i)
+	{
+		if (i->second == existing)
+		{
+			roots.erase (i);
+			break;
+		}
+	}
+	jobs.erase (existing);
+	return true;
+}
+
+constexpr size_t nano_pow_server::sharded_job_queue::shard_count;
+
+nano_pow_server::sharded_job_queue::sharded_job_queue (size_t limit_a)
+    : limit (limit_a)
+{
+}
+
+nano_pow_server::sharded_job_queue::push_result nano_pow_server::sharded_job_queue::push (job_handle const & job_a, std::function<bool(job_handle const &)> const & attach_a)
+{
+	auto & shard_l (shard_for (job_a->request.root_hash));
+	std::lock_guard<std::mutex> lk (shard_l.mutex);
+	return push (shard_l, job_a, attach_a);
+}
+
+std::vector<nano_pow_server::sharded_job_queue::push_result> nano_pow_server::sharded_job_queue::push (std::vector<job_handle> const & jobs_a, std::function<bool(size_t, job_handle const &)> const & attach_a)
+{
+	std::vector<push_result> result (jobs_a.size (), push_result::queued);
+	std::array<std::vector<size_t>, shard_count> indices;
+	for (size_t i (0); i < jobs_a.size (); ++i)
+	{
+		indices[root_hash () (jobs_a[i]->request.root_hash) % shard_count].push_back (i);
+	}
+	for (size_t shard_index (0); shard_index < shard_count; ++shard_index)
+	{
+		if (indices[shard_index].empty ())
+		{
+			continue;
+		}
+		auto & shard_l (shards[shard_index]);
+		std::lock_guard<std::mutex> lk (shard_l.mutex);
+		for (auto i : indices[shard_index])
+		{
+			result[i] = push (shard_l, jobs_a[i], [&attach_a, i](job_handle const & queued_a) { return attach_a (i, queued_a); });
+		}
+	}
+	return result;
+}
+
+nano_pow_server::sharded_job_queue::push_result nano_pow_server::sharded_job_queue::push (shard & shard_a, job_handle const & job_a, std::function<bool(job_handle const &)> const & attach_a)
+{
+	auto const queued (shard_a.queue.find (job_a->request.root_hash));
+	if (queued)
+	{
+		shard_a.queue.erase (queued);
+		shard_a.subtract (*queued);
+	}
+	auto const attached (attach_a (queued));
+	if (queued)
+	{
+		shard_a.queue.push (queued);
+		shard_a.add (*queued);
+	}
+	if (attached)
+	{
+		return push_result::attached;
+	}
+	if (size_.fetch_add (1) >= limit)
+	{
+		--size_;
+		return push_result::full;
+	}
+	if (shard_a.queue.push (job_a))
+	{
+		shard_a.add (*job_a);
+	}
+	else
+	{
+		--size_;
+	}
+	return push_result::queued;
+}
+
+void nano_pow_server::sharded_job_queue::requeue (job_handle const & job_a)
+{
+	auto & shard_l (shard_for (job_a->request.root_hash));
+	std::lock_guard<std::mutex> lk (shard_l.mutex);
+	if (shard_l.queue.push (job_a))
+	{
+		shard_l.add (*job_a);
+		++size_;
+	}
+}
+
+nano_pow_server::job_handle nano_pow_server::sharded_job_queue::pop ()
+{
+	job_handle result;
+	while (!result && size_ > 0)
+	{
+		// Find the shard with the next job. Another thread may take that job before it is popped, in which case
+		// the search starts over.
+		shard * next_shard (nullptr);
+		job_handle next;
+		for (auto & shard_l : shards)
+		{
+			std::lock_guard<std::mutex> lk (shard_l.mutex);
+			if (!shard_l.queue.empty () && (!next || job::comparator () (next, shard_l.queue.top ())))
+			{
+				next = shard_l.queue.top ();
+				next_shard = &shard_l;
+			}
+		}
+		if (!next)
+		{
+			break;
+		}
+		std::lock_guard<std::mutex> lk (next_shard->mutex);
+		if (!next_shard->queue.empty () && next_shard->queue.top () == next)
+		{
+			result = next_shard->queue.pop ();
+			next_shard->subtract (*result);
+			--size_;
+		}
+	}
+	return result;
+}
+
+std::vector<nano_pow_server::job_handle> nano_pow_server::sharded_job_queue::remove (u256 const & root_a)
+{
+	auto & shard_l (shard_for (root_a));
+	std::lock_guard<std::mutex> lk (shard_l.mutex);
+	auto result (shard_l.queue.remove (root_a));
+	for (auto const & job_l : result)
+	{
+		shard_l.subtract (*job_l);
+	}
+	size_ -= result.size ();
+	return result;
+}
+
+std::vector<nano_pow_server::job_handle> nano_pow_server::sharded_job_queue::clear ()
+{
+	std::vector<job_handle> result;
+	for (auto & shard_l : shards)
+	{
+		std::lock_guard<std::mutex> lk (shard_l.mutex);
+		result.insert (result.end (), shard_l.queue.begin (), shard_l.queue.end ());
+		size_ -= shard_l.queue.size ();
+		shard_l.queue.clear ();
+		shard_l.attempts = 0;
+	}
+	return result;
+}
+
+std::vector<nano_pow_server::job_handle> nano_pow_server::sharded_job_queue::jobs () const
+{
+	std::vector<job_handle> result;
+	for (auto const & shard_l : shards)
+	{
+		std::lock_guard<std::mutex> lk (shard_l.mutex);
+		result.insert (result.end (), shard_l.queue.begin (), shard_l.queue.end ());
+	}
+	// The comparator orders the next job last
+	std::sort (result.begin (), result.end (), [](job_handle const & lhs_a, job_handle const & rhs_a) { return job::comparator () (rhs_a, lhs_a); });
+	return result;
+}
+
+double nano_pow_server::sharded_job_queue::attempts () const
+{
+	double result (0);
+	for (auto const & shard_l : shards)
+	{
+		std::lock_guard<std::mutex> lk (shard_l.mutex);
+		result += shard_l.attempts;
+	}
+	return result;
+}
+
+void nano_pow_server::sharded_job_queue::shard::add (job const & job_a)
+{
+	attempts += job_a.get_attempts ();
+}
+
+void nano_pow_server::sharded_job_queue::shard::subtract (job const & job_a)
+{
+	// Restarting from zero once empty keeps rounding errors from accumulating
+	attempts = queue.empty () ? 0 : attempts - job_a.get_attempts ();
+}
@@ -0,0 +1,558 @@
+#pragma once
+
+#include <boost/optional.hpp>
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <workserver/pow.hpp>
+#include <workserver/util.hpp>
+
+namespace nano_pow_server
+{
+/**
+ * A job is a queued work generation request with an optional priority and deadline. Jobs are stable-sorted by
+ * priority, including any gained by aging, then by the rank of the scheduling policy, then by the fair queuing round of
+ * the client that created them, then earliest deadline first, with jobs without a deadline last. Jobs with the same
+ * deadline are FIFO.
+ * Jobs are not copied: the queues refer to a single record through a job_handle. The sort keys must not change
+ * while the job is queued.
+ */
+class job
+{
+public:
+	/** Constructor sets a unique job id */
+	job ();
+	job (job const &) = delete;
+	job & operator= (job const &) = delete;
+	/** When the job was created, which is when it was queued */
+	std::chrono::time_point<std::chrono::system_clock> queued_time;
+	std::chrono::time_point<std::chrono::system_clock> start_time;
+	std::chrono::time_point<std::chrono::system_clock> end_time;
+
+	struct request
+	{
+		u256 root_hash{ "0" };
+		u128 difficulty{ "0" };
+		double multiplier{ 1.0 };
+	} request;
+
+	struct result
+	{
+		u128 work{ "0" };
+		u128 difficulty{ "0" };
+		double multiplier{ 1.0 };
+	} result;
+
+	void start ()
+	{
+		start_time = std::chrono::system_clock::now ();
+	}
+
+	void stop ()
+	{
+		end_time = std::chrono::system_clock::now ();
+	}
+
+	std::chrono::milliseconds duration ()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds> (end_time - start_time);
+	}
+
+	unsigned get_job_id () const
+	{
+		return job_id;
+	}
+
+	/** Gives a job restored after a restart its original id. Ids of later jobs are higher. Call before queueing. */
+	void restore_id (unsigned job_id_a);
+
+	unsigned get_priority () const
+	{
+		return priority;
+	}
+
+	void set_priority (unsigned priority_a)
+	{
+		priority = priority_a;
+		priority_key = priority_a;
+	}
+
+	/**
+	 * Lets the job gain \p rate_a priority levels per second queued, up to \p cap_a. Call after set_priority.
+	 * The effective priority of an aged job at time t is min (priority + floor (rate * (t - queued)), cap). Comparing
+	 * two aged jobs at the same time t does not depend on t, so the queue order is fixed by a key computed once:
+	 * priority - floor (rate * queued). Aged keys never exceed the priority, and so stay below the cap and below
+	 * every job that does not age.
+	 */
+	void set_aging (double rate_a, unsigned cap_a);
+
+	/**
+	 * Takes on the higher priority, including any gained by aging, and the earlier deadline of \p job_a, a request
+	 * coalesced into this job, so that the job is dispatched no later than that request would have been. These are
+	 * sort keys, so the job must not be queued meanwhile.
+	 */
+	void merge (job const & job_a);
+
+	/** The time after which the client that created the job no longer waits for it. Jobs without a deadline have none. */
+	std::chrono::time_point<std::chrono::system_clock> get_deadline () const
+	{
+		return deadline;
+	}
+
+	void set_deadline (std::chrono::time_point<std::chrono::system_clock> deadline_a)
+	{
+		deadline = deadline_a;
+	}
+
+	bool has_deadline () const
+	{
+		return deadline != no_deadline ();
+	}
+
+	static std::chrono::time_point<std::chrono::system_clock> no_deadline ()
+	{
+		return std::chrono::time_point<std::chrono::system_clock>::max ();
+	}
+
+	/** The client that created the job, identified by its API key or remote address */
+	std::string const & get_client () const
+	{
+		return client;
+	}
+
+	void set_client (std::string const & client_a)
+	{
+		client = client_a;
+	}
+
+	/** Set by the scheduling policy from the job's expected cost. Within a priority, lower ranks are dispatched first. */
+	uint64_t get_rank () const
+	{
+		return rank;
+	}
+
+	void set_rank (uint64_t rank_a)
+	{
+		rank = rank_a;
+	}
+
+	/** The fair queuing round of the job, see client_rounds */
+	uint64_t get_round () const
+	{
+		return round;
+	}
+
+	void set_round (uint64_t round_a)
+	{
+		round = round_a;
+	}
+
+	/** Requests the job to stop. The stop token is checked by an active solve. */
+	void cancel ()
+	{
+		search_state.cancelled = true;
+		stop_token = true;
+	}
+
+	bool cancelled () const
+	{
+		return search_state.cancelled;
+	}
+
+	/** Stops the search, for instance once one of several devices found a solution, without cancelling the job */
+	void interrupt ()
+	{
+		stop_token = true;
+	}
+
+	/** Stops an active search so that the device can run a more urgent job. The job is resumed later. */
+	void preempt ()
+	{
+		search_state.preempted = true;
+		stop_token = true;
+	}
+
+	bool preempted () const
+	{
+		return search_state.preempted;
+	}
+
+	/** Clears the preemption of a job about to be queued again. A cancellation meanwhile still stops it. */
+	void resume ()
+	{
+		search_state.preempted = false;
+		stop_token = false;
+		if (search_state.cancelled)
+		{
+			stop_token = true;
+		}
+	}
+
+	/** Records nonce ranges that a stopped search did not get to */
+	void checkpoint (std::vector<nano_pow::nonce_range> const & unsearched_a);
+
+	/** Returns and clears the ranges left by a preempted search. Empty if the job was never preempted. */
+	std::vector<nano_pow::nonce_range> take_checkpoint ();
+
+	/** True if higher priority than \p other_a, including aging, so that this job may preempt it */
+	bool outranks (job const & other_a) const
+	{
+		return priority_key > other_a.priority_key;
+	}
+
+	/** The token checked by the solver working on this job */
+	std::atomic<bool> const & get_stop_token () const
+	{
+		return stop_token;
+	}
+
+	/** A client answered by this job: the request that created it, and any later request for the same root */
+	class waiter
+	{
+	public:
+		waiter (boost::optional<std::string> const & correlation_id_a, std::function<void(std::string)> const & response_handler_a, std::chrono::time_point<std::chrono::system_clock> deadline_a, std::function<void(boost::property_tree::ptree const &)> const & result_handler_a = nullptr);
+		boost::optional<std::string> correlation_id;
+		std::function<void(std::string)> response_handler;
+		/** The client gives up on the job after this time */
+		std::chrono::time_point<std::chrono::system_clock> deadline;
+		/** If set, receives the response instead of \p response_handler, so that it can be combined with others */
+		std::function<void(boost::property_tree::ptree const &)> result_handler;
+	};
+
+	/**
+	 * Adds \p waiter_a to the clients answered by this job. If \p difficulty_a is higher than the requested
+	 * difficulty, the job is raised to it: a queued job once it is dispatched, and a running job right away,
+	 * through the drivers searching for it. Returns false if the job has already been answered, or if it
+	 * already found a solution and \p difficulty_a is higher. Nothing changes in that case.
+	 */
+	bool attach (waiter const & waiter_a, u128 const & difficulty_a, double multiplier_a);
+
+	/**
+	 * Raises the request to the highest difficulty attached so far. Called when the job is dispatched, and when a
+	 * request is attached to the job while it is queued.
+	 */
+	void update_request ();
+
+	/** Expected number of nonces tried to solve the request, as of the last update_attempts */
+	double get_attempts () const
+	{
+		return attempts;
+	}
+
+	/**
+	 * Computes the expected attempts at the requested difficulty once, for the queue and admission estimates to
+	 * sum. Call once the request is set, before queueing. Must not change while the job is queued.
+	 */
+	void update_attempts ()
+	{
+		attempts = expected_attempts (request.difficulty);
+	}
+
+	/** Returns the difficulty the job must currently meet, including any raised while it runs */
+	uint64_t target () const;
+
+	/** Registers a driver searching for this job, unless it already is, and sets its difficulty to the current target */
+	void add_driver (std::shared_ptr<nano_pow::driver> const & driver_a);
+
+	/** Unregisters a driver that stopped searching for this job without a solution */
+	void remove_driver (std::shared_ptr<nano_pow::driver> const & driver_a);
+
+	/**
+	 * Ends the search if \p value_a meets the current target, and unregisters all drivers. Otherwise the target
+	 * was raised after the solution was found, and the search must go on.
+	 * @return true if the search ended
+	 */
+	bool finish_search (uint64_t value_a);
+
+	/** Returns the attached waiters and stops accepting new ones. Called once the job is answered. */
+	std::vector<waiter> close ();
+
+	/**
+	 * Removes and returns the waiters whose deadline passed before \p now_a. If no waiter is left, the job is
+	 * closed, as nobody waits for it anymore. Called before the job is dispatched.
+	 */
+	std::vector<waiter> expire (std::chrono::time_point<std::chrono::system_clock> now_a);
+
+	/** True if the job was closed, either because it was answered or because all its waiters expired */
+	bool closed () const;
+
+	/** Stable sorted priority queue */
+	struct comparator
+	{
+		bool operator() (job const & job1, job const & job2) const
+		{
+			if (job1.priority_key != job2.priority_key)
+			{
+				return job2.priority_key > job1.priority_key;
+			}
+			if (job1.rank != job2.rank)
+			{
+				return job1.rank > job2.rank;
+			}
+			// Deadlines only order jobs within a fair queuing round, so that a client cannot get ahead of the other
+			// clients by giving every request a deadline
+			if (job1.round != job2.round)
+			{
+				return job1.round > job2.round;
+			}
+			if (job1.deadline != job2.deadline)
+			{
+				return job1.deadline > job2.deadline;
+			}
+			return job1.job_id > job2.job_id;
+		}
+
+		bool operator() (std::shared_ptr<job> const & job1, std::shared_ptr<job> const & job2) const
+		{
+			return (*this) (*job1, *job2);
+		}
+	};
+
+private:
+	/** Requests coalesced into the job, and the drivers searching for it */
+	class coalesced
+	{
+	public:
+		mutable std::mutex mutex;
+		bool closed{ false };
+		/** Set once a solution meeting the target is found, after which the target can no longer be raised */
+		bool solved{ false };
+		std::vector<waiter> waiters;
+		/** Highest difficulty requested so far. Once the job is dispatched, this is its target. */
+		u128 difficulty{ "0" };
+		double multiplier{ 1.0 };
+		std::vector<std::shared_ptr<nano_pow::driver>> drivers;
+	};
+
+	unsigned priority{ 0 };
+	/** Sort key of the priority, which includes aging */
+	int64_t priority_key{ 0 };
+	unsigned job_id{ 0 };
+	std::chrono::time_point<std::chrono::system_clock> deadline{ no_deadline () };
+	uint64_t rank{ 0 };
+	uint64_t round{ 0 };
+	/** At the default difficulty of zero, the first attempt solves the job */
+	double attempts{ 1.0 };
+	std::string client;
+	/** Why the search stopped, and what it has left to search */
+	class search
+	{
+	public:
+		std::atomic<bool> cancelled{ false };
+		std::atomic<bool> preempted{ false };
+		std::mutex mutex;
+		std::vector<nano_pow::nonce_range> unsearched;
+	};
+
+	std::atomic<bool> stop_token{ false };
+	search search_state;
+	coalesced coalesced_requests;
+	static std::atomic<unsigned> job_id_dispenser;
+};
+
+/** A job record shared by the queue, the device queues, the active jobs and the history, see job_registry */
+using job_handle = std::shared_ptr<job>;
+
+/**
+ * Assigns the jobs of each client to weighted fair queuing rounds. A round holds up to the weight of every client
+ * in jobs, so that a client flooding the queue only pushes back its own later jobs. A client that was idle joins
+ * the current round without building up credit. Thread safe.
+ */
+class client_rounds
+{
+public:
+	/** Returns the round for the next job of \p client_a, which may have \p weight_a jobs in each round */
+	uint64_t assign (std::string const & client_a, unsigned weight_a);
+
+	/** Advances the current round to the round of a dispatched job, if that is later */
+	void dispatched (uint64_t round_a);
+
+	uint64_t current () const;
+
+private:
+	class client
+	{
+	public:
+		uint64_t round{ 0 };
+		/** Jobs assigned to the client's round so far */
+		unsigned used{ 0 };
+	};
+
+	mutable std::mutex mutex;
+	uint64_t current_round{ 0 };
+	std::unordered_map<std::string, client> clients;
+	/** Clients behind the current round are forgotten once the map reaches this size */
+	size_t prune_size{ 4096 };
+};
+
+/**
+ * Queue of jobs waiting for a device, in job::comparator order: highest priority first, then rank, fair queuing round
+ * and deadline.
+ * Jobs are kept in an ordered set and indexed by root hash, so pushing, popping and removing a root are
+ * O(log n), and checking whether a root is queued is O(1). Not thread safe.
+ */
+class job_queue
+{
+public:
+	using container = std::set<job_handle, job::comparator>;
+	/** Iterates over the queue in dispatch order */
+	using const_iterator = container::const_reverse_iterator;
+
+	job_queue () = default;
+	/** The index refers into the set, so queues are not copied */
+	job_queue (job_queue const &) = delete;
+	job_queue & operator= (job_queue const &) = delete;
+
+	/** Queues \p job_a. Returns false if a job with the same id is already queued. */
+	bool push (job_handle const & job_a);
+
+	/** Removes and returns the next job to dispatch, or nullptr if the queue is empty */
+	job_handle pop ();
+
+	/** Returns a queued job for \p root_a, or nullptr */
+	job_handle find (u256 const & root_a) const;
+
+	bool contains (u256 const & root_a) const
+	{
+		return roots.find (root_a) != roots.end ();
+	}
+
+	/** Removes all jobs for \p root_a and returns them */
+	std::vector<job_handle> remove (u256 const & root_a);
+
+	/** Removes \p job_a. Returns false if it is not queued. */
+	bool erase (job_handle const & job_a);
+
+	void clear ()
+	{
+		roots.clear ();
+		jobs.clear ();
+	}
+
+	size_t size () const
+	{
+		return jobs.size ();
+	}
+
+	bool empty () const
+	{
+		return jobs.empty ();
+	}
+
+	/** The next job to dispatch. The queue must not be empty. */
+	job_handle const & top () const
+	{
+		return *jobs.crbegin ();
+	}
+
+	const_iterator begin () const
+	{
+		return jobs.crbegin ();
+	}
+
+	const_iterator end () const
+	{
+		return jobs.crend ();
+	}
+
+private:
+	/** The comparator orders the next job to dispatch last */
+	container jobs;
+	std::unordered_multimap<u256, container::iterator, root_hash> roots;
+};
+
+/**
+ * Thread safe job queue for many submitting and dispatching threads. Jobs are split into shards by root hash,
+ * each an indexed job_queue with its own mutex, so that submissions for different roots rarely contend and
+ * all jobs for a root are in the same shard. Popping compares the next job of every shard, which keeps the
+ * global job::comparator order.
+ */
+class sharded_job_queue
+{
+public:
+	static constexpr size_t shard_count = 16;
+
+	enum class push_result
+	{
+		queued,
+		attached,
+		full
+	};
+
+	/** A queue of at most \p limit_a jobs */
+	explicit sharded_job_queue (size_t limit_a);
+
+	/**
+	 * Queues \p job_a, unless \p attach_a answers it with an existing job. \p attach_a is passed the job queued
+	 * for the same root, or nullptr, and returns true if it attached \p job_a elsewhere. It is called with the
+	 * root's shard locked, so that no other job for the root can be queued meanwhile. The queued job is taken out
+	 * of the queue while \p attach_a runs, so that it may change the job's sort keys.
+	 */
+	push_result push (job_handle const & job_a, std::function<bool(job_handle const &)> const & attach_a);
+
+	/**
+	 * Queues \p jobs_a as push does for a single job, locking each shard once for all of its jobs.
+	 * \p attach_a is also passed the index of the job.
+	 * @return the result for each job
+	 */
+	std::vector<push_result> push (std::vector<job_handle> const & jobs_a, std::function<bool(size_t, job_handle const &)> const & attach_a);
+
+	/** Queues \p job_a, which was queued before and was preempted, regardless of the limit */
+	void requeue (job_handle const & job_a);
+
+	/** Removes and returns the next job to dispatch, or nullptr if the queue is empty */
+	job_handle pop ();
+
+	/** Removes all jobs for \p root_a and returns them */
+	std::vector<job_handle> remove (u256 const & root_a);
+
+	/** Removes all jobs and returns them */
+	std::vector<job_handle> clear ();
+
+	/** Returns all queued jobs in dispatch order */
+	std::vector<job_handle> jobs () const;
+
+	size_t size () const
+	{
+		return size_;
+	}
+
+	/** The expected number of nonces to try to solve all queued jobs, at the difficulty they were queued with */
+	double attempts () const;
+
+private:
+	class shard
+	{
+	public:
+		mutable std::mutex mutex;
+		job_queue queue;
+		/** Sum of the expected attempts of the jobs in the queue */
+		double attempts{ 0 };
+
+		void add (job const & job_a);
+		void subtract (job const & job_a);
+	};
+
+	shard & shard_for (u256 const & root_a)
+	{
+		return shards[root_hash () (root_a) % shard_count];
+	}
+
+	/** Pushes \p job_a into \p shard_a, which must be locked */
+	push_result push (shard & shard_a, job_handle const & job_a, std::function<bool(job_handle const &)> const & attach_a);
+
+	size_t const limit;
+	std::atomic<size_t> size_{ 0 };
+	std::array<shard, shard_count> shards;
+};
+}
@@ -0,0 +1,131 @@
+#include <workserver/job_registry.hpp>
+
+nano_pow_server::slab::slab (size_t blocks_per_chunk_a)
+    : blocks_per_chunk (blocks_per_chunk_a)
+{
+}
+
+void * nano_pow_server::slab::allocate (size_t size_a)
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	if (block_size == 0)
+	{
+		// Blocks keep the alignment of the heap allocation they are carved from
+		auto const alignment (alignof (std::max_align_t));
+		block_size = (size_a + alignment - 1) / alignment * alignment;
+	}
+	if (size_a > block_size)
+	{
+		return ::operator new (size_a);
+	}
+	if (free.empty ())
+	{
+		chunks.emplace_back (new char[block_size * blocks_per_chunk]);
+		free.reserve (chunks.size () * blocks_per_chunk);
+		for (size_t i (blocks_per_chunk); i > 0; --i)
+		{
+			free.push_back (chunks.back ().get () + (i - 1) * block_size);
+		}
+	}
+	auto result (free.back ());
+	free.pop_back ();
+	return result;
+}
+
+void nano_pow_server::slab::deallocate (void * block_a, size_t size_a)
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	if (size_a > block_size)
+	{
+		::operator delete (block_a);
+	}
+	else
+	{
+		free.push_back (block_a);
+	}
+}
+
+size_t nano_pow_server::slab::capacity () const
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	return chunks.size () * blocks_per_chunk;
+}
+
+nano_pow_server::job_registry::job_registry (size_t history_a)
+    : slab (std::make_shared<nano_pow_server::slab> (256))
+    , completed (history_a)
+{
+}
+
+nano_pow_server::job_handle nano_pow_server::job_registry::create ()
+{
+	return std::allocate_shared<job> (slab_allocator<job> (slab));
+}
+
+void nano_pow_server::job_registry::add (job_handle const & job_a)
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	ids[job_a->get_job_id ()] = job_a;
+	roots[job_a->request.root_hash] = job_a;
+}
+
+void nano_pow_server::job_registry::remove (job const & job_a)
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	unindex (job_a);
+}
+
+void nano_pow_server::job_registry::complete (job_handle const & job_a)
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	if (completed.full ())
+	{
+		completed_ids.erase (completed.front ()->get_job_id ());
+		unindex (*completed.front ());
+	}
+	completed.push_back (job_a);
+	completed_ids.insert (job_a->get_job_id ());
+}
+
+bool nano_pow_server::job_registry::solved (job const & job_a) const
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	return completed_ids.find (job_a.get_job_id ()) != completed_ids.end ();
+}
+
+nano_pow_server::job_handle nano_pow_server::job_registry::find (unsigned id_a) const
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	auto existing (ids.find (id_a));
+	return existing != ids.end () ? existing->second : nullptr;
+}
+
+nano_pow_server::job_handle nano_pow_server::job_registry::find (u256 const & root_a) const
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	auto existing (roots.find (root_a));
+	return existing != roots.end () ? existing->second : nullptr;
+}
+
+std::vector<nano_pow_server::job_handle> nano_pow_server::job_registry::history () const
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	return std::vector<job_handle> (completed.begin (), completed.end ());
+}
+
+size_t nano_pow_server::job_registry::size () const
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	return ids.size ();
+}
+
+void nano_pow_server::job_registry::unindex (job const & job_a)
+{
+	ids.erase (job_a.get_job_id ());
+	// A later job for the root stays indexed
+	auto existing (roots.find (job_a.request.root_hash));
+	if (existing != roots.end () && existing->second->get_job_id () == job_a.get_job_id ())
+	{
+		roots.erase (existing);
+	}
+}
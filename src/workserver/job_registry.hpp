@@ -0,0 +1,132 @@
+#pragma once
+
+#include <boost/circular_buffer.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <workserver/job_queue.hpp>
+
+namespace nano_pow_server
+{
+/**
+ * Fixed size blocks carved from chunks, and recycled through a free list, so that job records are not allocated from
+ * the heap one by one. The block size is that of the first allocation; larger allocations go to the heap. Thread safe.
+ */
+class slab
+{
+public:
+	explicit slab (size_t blocks_per_chunk_a);
+
+	void * allocate (size_t size_a);
+	void deallocate (void * block_a, size_t size_a);
+
+	/** Number of blocks in all chunks, whether in use or free */
+	size_t capacity () const;
+
+private:
+	size_t const blocks_per_chunk;
+	mutable std::mutex mutex;
+	size_t block_size{ 0 };
+	std::vector<std::unique_ptr<char[]>> chunks;
+	std::vector<void *> free;
+};
+
+/** Allocates from a shared slab, which each allocation keeps alive */
+template <typename T>
+class slab_allocator
+{
+public:
+	using value_type = T;
+
+	explicit slab_allocator (std::shared_ptr<nano_pow_server::slab> const & slab_a)
+	    : slab (slab_a)
+	{
+	}
+
+	template <typename U>
+	slab_allocator (slab_allocator<U> const & other_a)
+	    : slab (other_a.slab)
+	{
+	}
+
+	T * allocate (size_t count_a)
+	{
+		return static_cast<T *> (slab->allocate (count_a * sizeof (T)));
+	}
+
+	void deallocate (T * block_a, size_t count_a)
+	{
+		slab->deallocate (block_a, count_a * sizeof (T));
+	}
+
+	template <typename U>
+	bool operator== (slab_allocator<U> const & other_a) const
+	{
+		return slab == other_a.slab;
+	}
+
+	template <typename U>
+	bool operator!= (slab_allocator<U> const & other_a) const
+	{
+		return slab != other_a.slab;
+	}
+
+	std::shared_ptr<nano_pow_server::slab> slab;
+};
+
+/**
+ * Owns the record of every job from its creation until it leaves the history of solved jobs. The queue, the device
+ * queues, the active jobs and the history all hold handles to the same record instead of copies of the job.
+ * Queued and active jobs are indexed by job id and root hash, so looking up the status of a job is O(1). Thread safe.
+ */
+class job_registry
+{
+public:
+	/** Keeps the last \p history_a solved jobs */
+	explicit job_registry (size_t history_a);
+
+	/** Creates a job record. The job is not indexed until it is added. */
+	job_handle create ();
+
+	/** Indexes \p job_a by id and root hash. The job is found by its root until a later job for the root is added. */
+	void add (job_handle const & job_a);
+
+	/** Drops \p job_a from the index, once it ended without a solution */
+	void remove (job const & job_a);
+
+	/** Moves the solved \p job_a to the history. The oldest solved job is dropped from the index if the history is full. */
+	void complete (job_handle const & job_a);
+
+	/** Returns the indexed job with \p id_a, or nullptr */
+	job_handle find (unsigned id_a) const;
+
+	/** Returns the latest indexed job for \p root_a, or nullptr */
+	job_handle find (u256 const & root_a) const;
+
+	/** True if \p job_a is in the history of solved jobs */
+	bool solved (job const & job_a) const;
+
+	/** Returns the solved jobs in the history, oldest first */
+	std::vector<job_handle> history () const;
+
+	/** Number of indexed jobs */
+	size_t size () const;
+
+private:
+	/** Drops \p job_a from the index, with the mutex locked */
+	void unindex (job const & job_a);
+
+	std::shared_ptr<nano_pow_server::slab> slab;
+	mutable std::mutex mutex;
+	std::unordered_map<unsigned, job_handle> ids;
+	std::unordered_map<u256, job_handle, root_hash> roots;
+	boost::circular_buffer<job_handle> completed;
+	/** Ids of the jobs in the history */
+	std::unordered_set<unsigned> completed_ids;
+};
+}
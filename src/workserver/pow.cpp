@@ -0,0 +1,272 @@
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <workserver/blake2b.hpp>
+#include <workserver/pow.hpp>
+
+namespace
+{
+/** Number of nonces tried between checks of the stop flag. This is a multiple of every kernel's lane count. */
+constexpr uint64_t search_batch = 1024;
+}
+
+uint64_t nano_pow::difficulty (root const & root_a, uint64_t nonce_a)
+{
+	uint8_t nonce_bytes[sizeof (nonce_a)];
+	for (size_t i = 0; i < sizeof (nonce_a); ++i)
+	{
+		nonce_bytes[i] = static_cast<uint8_t> (nonce_a >> (8 * i));
+	}
+
+	nano_pow::blake2b hash (sizeof (uint64_t));
+	hash.update (nonce_bytes, sizeof (nonce_bytes));
+	hash.update (root_a.data (), root_a.size ());
+
+	uint8_t digest[sizeof (uint64_t)];
+	hash.final (digest);
+	uint64_t result = 0;
+	for (int i = sizeof (digest) - 1; i >= 0; --i)
+	{
+		result = (result << 8) | digest[i];
+	}
+	return result;
+}
+
+bool nano_pow::passes (root const & root_a, uint64_t nonce_a, uint64_t difficulty_a)
+{
+	return difficulty (root_a, nonce_a) >= difficulty_a;
+}
+
+uint64_t nano_pow::random_nonce ()
+{
+	thread_local std::mt19937_64 generator{ std::random_device{}() };
+	return generator ();
+}
+
+std::vector<nano_pow::nonce_range> nano_pow::partition (uint64_t begin_a, std::vector<double> const & weights_a)
+{
+	double total (0);
+	for (auto weight : weights_a)
+	{
+		total += weight;
+	}
+
+	std::vector<nonce_range> result;
+	// The space holds 2^64 nonces, which only the arithmetic below wrapping around at 2^64 can count
+	auto const space (std::numeric_limits<uint64_t>::max ());
+	uint64_t assigned (0);
+	for (size_t i = 0; i < weights_a.size (); ++i)
+	{
+		nonce_range range;
+		range.begin = begin_a + assigned;
+		if (i + 1 == weights_a.size ())
+		{
+			// The last range takes the remainder, so rounding never leaves a gap. If nothing was assigned yet, the
+			// remainder is the whole space.
+			range.size = 0 - assigned;
+			range.full = assigned == 0;
+		}
+		else
+		{
+			auto const share (total > 0 ? weights_a[i] / total : 1.0 / weights_a.size ());
+			auto const size (static_cast<long double> (share) * (static_cast<long double> (space) + 1));
+			range.size = std::min (static_cast<uint64_t> (std::min (size, static_cast<long double> (space))), space - assigned);
+		}
+		assigned += range.size;
+		result.push_back (range);
+	}
+	return result;
+}
+
+nano_pow::cpp_driver::cpp_driver (unsigned threads_a, nano_pow::kernel const & kernel_a)
+    : kernel (kernel_a)
+{
+	threads_set (threads_a);
+}
+
+std::vector<uint64_t> nano_pow::driver::take_skipped ()
+{
+	std::lock_guard<std::mutex> lk (skipped_mutex);
+	std::vector<uint64_t> result;
+	result.swap (skipped);
+	return result;
+}
+
+void nano_pow::driver::skip (uint64_t solution_a)
+{
+	// Difficulty changes are rare, but nothing bounds the skips of a driver whose solutions are never taken
+	std::size_t const max_skipped (16);
+	++skipped_total;
+	std::lock_guard<std::mutex> lk (skipped_mutex);
+	if (skipped.size () < max_skipped)
+	{
+		skipped.push_back (solution_a);
+	}
+}
+
+void nano_pow::cpp_driver::difficulty_set (uint64_t difficulty_a)
+{
+	difficulty = difficulty_a;
+}
+
+uint64_t nano_pow::cpp_driver::difficulty_get () const
+{
+	return difficulty;
+}
+
+void nano_pow::cpp_driver::threads_set (unsigned threads_a)
+{
+	threads = threads_a != 0 ? threads_a : std::max (1U, std::thread::hardware_concurrency ());
+}
+
+unsigned nano_pow::cpp_driver::threads_get () const
+{
+	return threads;
+}
+
+std::string nano_pow::cpp_driver::description () const
+{
+	return std::string ("cpu/") + kernel.name;
+}
+
+double nano_pow::cpp_driver::hashrate () const
+{
+	auto const microseconds (total_microseconds.load ());
+	return microseconds > 0 ? static_cast<double> (total_attempts) * 1e6 / microseconds : 0.0;
+}
+
+boost::optional<uint64_t> nano_pow::cpp_driver::solve_range (root const & root_a, std::atomic<bool> const & stop_a, nonce_range const & range_a, std::vector<nonce_range> * unsearched_a)
+{
+	std::lock_guard<std::mutex> lk (solve_mutex);
+
+	auto const thread_count (threads.load ());
+	auto const words (to_root_words (root_a));
+	// Each thread gets an equally sized, disjoint slice of the range. The last one also gets the remainder. The
+	// 2^64 nonces of a full range wrap around to a size of 0, and are sliced as if counted.
+	auto const size (range_a.full ? 0 : range_a.size);
+	auto const slice (range_a.full ? (std::numeric_limits<uint64_t>::max () - (thread_count - 1)) / thread_count + 1 : size / thread_count);
+	auto const start_time (std::chrono::steady_clock::now ());
+
+	std::atomic<bool> found{ false };
+	std::atomic<uint64_t> solution{ 0 };
+	std::atomic<uint64_t> attempts{ 0 };
+	// The rest of each thread's slice when the search stopped
+	std::vector<nonce_range> remainders (thread_count);
+	auto search = [&](unsigned index_a) {
+		uint64_t nonce (range_a.begin + index_a * slice);
+		uint64_t remaining (index_a + 1 == thread_count ? size - index_a * slice : slice);
+		// A single thread searching a full range has 2^64 nonces left, which remaining only counts once it has
+		// searched any
+		bool whole (range_a.full && thread_count == 1);
+		auto const capped = [&remaining, &whole](uint64_t count_a) { return whole ? count_a : std::min (count_a, remaining); };
+		uint64_t attempts_l (0);
+		uint64_t result;
+		while ((whole || remaining > 0) && !found.load (std::memory_order_relaxed) && !stop_a.load (std::memory_order_relaxed))
+		{
+			// Kernels round the count up to their lane count, so the final batch may overlap the next slice slightly
+			auto const count (capped (search_batch));
+			// A difficulty raised during the solve applies from the next batch on
+			if (kernel.search (words.data (), nonce, count, difficulty.load (std::memory_order_relaxed), result))
+			{
+				auto const searched (capped (result - nonce + 1));
+				attempts_l += searched;
+				nonce = result + 1;
+				remaining -= searched;
+				whole = false;
+				if (nano_pow::difficulty (root_a, result) >= difficulty.load ())
+				{
+					if (!found.exchange (true))
+					{
+						solution = result;
+					}
+					break;
+				}
+				// The solution only meets the difficulty the batch started with. It is recorded for the caller, and the
+				// search resumes after it.
+				skip (result);
+				continue;
+			}
+			nonce += count;
+			remaining -= count;
+			whole = false;
+			attempts_l += count;
+		}
+		attempts += attempts_l;
+		remainders[index_a].begin = nonce;
+		remainders[index_a].size = remaining;
+		remainders[index_a].full = whole;
+	};
+
+	// The calling thread does its share of the search
+	std::vector<std::thread> workers;
+	workers.reserve (thread_count - 1);
+	for (unsigned i = 1; i < thread_count; ++i)
+	{
+		workers.emplace_back (search, i);
+	}
+	search (0);
+	for (auto & worker : workers)
+	{
+		worker.join ();
+	}
+
+	total_attempts += attempts;
+	total_microseconds += std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - start_time).count ();
+
+	boost::optional<uint64_t> result;
+	if (found)
+	{
+		result = solution.load ();
+	}
+	if (unsearched_a != nullptr)
+	{
+		for (auto const & remainder : remainders)
+		{
+			if (remainder.full || remainder.size > 0)
+			{
+				unsearched_a->push_back (remainder);
+			}
+		}
+	}
+	return result;
+}
+
+void nano_pow::opencl_driver::difficulty_set (uint64_t difficulty_a)
+{
+	difficulty = difficulty_a;
+}
+
+uint64_t nano_pow::opencl_driver::difficulty_get () const
+{
+	return difficulty;
+}
+
+void nano_pow::opencl_driver::threads_set (unsigned threads_a)
+{
+	threads = threads_a;
+}
+
+unsigned nano_pow::opencl_driver::threads_get () const
+{
+	return threads;
+}
+
+std::string nano_pow::opencl_driver::description () const
+{
+	return "opencl";
+}
+
+double nano_pow::opencl_driver::hashrate () const
+{
+	return 0.0;
+}
+
+boost::optional<uint64_t> nano_pow::opencl_driver::solve_range (root const &, std::atomic<bool> const &, nonce_range const &, std::vector<nonce_range> *)
+{
+	throw std::runtime_error ("OpenCL work generation is not supported by this build");
+}
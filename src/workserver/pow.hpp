@@ -0,0 +1,156 @@
+#pragma once
+
+#include <boost/optional.hpp>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <workserver/pow_kernels.hpp>
+
+namespace nano_pow
+{
+/** A 256-bit work root, in the same big-endian byte order as nano_pow_server::u256::bytes */
+using root = std::array<uint8_t, 32>;
+
+/**
+ * Returns the work value of \p nonce_a for \p root_a, which is the 64-bit Blake2b digest of the
+ * little-endian nonce followed by the root. Higher values represent more work.
+ */
+uint64_t difficulty (root const & root_a, uint64_t nonce_a);
+
+/** Returns true if the work value of \p nonce_a meets \p difficulty_a */
+bool passes (root const & root_a, uint64_t nonce_a, uint64_t difficulty_a);
+
+/** Returns a random nonce, used as the start of a search so that repeated solves for a root differ */
+uint64_t random_nonce ();
+
+/** A contiguous slice of the nonce space, which wraps around at 2^64 */
+class nonce_range
+{
+public:
+	uint64_t begin{ 0 };
+	/** Number of nonces in the range, unless it is full */
+	uint64_t size{ 0 };
+	/** The range holds all 2^64 nonces, one more than \p size can count */
+	bool full{ false };
+};
+
+/**
+ * Splits the nonce space into consecutive ranges, starting at \p begin_a, with sizes proportional to \p weights_a.
+ * Weights must not be negative. If they are all zero, the ranges are equally sized. Together the ranges hold every
+ * nonce once, so a single weight yields a full range.
+ */
+std::vector<nonce_range> partition (uint64_t begin_a, std::vector<double> const & weights_a);
+
+/**
+ * Work generation backend. A driver runs a single solve at a time. The difficulty may be raised while a solve
+ * is in progress, in which case the search continues with the new difficulty without repeating any nonces.
+ */
+class driver
+{
+public:
+	virtual ~driver () = default;
+	virtual void difficulty_set (uint64_t difficulty_a) = 0;
+	virtual uint64_t difficulty_get () const = 0;
+	virtual void threads_set (unsigned threads_a) = 0;
+	virtual unsigned threads_get () const = 0;
+	/** Sets the memory available for a search table, in bytes. Drivers that search without a table ignore this. */
+	virtual void memory_set (uint64_t)
+	{
+	}
+	virtual uint64_t memory_get () const
+	{
+		return 0;
+	}
+	/** Returns a short description of the backend, for logging */
+	virtual std::string description () const = 0;
+	/** Returns the measured hashes per second over all solves so far, or zero if nothing has been measured */
+	virtual double hashrate () const = 0;
+
+	/**
+	 * Searches the nonces in \p range_a for one whose work value for \p root_a meets the current difficulty.
+	 * Blocks until a solution is found, or returns boost::none if the range is exhausted or as soon as
+	 * \p stop_a is set by another thread. If \p unsearched_a is set, the nonces of the range that were not searched
+	 * are appended to it, so that the search can be resumed without repeating any. This includes the nonces after a
+	 * solution, in case the caller rejects it.
+	 */
+	virtual boost::optional<uint64_t> solve_range (root const & root_a, std::atomic<bool> const & stop_a, nonce_range const & range_a, std::vector<nonce_range> * unsearched_a = nullptr) = 0;
+
+	/** Searches the whole nonce space, starting at a random nonce */
+	boost::optional<uint64_t> solve (root const & root_a, std::atomic<bool> const & stop_a)
+	{
+		nonce_range range;
+		range.begin = random_nonce ();
+		range.full = true;
+		return solve_range (root_a, stop_a, range);
+	}
+
+	/**
+	 * Returns and forgets the solutions skipped by the last solves: they met the difficulty a batch of the search
+	 * started with, but not the difficulty it was raised to since. Only the most recent are kept.
+	 */
+	std::vector<uint64_t> take_skipped ();
+
+	/** Number of solutions skipped over all solves */
+	uint64_t skipped_count () const
+	{
+		return skipped_total;
+	}
+
+protected:
+	/** Records \p solution_a as skipped. Called by solves. */
+	void skip (uint64_t solution_a);
+
+private:
+	std::mutex skipped_mutex;
+	std::vector<uint64_t> skipped;
+	std::atomic<uint64_t> skipped_total{ 0 };
+};
+
+/** Multithreaded CPU driver. Each thread searches its own slice of the nonce range using a search kernel. */
+class cpp_driver : public driver
+{
+public:
+	/** Uses \p threads_a search threads, or one per hardware thread if zero */
+	cpp_driver (unsigned threads_a = 0, nano_pow::kernel const & kernel_a = best_kernel ());
+	void difficulty_set (uint64_t difficulty_a) override;
+	uint64_t difficulty_get () const override;
+	void threads_set (unsigned threads_a) override;
+	unsigned threads_get () const override;
+	std::string description () const override;
+	double hashrate () const override;
+	boost::optional<uint64_t> solve_range (root const & root_a, std::atomic<bool> const & stop_a, nonce_range const & range_a, std::vector<nonce_range> * unsearched_a = nullptr) override;
+
+private:
+	nano_pow::kernel const & kernel;
+	std::atomic<uint64_t> difficulty{ 0 };
+	std::atomic<unsigned> threads{ 1 };
+	/** Totals for the hashrate measurement, updated after each solve */
+	std::atomic<uint64_t> total_attempts{ 0 };
+	std::atomic<uint64_t> total_microseconds{ 0 };
+	/** Serializes solves */
+	std::mutex solve_mutex;
+};
+
+/** Placeholder for the OpenCL backend, which is not part of this build */
+class opencl_driver : public driver
+{
+public:
+	void difficulty_set (uint64_t difficulty_a) override;
+	uint64_t difficulty_get () const override;
+	void threads_set (unsigned threads_a) override;
+	unsigned threads_get () const override;
+	std::string description () const override;
+	double hashrate () const override;
+	boost::optional<uint64_t> solve_range (root const & root_a, std::atomic<bool> const & stop_a, nonce_range const & range_a, std::vector<nonce_range> * unsearched_a = nullptr) override;
+
+private:
+	uint64_t difficulty{ 0 };
+	unsigned threads{ 0 };
+};
+}
@@ -0,0 +1,192 @@
+#include <workserver/pow_kernels.hpp>
+#include <workserver/pow_kernels_impl.hpp>
+
+#if defined(NANO_POW_SERVER_X86_KERNELS)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace
+{
+/** Portable fallback, hashing one nonce per lane */
+class scalar_ops
+{
+public:
+	using vec = uint64_t;
+	static constexpr unsigned width = 1;
+
+	static vec set1 (uint64_t value_a)
+	{
+		return value_a;
+	}
+	static vec nonces (uint64_t base_a)
+	{
+		return base_a;
+	}
+	static vec load (uint64_t const * values_a)
+	{
+		return *values_a;
+	}
+	static void store (uint64_t * values_a, vec value_a)
+	{
+		*values_a = value_a;
+	}
+	static vec add (vec a, vec b)
+	{
+		return a + b;
+	}
+	static vec xor_ (vec a, vec b)
+	{
+		return a ^ b;
+	}
+	static vec rotr32 (vec a)
+	{
+		return (a >> 32) | (a << 32);
+	}
+	static vec rotr24 (vec a)
+	{
+		return (a >> 24) | (a << 40);
+	}
+	static vec rotr16 (vec a)
+	{
+		return (a >> 16) | (a << 48);
+	}
+	static vec rotr63 (vec a)
+	{
+		return (a >> 63) | (a << 1);
+	}
+	static unsigned passing (vec value_a, uint64_t difficulty_a)
+	{
+		return value_a >= difficulty_a ? 1U : 0U;
+	}
+};
+
+#if defined(NANO_POW_SERVER_X86_KERNELS)
+class cpu_features
+{
+public:
+	cpu_features ()
+	{
+		uint32_t regs[4];
+		cpuid (0, regs);
+		auto const max_leaf (regs[0]);
+
+		cpuid (1, regs);
+		sse41 = (regs[2] & (1U << 19)) != 0;
+		// The OS must save the wider register state on context switches before AVX can be used
+		bool const osxsave ((regs[2] & (1U << 27)) != 0);
+		uint64_t const xcr0 (osxsave ? xgetbv () : 0);
+		bool const ymm_enabled ((xcr0 & 0x6) == 0x6);
+		bool const zmm_enabled ((xcr0 & 0xe6) == 0xe6);
+
+		if (max_leaf >= 7)
+		{
+			cpuid (7, regs);
+			avx2 = ymm_enabled && (regs[1] & (1U << 5)) != 0;
+			avx512 = zmm_enabled && (regs[1] & (1U << 16)) != 0;
+		}
+	}
+
+	bool sse41{ false };
+	bool avx2{ false };
+	bool avx512{ false };
+
+private:
+	static void cpuid (uint32_t leaf_a, uint32_t (&regs_a)[4])
+	{
+#if defined(_MSC_VER)
+		int regs_l[4];
+		__cpuidex (regs_l, static_cast<int> (leaf_a), 0);
+		for (int i = 0; i < 4; ++i)
+		{
+			regs_a[i] = static_cast<uint32_t> (regs_l[i]);
+		}
+#else
+		__cpuid_count (leaf_a, 0, regs_a[0], regs_a[1], regs_a[2], regs_a[3]);
+#endif
+	}
+
+	static uint64_t xgetbv ()
+	{
+#if defined(_MSC_VER)
+		return _xgetbv (0);
+#else
+		uint32_t eax, edx;
+		__asm__ volatile("xgetbv"
+		                 : "=a"(eax), "=d"(edx)
+		                 : "c"(0));
+		return (static_cast<uint64_t> (edx) << 32) | eax;
+#endif
+	}
+};
+#endif
+}
+
+bool nano_pow::search_scalar (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a)
+{
+	return lanes::search_specialized<scalar_ops> (root_a, nonce_a, count_a, difficulty_a, result_a);
+}
+
+bool nano_pow::search_scalar_generic (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a)
+{
+	return lanes::search<scalar_ops> (root_a, nonce_a, count_a, difficulty_a, result_a);
+}
+
+void nano_pow::values_scalar (uint64_t const * roots_a, uint64_t const * nonces_a, size_t count_a, uint64_t * values_a)
+{
+	lanes::values<scalar_ops> (roots_a, nonces_a, count_a, values_a);
+}
+
+nano_pow::root_words nano_pow::to_root_words (std::array<uint8_t, 32> const & root_a)
+{
+	root_words result;
+	for (size_t word = 0; word < result.size (); ++word)
+	{
+		uint64_t value = 0;
+		for (int i = 7; i >= 0; --i)
+		{
+			value = (value << 8) | root_a[word * 8 + i];
+		}
+		result[word] = value;
+	}
+	return result;
+}
+
+std::vector<nano_pow::kernel> const & nano_pow::supported_kernels ()
+{
+	static std::vector<kernel> const kernels = [] {
+		std::vector<kernel> result;
+		std::vector<kernel> generic;
+#if defined(NANO_POW_SERVER_X86_KERNELS)
+		cpu_features const features;
+		if (features.avx512)
+		{
+			result.push_back ({ "avx512", 8, &search_avx512, &values_avx512 });
+			generic.push_back ({ "avx512-generic", 8, &search_avx512_generic, &values_avx512 });
+		}
+		if (features.avx2)
+		{
+			result.push_back ({ "avx2", 4, &search_avx2, &values_avx2 });
+			generic.push_back ({ "avx2-generic", 4, &search_avx2_generic, &values_avx2 });
+		}
+		if (features.sse41)
+		{
+			result.push_back ({ "sse4.1", 2, &search_sse41, &values_sse41 });
+			generic.push_back ({ "sse4.1-generic", 2, &search_sse41_generic, &values_sse41 });
+		}
+#endif
+		result.push_back ({ "scalar", 1, &search_scalar, &values_scalar });
+		generic.push_back ({ "scalar-generic", 1, &search_scalar_generic, &values_scalar });
+		result.insert (result.end (), generic.begin (), generic.end ());
+		return result;
+	}();
+	return kernels;
+}
+
+nano_pow::kernel const & nano_pow::best_kernel ()
+{
+	return supported_kernels ().front ();
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nano_pow
+{
+/** The root as the four little-endian message words hashed after the nonce */
+using root_words = std::array<uint64_t, 4>;
+
+/**
+ * A nonce search kernel. Kernels hash several nonces per instruction stream where the CPU allows it, and
+ * are selected at runtime based on CPUID.
+ */
+class kernel
+{
+public:
+	/**
+	 * Hashes the nonces [nonce_a, nonce_a + count_a) for the four root words \p root_a and stores the first
+	 * nonce found whose work value meets \p difficulty_a in \p result_a. The count is rounded up to a multiple
+	 * of the lane count.
+	 * @return true if a solution was found
+	 */
+	using search_function = bool (*) (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a);
+	/**
+	 * Stores the work values of \p count_a independent (root, nonce) pairs in \p values_a. \p roots_a holds four
+	 * root words per pair. Used for validation, where every pair can have a different root.
+	 */
+	using values_function = void (*) (uint64_t const * roots_a, uint64_t const * nonces_a, size_t count_a, uint64_t * values_a);
+
+	char const * name;
+	/** Number of nonces hashed per iteration */
+	unsigned lanes;
+	search_function search;
+	values_function values;
+};
+
+/** Converts a root to the message words used by the kernels */
+root_words to_root_words (std::array<uint8_t, 32> const & root_a);
+
+/**
+ * Returns the kernels supported by this CPU: the specialized kernels fastest first, followed by their generic
+ * counterparts. The portable scalar kernels are always available.
+ */
+std::vector<kernel> const & supported_kernels ();
+
+/** Returns the fastest supported kernel */
+kernel const & best_kernel ();
+
+/**
+ * Kernel entry points. The SIMD variants must only be called if supported_kernels () lists them. Their
+ * translation units are compiled with ISA specific flags, so they take plain pointers rather than sharing
+ * inline library code with the rest of the program.
+ *
+ * The default kernels are specialized for the fixed size PoW message at compile time. The generic variants
+ * run the regular Blake2b message schedule and are kept as a baseline for tests and benchmarks.
+ */
+bool search_scalar (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a);
+bool search_scalar_generic (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a);
+bool search_sse41 (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a);
+bool search_sse41_generic (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a);
+bool search_avx2 (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a);
+bool search_avx2_generic (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a);
+bool search_avx512 (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a);
+bool search_avx512_generic (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a);
+void values_scalar (uint64_t const * roots_a, uint64_t const * nonces_a, size_t count_a, uint64_t * values_a);
+void values_sse41 (uint64_t const * roots_a, uint64_t const * nonces_a, size_t count_a, uint64_t * values_a);
+void values_avx2 (uint64_t const * roots_a, uint64_t const * nonces_a, size_t count_a, uint64_t * values_a);
+void values_avx512 (uint64_t const * roots_a, uint64_t const * nonces_a, size_t count_a, uint64_t * values_a);
+}
@@ -0,0 +1,78 @@
+#include <immintrin.h>
+
+#include <workserver/pow_kernels.hpp>
+#include <workserver/pow_kernels_impl.hpp>
+
+namespace
+{
+/** Four 64-bit lanes per 256-bit register */
+class avx2_ops
+{
+public:
+	using vec = __m256i;
+	static constexpr unsigned width = 4;
+
+	static vec set1 (uint64_t value_a)
+	{
+		return _mm256_set1_epi64x (static_cast<long long> (value_a));
+	}
+	static vec nonces (uint64_t base_a)
+	{
+		return _mm256_add_epi64 (set1 (base_a), _mm256_setr_epi64x (0, 1, 2, 3));
+	}
+	static vec load (uint64_t const * values_a)
+	{
+		return _mm256_loadu_si256 (reinterpret_cast<__m256i const *> (values_a));
+	}
+	static void store (uint64_t * values_a, vec value_a)
+	{
+		_mm256_storeu_si256 (reinterpret_cast<__m256i *> (values_a), value_a);
+	}
+	static vec add (vec a, vec b)
+	{
+		return _mm256_add_epi64 (a, b);
+	}
+	static vec xor_ (vec a, vec b)
+	{
+		return _mm256_xor_si256 (a, b);
+	}
+	static vec rotr32 (vec a)
+	{
+		return _mm256_shuffle_epi32 (a, _MM_SHUFFLE (2, 3, 0, 1));
+	}
+	static vec rotr24 (vec a)
+	{
+		return _mm256_shuffle_epi8 (a, _mm256_setr_epi8 (3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10, 3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10));
+	}
+	static vec rotr16 (vec a)
+	{
+		return _mm256_shuffle_epi8 (a, _mm256_setr_epi8 (2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9, 2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9));
+	}
+	static vec rotr63 (vec a)
+	{
+		return _mm256_or_si256 (_mm256_srli_epi64 (a, 63), _mm256_add_epi64 (a, a));
+	}
+	/** AVX2 only has signed 64-bit comparisons, so both sides are biased by the sign bit */
+	static unsigned passing (vec value_a, uint64_t difficulty_a)
+	{
+		auto const bias (set1 (0x8000000000000000ULL));
+		auto const below (_mm256_cmpgt_epi64 (_mm256_xor_si256 (set1 (difficulty_a), bias), _mm256_xor_si256 (value_a, bias)));
+		return ~static_cast<unsigned> (_mm256_movemask_pd (_mm256_castsi256_pd (below))) & 0xfU;
+	}
+};
+}
+
+bool nano_pow::search_avx2 (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a)
+{
+	return lanes::search_specialized<avx2_ops> (root_a, nonce_a, count_a, difficulty_a, result_a);
+}
+
+bool nano_pow::search_avx2_generic (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a)
+{
+	return lanes::search<avx2_ops> (root_a, nonce_a, count_a, difficulty_a, result_a);
+}
+
+void nano_pow::values_avx2 (uint64_t const * roots_a, uint64_t const * nonces_a, size_t count_a, uint64_t * values_a)
+{
+	lanes::values<avx2_ops> (roots_a, nonces_a, count_a, values_a);
+}
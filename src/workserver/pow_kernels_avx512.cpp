@@ -0,0 +1,75 @@
+#include <immintrin.h>
+
+#include <workserver/pow_kernels.hpp>
+#include <workserver/pow_kernels_impl.hpp>
+
+namespace
+{
+/** Eight 64-bit lanes per 512-bit register, using the native rotate and unsigned compare */
+class avx512_ops
+{
+public:
+	using vec = __m512i;
+	static constexpr unsigned width = 8;
+
+	static vec set1 (uint64_t value_a)
+	{
+		return _mm512_set1_epi64 (static_cast<long long> (value_a));
+	}
+	static vec nonces (uint64_t base_a)
+	{
+		return _mm512_add_epi64 (set1 (base_a), _mm512_set_epi64 (7, 6, 5, 4, 3, 2, 1, 0));
+	}
+	static vec load (uint64_t const * values_a)
+	{
+		return _mm512_loadu_si512 (values_a);
+	}
+	static void store (uint64_t * values_a, vec value_a)
+	{
+		_mm512_storeu_si512 (values_a, value_a);
+	}
+	static vec add (vec a, vec b)
+	{
+		return _mm512_add_epi64 (a, b);
+	}
+	static vec xor_ (vec a, vec b)
+	{
+		return _mm512_xor_si512 (a, b);
+	}
+	static vec rotr32 (vec a)
+	{
+		return _mm512_ror_epi64 (a, 32);
+	}
+	static vec rotr24 (vec a)
+	{
+		return _mm512_ror_epi64 (a, 24);
+	}
+	static vec rotr16 (vec a)
+	{
+		return _mm512_ror_epi64 (a, 16);
+	}
+	static vec rotr63 (vec a)
+	{
+		return _mm512_ror_epi64 (a, 63);
+	}
+	static unsigned passing (vec value_a, uint64_t difficulty_a)
+	{
+		return _mm512_cmpge_epu64_mask (value_a, set1 (difficulty_a));
+	}
+};
+}
+
+bool nano_pow::search_avx512 (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a)
+{
+	return lanes::search_specialized<avx512_ops> (root_a, nonce_a, count_a, difficulty_a, result_a);
+}
+
+bool nano_pow::search_avx512_generic (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a)
+{
+	return lanes::search<avx512_ops> (root_a, nonce_a, count_a, difficulty_a, result_a);
+}
+
+void nano_pow::values_avx512 (uint64_t const * roots_a, uint64_t const * nonces_a, size_t count_a, uint64_t * values_a)
+{
+	lanes::values<avx512_ops> (roots_a, nonces_a, count_a, values_a);
+}
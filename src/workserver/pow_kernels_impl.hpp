@@ -0,0 +1,356 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Lane-parallel Blake2b nonce search and hashing, shared by the scalar and SIMD kernels.
+ *
+ * Every kernel translation unit instantiates the templates below with its own vector operations. Each of them
+ * may be compiled with different instruction set flags, so everything here has internal linkage and only
+ * depends on the vector operations passed in. Sharing inline functions with external linkage would allow
+ * the linker to pick, say, an AVX-512 copy for use on any CPU.
+ */
+namespace
+{
+namespace lanes
+{
+	constexpr uint64_t iv[8] = { 0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+		0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL };
+
+	constexpr uint8_t sigma[12][16] = {
+		{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+		{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+		{ 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+		{ 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+		{ 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+		{ 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+		{ 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+		{ 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+		{ 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+		{ 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+		{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+		{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 }
+	};
+
+	/** First chaining value after applying the parameter block for an unkeyed 8 byte digest */
+	constexpr uint64_t h0 = iv[0] ^ 0x01010008ULL;
+
+	/** The message is the 8 byte nonce followed by the 32 byte root */
+	constexpr uint64_t message_bytes = 40;
+
+	/** Applies G to the state. Message word 0 is the nonce, which differs per lane. */
+	template <typename ops>
+	inline void g (typename ops::vec (&v)[16], typename ops::vec const & nonce, typename ops::vec const (&m)[16], int a, int b, int c, int d, uint8_t x, uint8_t y)
+	{
+		v[a] = ops::add (ops::add (v[a], v[b]), x == 0 ? nonce : m[x]);
+		v[d] = ops::rotr32 (ops::xor_ (v[d], v[a]));
+		v[c] = ops::add (v[c], v[d]);
+		v[b] = ops::rotr24 (ops::xor_ (v[b], v[c]));
+		v[a] = ops::add (ops::add (v[a], v[b]), y == 0 ? nonce : m[y]);
+		v[d] = ops::rotr16 (ops::xor_ (v[d], v[a]));
+		v[c] = ops::add (v[c], v[d]);
+		v[b] = ops::rotr63 (ops::xor_ (v[b], v[c]));
+	}
+
+	/**
+	 * Generic search, hashing ops::width nonces per iteration with one nonce per vector lane. The message
+	 * schedule is looked up at runtime and every message word is added, as in a general purpose Blake2b.
+	 */
+	template <typename ops>
+	bool search (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a)
+	{
+		using vec = typename ops::vec;
+
+		vec m[16];
+		for (int i = 0; i < 16; ++i)
+		{
+			m[i] = ops::set1 (i >= 1 && i <= 4 ? root_a[i - 1] : 0);
+		}
+
+		for (uint64_t done = 0; done < count_a; done += ops::width)
+		{
+			auto const base (nonce_a + done);
+			auto const nonce (ops::nonces (base));
+			vec v[16];
+			v[0] = ops::set1 (h0);
+			for (int i = 1; i < 8; ++i)
+			{
+				v[i] = ops::set1 (iv[i]);
+			}
+			for (int i = 0; i < 8; ++i)
+			{
+				v[i + 8] = ops::set1 (iv[i]);
+			}
+			// Byte counter and last block flag
+			v[12] = ops::set1 (iv[4] ^ message_bytes);
+			v[14] = ops::set1 (~iv[6]);
+
+			for (int round = 0; round < 12; ++round)
+			{
+				auto const * s (sigma[round]);
+				g<ops> (v, nonce, m, 0, 4, 8, 12, s[0], s[1]);
+				g<ops> (v, nonce, m, 1, 5, 9, 13, s[2], s[3]);
+				g<ops> (v, nonce, m, 2, 6, 10, 14, s[4], s[5]);
+				g<ops> (v, nonce, m, 3, 7, 11, 15, s[6], s[7]);
+				g<ops> (v, nonce, m, 0, 5, 10, 15, s[8], s[9]);
+				g<ops> (v, nonce, m, 1, 6, 11, 12, s[10], s[11]);
+				g<ops> (v, nonce, m, 2, 7, 8, 13, s[12], s[13]);
+				g<ops> (v, nonce, m, 3, 4, 9, 14, s[14], s[15]);
+			}
+
+			// Only the first output word is needed for an 8 byte digest
+			auto const value (ops::xor_ (ops::set1 (h0), ops::xor_ (v[0], v[8])));
+			auto mask (ops::passing (value, difficulty_a));
+			if (mask != 0)
+			{
+				unsigned lane = 0;
+				while ((mask & 1) == 0)
+				{
+					mask >>= 1;
+					++lane;
+				}
+				result_a = base + lane;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/*
+	 * Search specialized for the fixed PoW message. The message length, parameter block and schedule are
+	 * compile time constants, so the eleven message words that are always zero vanish from the rounds and
+	 * only the nonce varies per iteration. Everything in the first round that does not depend on the
+	 * nonce is computed once per call instead of once per nonce.
+	 */
+
+	/** Adds message word X, which is either the nonce, a root word or zero */
+	template <typename ops, int X, int kind = (X == 0 ? 0 : (X <= 4 ? 1 : 2))>
+	class message_word;
+
+	template <typename ops, int X>
+	class message_word<ops, X, 0>
+	{
+	public:
+		static typename ops::vec add (typename ops::vec const & a, typename ops::vec const & nonce, typename ops::vec const (&)[4])
+		{
+			return ops::add (a, nonce);
+		}
+	};
+
+	template <typename ops, int X>
+	class message_word<ops, X, 1>
+	{
+	public:
+		static typename ops::vec add (typename ops::vec const & a, typename ops::vec const &, typename ops::vec const (&root)[4])
+		{
+			return ops::add (a, root[X - 1]);
+		}
+	};
+
+	template <typename ops, int X>
+	class message_word<ops, X, 2>
+	{
+	public:
+		static typename ops::vec add (typename ops::vec const & a, typename ops::vec const &, typename ops::vec const (&)[4])
+		{
+			return a;
+		}
+	};
+
+	template <typename ops, int A, int B, int C, int D, int X, int Y>
+	inline void g_fixed (typename ops::vec (&v)[16], typename ops::vec const & nonce, typename ops::vec const (&root)[4])
+	{
+		v[A] = message_word<ops, X>::add (ops::add (v[A], v[B]), nonce, root);
+		v[D] = ops::rotr32 (ops::xor_ (v[D], v[A]));
+		v[C] = ops::add (v[C], v[D]);
+		v[B] = ops::rotr24 (ops::xor_ (v[B], v[C]));
+		v[A] = message_word<ops, Y>::add (ops::add (v[A], v[B]), nonce, root);
+		v[D] = ops::rotr16 (ops::xor_ (v[D], v[A]));
+		v[C] = ops::add (v[C], v[D]);
+		v[B] = ops::rotr63 (ops::xor_ (v[B], v[C]));
+	}
+
+	template <typename ops, int R>
+	inline void diagonals_fixed (typename ops::vec (&v)[16], typename ops::vec const & nonce, typename ops::vec const (&root)[4])
+	{
+		g_fixed<ops, 0, 5, 10, 15, sigma[R][8], sigma[R][9]> (v, nonce, root);
+		g_fixed<ops, 1, 6, 11, 12, sigma[R][10], sigma[R][11]> (v, nonce, root);
+		g_fixed<ops, 2, 7, 8, 13, sigma[R][12], sigma[R][13]> (v, nonce, root);
+		g_fixed<ops, 3, 4, 9, 14, sigma[R][14], sigma[R][15]> (v, nonce, root);
+	}
+
+	/** Applies rounds R to 11 */
+	template <typename ops, int R>
+	class rounds_fixed
+	{
+	public:
+		static void apply (typename ops::vec (&v)[16], typename ops::vec const & nonce, typename ops::vec const (&root)[4])
+		{
+			g_fixed<ops, 0, 4, 8, 12, sigma[R][0], sigma[R][1]> (v, nonce, root);
+			g_fixed<ops, 1, 5, 9, 13, sigma[R][2], sigma[R][3]> (v, nonce, root);
+			g_fixed<ops, 2, 6, 10, 14, sigma[R][4], sigma[R][5]> (v, nonce, root);
+			g_fixed<ops, 3, 7, 11, 15, sigma[R][6], sigma[R][7]> (v, nonce, root);
+			diagonals_fixed<ops, R> (v, nonce, root);
+			rounds_fixed<ops, R + 1>::apply (v, nonce, root);
+		}
+	};
+
+	template <typename ops>
+	class rounds_fixed<ops, 12>
+	{
+	public:
+		static void apply (typename ops::vec (&)[16], typename ops::vec const &, typename ops::vec const (&)[4])
+		{
+		}
+	};
+
+	inline uint64_t rotr (uint64_t value_a, int bits_a)
+	{
+		return (value_a >> bits_a) | (value_a << (64 - bits_a));
+	}
+
+	/** Scalar G used for the per-call precomputation */
+	inline void g_scalar (uint64_t (&v)[16], int a, int b, int c, int d, uint64_t x, uint64_t y)
+	{
+		v[a] = v[a] + v[b] + x;
+		v[d] = rotr (v[d] ^ v[a], 32);
+		v[c] = v[c] + v[d];
+		v[b] = rotr (v[b] ^ v[c], 24);
+		v[a] = v[a] + v[b] + y;
+		v[d] = rotr (v[d] ^ v[a], 16);
+		v[c] = v[c] + v[d];
+		v[b] = rotr (v[b] ^ v[c], 63);
+	}
+
+	template <typename ops>
+	bool search_specialized (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a)
+	{
+		using vec = typename ops::vec;
+
+		// The initial state is a constant. The first round uses the identity schedule, so its columns 1 to 3
+		// only see root words and zeros, and column 0 only sees the nonce after adding v[4] and before
+		// adding the first root word.
+		uint64_t initial[16];
+		for (int i = 0; i < 8; ++i)
+		{
+			initial[i] = iv[i];
+			initial[i + 8] = iv[i];
+		}
+		initial[0] = h0;
+		initial[12] ^= message_bytes;
+		initial[14] = ~initial[14];
+		g_scalar (initial, 1, 5, 9, 13, root_a[1], root_a[2]);
+		g_scalar (initial, 2, 6, 10, 14, root_a[3], 0);
+		g_scalar (initial, 3, 7, 11, 15, 0, 0);
+
+		vec pre[16];
+		for (int i = 0; i < 16; ++i)
+		{
+			pre[i] = ops::set1 (initial[i]);
+		}
+		auto const v0_plus_v4 (ops::set1 (initial[0] + initial[4]));
+		vec root[4];
+		for (int i = 0; i < 4; ++i)
+		{
+			root[i] = ops::set1 (root_a[i]);
+		}
+		auto const h0_l (ops::set1 (h0));
+
+		for (uint64_t done = 0; done < count_a; done += ops::width)
+		{
+			auto const base (nonce_a + done);
+			auto const nonce (ops::nonces (base));
+			vec v[16];
+			for (int i = 0; i < 16; ++i)
+			{
+				v[i] = pre[i];
+			}
+
+			// Column 0 of the first round
+			v[0] = ops::add (v0_plus_v4, nonce);
+			v[12] = ops::rotr32 (ops::xor_ (v[12], v[0]));
+			v[8] = ops::add (v[8], v[12]);
+			v[4] = ops::rotr24 (ops::xor_ (v[4], v[8]));
+			v[0] = ops::add (ops::add (v[0], v[4]), root[0]);
+			v[12] = ops::rotr16 (ops::xor_ (v[12], v[0]));
+			v[8] = ops::add (v[8], v[12]);
+			v[4] = ops::rotr63 (ops::xor_ (v[4], v[8]));
+
+			diagonals_fixed<ops, 0> (v, nonce, root);
+			rounds_fixed<ops, 1>::apply (v, nonce, root);
+
+			auto const value (ops::xor_ (h0_l, ops::xor_ (v[0], v[8])));
+			auto mask (ops::passing (value, difficulty_a));
+			if (mask != 0)
+			{
+				unsigned lane = 0;
+				while ((mask & 1) == 0)
+				{
+					mask >>= 1;
+					++lane;
+				}
+				result_a = base + lane;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * Hashes independent (root, nonce) pairs, one pair per lane. Roots differ per lane, so nothing can be
+	 * precomputed, but the zero message words are still eliminated by the fixed rounds.
+	 */
+	template <typename ops>
+	void values (uint64_t const * roots_a, uint64_t const * nonces_a, size_t count_a, uint64_t * values_a)
+	{
+		using vec = typename ops::vec;
+
+		vec initial[16];
+		for (int i = 0; i < 8; ++i)
+		{
+			initial[i] = ops::set1 (iv[i]);
+			initial[i + 8] = ops::set1 (iv[i]);
+		}
+		initial[0] = ops::set1 (h0);
+		initial[12] = ops::set1 (iv[4] ^ message_bytes);
+		initial[14] = ops::set1 (~iv[6]);
+		auto const h0_l (ops::set1 (h0));
+
+		for (size_t done = 0; done < count_a; done += ops::width)
+		{
+			// Transpose the pairs into one array per message word. A partial final group is padded with zeros.
+			uint64_t words[5][ops::width] = {};
+			uint64_t out[ops::width];
+			auto const group (count_a - done < ops::width ? count_a - done : ops::width);
+			for (size_t lane = 0; lane < group; ++lane)
+			{
+				words[0][lane] = nonces_a[done + lane];
+				for (int i = 0; i < 4; ++i)
+				{
+					words[i + 1][lane] = roots_a[(done + lane) * 4 + i];
+				}
+			}
+
+			auto const nonce (ops::load (words[0]));
+			vec root[4];
+			for (int i = 0; i < 4; ++i)
+			{
+				root[i] = ops::load (words[i + 1]);
+			}
+			vec v[16];
+			for (int i = 0; i < 16; ++i)
+			{
+				v[i] = initial[i];
+			}
+			rounds_fixed<ops, 0>::apply (v, nonce, root);
+
+			ops::store (out, ops::xor_ (h0_l, ops::xor_ (v[0], v[8])));
+			for (size_t lane = 0; lane < group; ++lane)
+			{
+				values_a[done + lane] = out[lane];
+			}
+		}
+	}
+}
+}
@@ -0,0 +1,76 @@
+#include <smmintrin.h>
+
+#include <workserver/pow_kernels.hpp>
+#include <workserver/pow_kernels_impl.hpp>
+
+namespace
+{
+/** Two 64-bit lanes per 128-bit register */
+class sse41_ops
+{
+public:
+	using vec = __m128i;
+	static constexpr unsigned width = 2;
+
+	static vec set1 (uint64_t value_a)
+	{
+		return _mm_set1_epi64x (static_cast<long long> (value_a));
+	}
+	static vec nonces (uint64_t base_a)
+	{
+		return _mm_set_epi64x (static_cast<long long> (base_a + 1), static_cast<long long> (base_a));
+	}
+	static vec load (uint64_t const * values_a)
+	{
+		return _mm_loadu_si128 (reinterpret_cast<__m128i const *> (values_a));
+	}
+	static void store (uint64_t * values_a, vec value_a)
+	{
+		_mm_storeu_si128 (reinterpret_cast<__m128i *> (values_a), value_a);
+	}
+	static vec add (vec a, vec b)
+	{
+		return _mm_add_epi64 (a, b);
+	}
+	static vec xor_ (vec a, vec b)
+	{
+		return _mm_xor_si128 (a, b);
+	}
+	static vec rotr32 (vec a)
+	{
+		return _mm_shuffle_epi32 (a, _MM_SHUFFLE (2, 3, 0, 1));
+	}
+	static vec rotr24 (vec a)
+	{
+		return _mm_shuffle_epi8 (a, _mm_setr_epi8 (3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10));
+	}
+	static vec rotr16 (vec a)
+	{
+		return _mm_shuffle_epi8 (a, _mm_setr_epi8 (2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9));
+	}
+	static vec rotr63 (vec a)
+	{
+		return _mm_or_si128 (_mm_srli_epi64 (a, 63), _mm_add_epi64 (a, a));
+	}
+	/** SSE4.1 has no 64-bit comparisons, so the two lanes are compared as scalars */
+	static unsigned passing (vec value_a, uint64_t difficulty_a)
+	{
+		return (static_cast<uint64_t> (_mm_extract_epi64 (value_a, 0)) >= difficulty_a ? 1U : 0U) | (static_cast<uint64_t> (_mm_extract_epi64 (value_a, 1)) >= difficulty_a ? 2U : 0U);
+	}
+};
+}
+
+bool nano_pow::search_sse41 (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a)
+{
+	return lanes::search_specialized<sse41_ops> (root_a, nonce_a, count_a, difficulty_a, result_a);
+}
+
+bool nano_pow::search_sse41_generic (uint64_t const * root_a, uint64_t nonce_a, uint64_t count_a, uint64_t difficulty_a, uint64_t & result_a)
+{
+	return lanes::search<sse41_ops> (root_a, nonce_a, count_a, difficulty_a, result_a);
+}
+
+void nano_pow::values_sse41 (uint64_t const * roots_a, uint64_t const * nonces_a, size_t count_a, uint64_t * values_a)
+{
+	lanes::values<sse41_ops> (roots_a, nonces_a, count_a, values_a);
+}
@@ -0,0 +1,310 @@
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <workserver/blake2b.hpp>
+#include <workserver/pow_table.hpp>
+
+namespace
+{
+/** Number of rhs nonces tried between checks of the stop flag */
+constexpr uint64_t search_batch = 1024;
+
+/** The table must hold at least this many lhs nonces to be worth using */
+constexpr unsigned min_slot_bits = 10;
+
+/** lhs nonces are stored in 32-bit slots */
+constexpr unsigned max_slot_bits = 32;
+
+/** Keeps lhs and rhs items apart, so that a nonce hashes differently on either side */
+constexpr uint64_t rhs_flag = 1ULL << 32;
+
+inline uint64_t rotl (uint64_t value_a, int bits_a)
+{
+	return (value_a << bits_a) | (value_a >> (64 - bits_a));
+}
+
+inline void sipround (uint64_t & v0, uint64_t & v1, uint64_t & v2, uint64_t & v3)
+{
+	v0 += v1;
+	v1 = rotl (v1, 13);
+	v1 ^= v0;
+	v0 = rotl (v0, 32);
+	v2 += v3;
+	v3 = rotl (v3, 16);
+	v3 ^= v2;
+	v0 += v3;
+	v3 = rotl (v3, 21);
+	v3 ^= v0;
+	v2 += v1;
+	v1 = rotl (v1, 17);
+	v1 ^= v2;
+	v2 = rotl (v2, 32);
+}
+
+inline uint64_t work_value (uint64_t lhs_hash_a, uint64_t rhs_hash_a)
+{
+	return ~(lhs_hash_a + rhs_hash_a);
+}
+}
+
+nano_pow::table_key nano_pow::to_table_key (root const & root_a)
+{
+	nano_pow::blake2b hash (sizeof (table_key));
+	hash.update (root_a.data (), root_a.size ());
+	uint8_t digest[sizeof (table_key)];
+	hash.final (digest);
+
+	table_key result{ { 0, 0 } };
+	for (size_t i = 0; i < sizeof (digest); ++i)
+	{
+		result[i / 8] |= static_cast<uint64_t> (digest[i]) << (8 * (i % 8));
+	}
+	return result;
+}
+
+uint64_t nano_pow::siphash (table_key const & key_a, uint64_t item_a)
+{
+	uint64_t v0 (key_a[0] ^ 0x736f6d6570736575ULL);
+	uint64_t v1 (key_a[1] ^ 0x646f72616e646f6dULL);
+	uint64_t v2 (key_a[0] ^ 0x6c7967656e657261ULL);
+	uint64_t v3 (key_a[1] ^ 0x7465646279746573ULL);
+
+	v3 ^= item_a;
+	sipround (v0, v1, v2, v3);
+	sipround (v0, v1, v2, v3);
+	v0 ^= item_a;
+
+	// Final block, holding only the message length
+	uint64_t const last (8ULL << 56);
+	v3 ^= last;
+	sipround (v0, v1, v2, v3);
+	sipround (v0, v1, v2, v3);
+	v0 ^= last;
+
+	v2 ^= 0xff;
+	for (int i = 0; i < 4; ++i)
+	{
+		sipround (v0, v1, v2, v3);
+	}
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t nano_pow::table_difficulty (root const & root_a, uint64_t solution_a)
+{
+	auto const key (to_table_key (root_a));
+	return work_value (siphash (key, solution_a >> 32), siphash (key, (solution_a & 0xffffffffULL) | rhs_flag));
+}
+
+nano_pow::table_driver::table_driver (unsigned threads_a)
+{
+	threads_set (threads_a);
+}
+
+void nano_pow::table_driver::difficulty_set (uint64_t difficulty_a)
+{
+	difficulty = difficulty_a;
+}
+
+uint64_t nano_pow::table_driver::difficulty_get () const
+{
+	return difficulty;
+}
+
+void nano_pow::table_driver::threads_set (unsigned threads_a)
+{
+	threads = threads_a != 0 ? threads_a : std::max (1U, std::thread::hardware_concurrency ());
+}
+
+unsigned nano_pow::table_driver::threads_get () const
+{
+	return threads;
+}
+
+void nano_pow::table_driver::memory_set (uint64_t memory_a)
+{
+	memory = memory_a;
+}
+
+uint64_t nano_pow::table_driver::memory_get () const
+{
+	return memory;
+}
+
+std::string nano_pow::table_driver::description () const
+{
+	std::lock_guard<std::mutex> lk (pages_mutex);
+	return "cpu/table/" + std::to_string (memory / (1024 * 1024)) + "MB" + (pages.empty () ? "" : "/" + pages);
+}
+
+double nano_pow::table_driver::hashrate () const
+{
+	auto const microseconds (total_microseconds.load ());
+	return microseconds > 0 ? static_cast<double> (total_attempts) * 1e6 / microseconds : 0.0;
+}
+
+void nano_pow::table_driver::allocate ()
+{
+	// The largest power of two number of slots that fits
+	auto const available_slots (memory / sizeof (uint32_t));
+	unsigned bits (0);
+	while (bits < max_slot_bits && (2ULL << bits) <= available_slots)
+	{
+		++bits;
+	}
+	if (bits < min_slot_bits)
+	{
+		throw std::runtime_error ("Not enough memory configured for the work table");
+	}
+
+	if (bits != slot_bits || table_arena == nullptr)
+	{
+		auto const slot_count (1ULL << bits);
+		table_arena.reset ();
+		slots = nullptr;
+		filled_key = boost::none;
+		try
+		{
+			table_arena.reset (new nano_pow::arena (slot_count * sizeof (uint32_t)));
+		}
+		catch (std::bad_alloc const &)
+		{
+			throw std::runtime_error ("Could not allocate the work table");
+		}
+		// Atomics have trivial constructors, so this only starts the lifetime of the zero filled slots
+		slots = static_cast<std::atomic<uint32_t> *> (table_arena->data ());
+		for (uint64_t i = 0; i < slot_count; ++i)
+		{
+			new (&slots[i]) std::atomic<uint32_t>;
+		}
+		slot_bits = bits;
+		std::lock_guard<std::mutex> lk (pages_mutex);
+		pages = table_arena->pages_as_string ();
+	}
+}
+
+void nano_pow::table_driver::fill (table_key const & key_a, unsigned thread_count_a)
+{
+	auto const slot_count (1ULL << slot_bits);
+	auto const shift (64 - slot_bits);
+	auto const slice (slot_count / thread_count_a);
+	auto fill_slice = [&](unsigned index_a) {
+		auto const begin (index_a * slice);
+		auto const end (index_a + 1 == thread_count_a ? slot_count : begin + slice);
+		for (uint64_t lhs = begin; lhs < end; ++lhs)
+		{
+			// Colliding lhs nonces overwrite each other, and any of them is as good as the other
+			slots[siphash (key_a, lhs) >> shift].store (static_cast<uint32_t> (lhs), std::memory_order_relaxed);
+		}
+	};
+
+	std::vector<std::thread> workers;
+	workers.reserve (thread_count_a - 1);
+	for (unsigned i = 1; i < thread_count_a; ++i)
+	{
+		workers.emplace_back (fill_slice, i);
+	}
+	fill_slice (0);
+	for (auto & worker : workers)
+	{
+		worker.join ();
+	}
+}
+
+boost::optional<uint64_t> nano_pow::table_driver::solve_range (root const & root_a, std::atomic<bool> const & stop_a, nonce_range const & range_a, std::vector<nonce_range> * unsearched_a)
+{
+	std::lock_guard<std::mutex> lk (solve_mutex);
+	allocate ();
+
+	auto const thread_count (threads.load ());
+	auto const key (to_table_key (root_a));
+	auto const shift (64 - slot_bits);
+	auto const start_time (std::chrono::steady_clock::now ());
+
+	// Slots left over from earlier roots simply fail verification, so the table is never cleared
+	if (filled_key != key)
+	{
+		fill (key, thread_count);
+		filled_key = key;
+	}
+
+	auto const rhs_begin (range_a.begin >> 32);
+	auto const rhs_count (range_a.full ? uint64_t (1) << 32 : std::min ((range_a.size >> 32) + 1, uint64_t (1) << 32));
+	auto const slice (rhs_count / thread_count);
+
+	std::atomic<bool> found{ false };
+	std::atomic<uint64_t> solution{ 0 };
+	std::atomic<uint64_t> attempts{ 0 };
+	// The rhs nonces left in each thread's slice when the search stopped
+	std::vector<std::pair<uint64_t, uint64_t>> remainders (thread_count);
+	auto search = [&](unsigned index_a) {
+		uint64_t offset (index_a * slice);
+		uint64_t const end (index_a + 1 == thread_count ? rhs_count : offset + slice);
+		uint64_t attempts_l (0);
+		while (offset < end && !found.load (std::memory_order_relaxed) && !stop_a.load (std::memory_order_relaxed))
+		{
+			auto const batch_end (std::min (offset + search_batch, end));
+			for (; offset < batch_end; ++offset)
+			{
+				++attempts_l;
+				auto const rhs ((rhs_begin + offset) & 0xffffffffULL);
+				auto const rhs_hash (siphash (key, rhs | rhs_flag));
+				// The slot of the negated rhs hash holds the lhs most likely to cancel it out
+				auto const lhs (slots[(0 - rhs_hash) >> shift].load (std::memory_order_relaxed));
+				// Reloaded for every lookup, so that a difficulty raised during the solve applies right away
+				if (work_value (siphash (key, lhs), rhs_hash) >= difficulty.load (std::memory_order_relaxed))
+				{
+					if (!found.exchange (true))
+					{
+						solution = (static_cast<uint64_t> (lhs) << 32) | rhs;
+					}
+					++offset;
+					break;
+				}
+			}
+		}
+		attempts += attempts_l;
+		remainders[index_a] = std::make_pair (offset, end);
+	};
+
+	std::vector<std::thread> workers;
+	workers.reserve (thread_count - 1);
+	for (unsigned i = 1; i < thread_count; ++i)
+	{
+		workers.emplace_back (search, i);
+	}
+	search (0);
+	for (auto & worker : workers)
+	{
+		worker.join ();
+	}
+
+	total_attempts += attempts;
+	total_microseconds += std::chrono::duration_cast<std::chrono::microseconds> (std::chrono::steady_clock::now () - start_time).count ();
+
+	boost::optional<uint64_t> result;
+	if (found)
+	{
+		result = solution.load ();
+	}
+	if (unsearched_a != nullptr)
+	{
+		for (auto const & remainder : remainders)
+		{
+			if (remainder.first < remainder.second)
+			{
+				// Maps back onto the range: nonces with the same top 32 bits share an rhs nonce. A count of 2^32 rhs
+				// nonces is the whole nonce space.
+				nonce_range range;
+				range.begin = ((rhs_begin + remainder.first) & 0xffffffffULL) << 32;
+				range.size = (remainder.second - remainder.first) << 32;
+				range.full = remainder.second - remainder.first == uint64_t (1) << 32;
+				unsearched_a->push_back (range);
+			}
+		}
+	}
+	return result;
+}
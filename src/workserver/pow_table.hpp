@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <workserver/arena.hpp>
+#include <workserver/pow.hpp>
+
+namespace nano_pow
+{
+/*
+ * Memory-hard proof of work. Every root keys a 64-bit SipHash-2-4, which hashes two kinds of items: lhs
+ * nonces and rhs nonces. A solution packs a 32-bit lhs nonce and a 32-bit rhs nonce as lhs << 32 | rhs, and
+ * its work value is the complement of the sum of the two item hashes. High work values need item hashes
+ * that nearly cancel out, which is a birthday problem: a table of lhs nonces indexed by their hash answers
+ * "which lhs cancels this rhs" with a single lookup, so a larger table finds solutions proportionally faster.
+ */
+
+/** The SipHash key of a root */
+using table_key = std::array<uint64_t, 2>;
+
+table_key to_table_key (root const & root_a);
+
+/** SipHash-2-4 of a single 64-bit little-endian word */
+uint64_t siphash (table_key const & key_a, uint64_t item_a);
+
+/** Returns the memory-hard work value of \p solution_a for \p root_a. Higher values represent more work. */
+uint64_t table_difficulty (root const & root_a, uint64_t solution_a);
+
+/**
+ * Multithreaded CPU driver for the memory-hard proof of work. The table is sized from the memory setting and
+ * allocated when first needed. It is kept for later solves, which refill it for their root, unless it is still
+ * filled for the same root, as when a preempted search resumes in several ranges.
+ */
+class table_driver : public driver
+{
+public:
+	/** Uses \p threads_a threads, or one per hardware thread if zero */
+	table_driver (unsigned threads_a = 0);
+	void difficulty_set (uint64_t difficulty_a) override;
+	uint64_t difficulty_get () const override;
+	void threads_set (unsigned threads_a) override;
+	unsigned threads_get () const override;
+	void memory_set (uint64_t memory_a) override;
+	uint64_t memory_get () const override;
+	std::string description () const override;
+	/** Returns the measured table lookups per second */
+	double hashrate () const override;
+	/**
+	 * The 64-bit range is scaled onto the 32-bit rhs nonces, so splitting the nonce space splits the lookups.
+	 * Returns boost::none if all rhs nonces in the range were tried, which only happens if the table is far
+	 * too small for the difficulty. Unsearched nonces are reported in whole rhs nonces.
+	 */
+	boost::optional<uint64_t> solve_range (root const & root_a, std::atomic<bool> const & stop_a, nonce_range const & range_a, std::vector<nonce_range> * unsearched_a = nullptr) override;
+
+private:
+	/** Allocates the table if the memory setting changed since the last solve */
+	void allocate ();
+	void fill (table_key const & key_a, unsigned thread_count_a);
+
+	std::atomic<uint64_t> difficulty{ 0 };
+	std::atomic<unsigned> threads{ 1 };
+	std::atomic<uint64_t> memory{ 0 };
+	std::atomic<uint64_t> total_attempts{ 0 };
+	std::atomic<uint64_t> total_microseconds{ 0 };
+	/** Serializes solves, which share the table */
+	std::mutex solve_mutex;
+
+	std::unique_ptr<nano_pow::arena> table_arena;
+	/** Page type of the table, for the description. Set when the table is allocated. */
+	mutable std::mutex pages_mutex;
+	std::string pages;
+	/** Table of lhs nonces, indexed by the top slot_bits bits of their hash */
+	std::atomic<uint32_t> * slots{ nullptr };
+	unsigned slot_bits{ 0 };
+	/** The key the table was last filled for, none until the table is filled */
+	boost::optional<table_key> filled_key;
+};
+}
@@ -5,6 +5,7 @@
 #include <boost/multiprecision/cpp_int.hpp>
 
 #include <array>
+#include <limits>
 #include <sstream>
 
 namespace nano_pow_server
@@ -74,6 +75,11 @@ struct bigint
 		}
 	}
 
+	bool operator== (bigint const & other_a) const
+	{
+		return bytes == other_a.bytes;
+	}
+
 	union
 	{
 		std::array<uint8_t, SIZE_BYTES> bytes;
@@ -86,6 +92,16 @@ using u256 = bigint<boost::multiprecision::uint256_t, 32>;
 using u512 = bigint<boost::multiprecision::uint512_t, 64>;
 using bigfloat = boost::multiprecision::cpp_bin_float_100;
 
+/** Hashes root hashes for unordered containers. Real roots are uniformly distributed, so folding the words is enough. */
+class root_hash
+{
+public:
+	size_t operator() (u256 const & root_a) const
+	{
+		return static_cast<size_t> (root_a.qwords[0] ^ root_a.qwords[1] ^ root_a.qwords[2] ^ root_a.qwords[3]);
+	}
+};
+
 inline double to_multiplier (nano_pow_server::u128 const difficulty_a, nano_pow_server::u128 const base_difficulty_a)
 {
 	assert (difficulty_a.number () > 0);
@@ -93,9 +109,37 @@ inline double to_multiplier (nano_pow_server::u128 const difficulty_a, nano_pow_
 	return res.convert_to<double> ();
 }
 
+/**
+ * Expected number of nonces tried before finding work that meets \p difficulty_a, as work values are uniformly
+ * distributed: 2^64 / (2^64 - difficulty). The divisor is exact in 64 bit arithmetic, so doubles suffice.
+ */
+inline double expected_attempts (uint64_t const difficulty_a)
+{
+	return 18446744073709551616.0 / (static_cast<double> (std::numeric_limits<uint64_t>::max () - difficulty_a) + 1.0);
+}
+
+/** As above, for a difficulty that may exceed the largest work value, which can never be met */
+inline double expected_attempts (nano_pow_server::u128 const difficulty_a)
+{
+	auto const number (difficulty_a.number ());
+	return number > std::numeric_limits<uint64_t>::max () ? std::numeric_limits<double>::infinity () : expected_attempts (number.convert_to<uint64_t> ());
+}
+
 inline nano_pow_server::u128 from_multiplier (double const multiplier_a, nano_pow_server::u128 const base_difficulty_a)
 {
 	bigfloat res = bigfloat (base_difficulty_a.number ()) * bigfloat (multiplier_a);
 	return res.convert_to<boost::multiprecision::uint128_t> ();
 }
+
+/** FNV-1a hash of \p size_a bytes, used to detect records of mapped files torn by a crash */
+inline uint64_t checksum (void const * data_a, size_t size_a)
+{
+	auto const bytes (static_cast<uint8_t const *> (data_a));
+	uint64_t result (14695981039346656037ULL);
+	for (size_t i (0); i < size_a; ++i)
+	{
+		result = (result ^ bytes[i]) * 1099511628211ULL;
+	}
+	return result;
+}
 }
@@ -13,6 +13,7 @@
 #include <boost/make_unique.hpp>
 
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <deque>
 #include <functional>
@@ -20,8 +21,10 @@
 #include <map>
 #include <memory>
 #include <regex>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_set>
 #include <vector>
 
 using tcp = boost::asio::ip::tcp;
@@ -39,12 +42,26 @@ using socket_type = boost::asio::basic_stream_socket<boost::asio::ip::tcp, boost
 
 namespace web
 {
+/** Request header with which configured clients may identify themselves, instead of by remote address */
+static constexpr char const * api_key_header = "X-API-Key";
+
 /** Configuration options passed to sessions */
 class config
 {
 public:
 	bool static_pages_allow_remote{ false };
 	bool static_pages_allow{ true };
+	/**
+	 * API keys of the configured clients. Other keys are ignored, as a client could otherwise claim a fair queuing
+	 * share for every key it makes up.
+	 */
+	std::unordered_set<std::string> api_keys;
+
+	/** Identifies a client for fair queuing: by \p api_key_a if it is configured, or else by \p remote_address_a */
+	std::string client_key (std::string const & api_key_a, std::string const & remote_address_a) const
+	{
+		return api_keys.find (api_key_a) != api_keys.end () ? api_key_a : remote_address_a;
+	}
 };
 
 class http_session;
@@ -215,13 +232,17 @@ class websocket_session : public std::enable_shared_from_this<websocket_session>
 	/** Outgoing messages. The send queue is protected by accessing it only through the strand */
 	std::deque<std::string> send_queue_;
 	websocket_endpoint const & handler_;
+	config const & config_;
+	/** Identifies the client for fair queuing: the configured API key of the upgrade request, or else the remote address */
+	std::string client_key_;
 
 public:
-	explicit websocket_session (socket_type socket, websocket_endpoint const & handler)
+	explicit websocket_session (socket_type socket, websocket_endpoint const & handler, config const & conf)
 	    : ws_ (std::move (socket))
 	    , strand_ (ws_.get_executor ())
 	    , timer_ (ws_.get_executor ().context (), (std::chrono::steady_clock::time_point::max) ())
 	    , handler_ (handler)
+	    , config_ (conf)
 	{
 	}
 
@@ -258,9 +279,17 @@ public:
 		        }));
 	}
 
+	std::string const & client_key () const
+	{
+		return client_key_;
+	}
+
 	template <class Body, class Allocator>
 	void do_accept (http::request<Body, http::basic_fields<Allocator>> req)
 	{
+		boost::system::error_code ec;
+		client_key_ = config_.client_key (req[api_key_header].to_string (), ws_.next_layer ().remote_endpoint (ec).address ().to_string ());
+
 		// Control callback to handle ping, pong, and close frames.
 		ws_.control_callback (std::bind (&websocket_session::on_control_callback, this, std::placeholders::_1, std::placeholders::_2));
 
@@ -520,6 +549,10 @@ class http_session : public std::enable_shared_from_this<http_session>
 	config const & config_;
 	http::request<http::string_body> req_;
 	queue queue_;
+	/** API key of the request being handled, if any */
+	std::string api_key_;
+	/** Query string of the request being handled, without the leading '?' */
+	std::string query_;
 	// May be changed during requests
 	unsigned client_version{ 11 };
 	bool client_keepalive{ true };
@@ -544,6 +577,29 @@ public:
 	{
 	}
 
+	/** Identifies the client of the request being handled for fair queuing: its configured API key, or else the remote address */
+	std::string client_key () const
+	{
+		return config_.client_key (api_key_, remote_address_.address ().to_string ());
+	}
+
+	/** Returns the value of the query parameter \p name_a of the request being handled, or an empty string */
+	std::string query_parameter (std::string const & name_a) const
+	{
+		std::string result;
+		std::stringstream query (query_);
+		std::string parameter;
+		while (std::getline (query, parameter, '&'))
+		{
+			auto const separator (parameter.find ('='));
+			if (parameter.substr (0, separator) == name_a)
+			{
+				result = separator != std::string::npos ? parameter.substr (separator + 1) : "";
+			}
+		}
+		return result;
+	}
+
 	void write_json_response (std::string body)
 	{
 		http::response<http::string_body> res{ http::status::ok, client_version };
@@ -555,6 +611,19 @@ public:
 		queue_ (std::move (res));
 	}
 
+	/** Writes a 503 response, telling the client to retry after \p retry_after_a or turn to another server */
+	void write_unavailable_response (std::string body, std::chrono::seconds retry_after_a)
+	{
+		http::response<http::string_body> res{ http::status::service_unavailable, client_version };
+		res.set (http::field::server, "web/1");
+		res.set (http::field::content_type, "application/json");
+		res.set (http::field::retry_after, std::to_string (retry_after_a.count ()));
+		res.keep_alive (client_keepalive);
+		res.body () = body;
+		res.prepare_payload ();
+		queue_ (std::move (res));
+	}
+
 private:
 	void run ()
 	{
@@ -644,7 +713,7 @@ private:
 								params.push_back (match[i]);
 							}
 						}
-						session = std::make_shared<websocket_session> (std::move (socket_), handler);
+						session = std::make_shared<websocket_session> (std::move (socket_), handler, config_);
 						break;
 					}
 				}
@@ -709,6 +778,7 @@ private:
 	{
 		client_version = req.version ();
 		client_keepalive = req.keep_alive ();
+		api_key_ = req[api_key_header].to_string ();
 
 		// Returns a bad request response
 		auto const bad_request =
@@ -752,7 +822,10 @@ private:
 			return send (bad_request ("Illegal request-target"));
 		}
 
-		auto target_path (req.target ().to_string ());
+		// Endpoints match the path, and read the query through query_parameter
+		url const target (req.target ().to_string ());
+		auto const & target_path (target.path);
+		query_ = target.query;
 		for (auto & handler : handlers_)
 		{
 			if (std::regex_match (target_path, handler.path) && handler.verb == req.method ())
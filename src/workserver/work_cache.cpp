@@ -0,0 +1,240 @@
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include <workserver/work_cache.hpp>
+
+namespace
+{
+/** Number of slots searched for a root, starting at the slot its hash maps to */
+size_t const max_probes (8);
+
+/** Identifies a work cache file, and changes whenever its layout does */
+uint64_t const magic (0x3168636163776f70ULL);
+}
+
+/** A cached solution, in the byte order of the server. A slot is empty unless its checksum matches. */
+class nano_pow_server::work_cache::slot
+{
+public:
+	uint8_t root_hash[32];
+	uint64_t work;
+	uint64_t difficulty;
+	/** Of the bytes before it */
+	uint64_t checksum;
+
+	bool valid () const
+	{
+		return difficulty != 0 && checksum == nano_pow_server::checksum (this, offsetof (slot, checksum));
+	}
+
+	bool matches (u256 const & root_a) const
+	{
+		return std::equal (root_a.bytes.begin (), root_a.bytes.end (), std::begin (root_hash));
+	}
+};
+
+namespace
+{
+/** Takes the place of the first slot of the file */
+class header
+{
+public:
+	uint64_t magic;
+	uint64_t format;
+	uint64_t slots;
+	uint64_t reserved[4];
+};
+}
+
+nano_pow_server::work_cache::work_cache (size_t capacity_a, std::string const & path_a, size_t disk_capacity_a, uint64_t format_a)
+    : capacity_ (capacity_a)
+{
+	static_assert (sizeof (slot) == 56 && sizeof (header) == sizeof (slot), "Work cache records must not change size");
+	index.reserve (capacity_a);
+	if (path_a.empty ())
+	{
+		return;
+	}
+
+	slots = 1;
+	while (slots < std::max (disk_capacity_a, max_probes))
+	{
+		slots *= 2;
+	}
+	header expected{};
+	expected.magic = magic;
+	expected.format = format_a;
+	expected.slots = slots;
+	auto const size_l ((slots + 1) * sizeof (slot));
+	auto map = [this, &path_a]() {
+		boost::interprocess::file_mapping (path_a.c_str (), boost::interprocess::read_write).swap (file);
+		boost::interprocess::mapped_region (file, boost::interprocess::read_write).swap (region);
+	};
+
+	// The file is only mapped here. Its pages are read as lookups touch them.
+	if (boost::filesystem::exists (path_a) && boost::filesystem::file_size (path_a) == size_l)
+	{
+		map ();
+		if (std::memcmp (region.get_address (), &expected, sizeof (header)) == 0)
+		{
+			return;
+		}
+		boost::interprocess::mapped_region ().swap (region);
+		boost::interprocess::file_mapping ().swap (file);
+	}
+	{
+		std::ofstream create (path_a, std::ios::binary | std::ios::trunc);
+		if (!create)
+		{
+			throw std::runtime_error ("Could not create work cache " + path_a);
+		}
+	}
+	boost::filesystem::resize_file (path_a, size_l);
+	map ();
+	std::memcpy (region.get_address (), &expected, sizeof (header));
+}
+
+nano_pow_server::work_cache::~work_cache ()
+{
+	if (slots != 0)
+	{
+		region.flush ();
+	}
+}
+
+boost::optional<nano_pow_server::work_cache::entry> nano_pow_server::work_cache::find (u256 const & root_a, uint64_t difficulty_a)
+{
+	boost::optional<entry> result;
+	std::lock_guard<std::mutex> lk (mutex);
+	auto existing (index.find (root_a));
+	if (existing != index.end ())
+	{
+		if (existing->second->second.difficulty >= difficulty_a)
+		{
+			entries.splice (entries.begin (), entries, existing->second);
+			result = existing->second->second;
+		}
+	}
+	else if (slots != 0)
+	{
+		// The file holds every entry in memory, so it is only searched for roots that are not
+		auto stored (disk_find (root_a));
+		if (stored && stored->difficulty >= difficulty_a)
+		{
+			result = stored;
+			++disk_hits_;
+			if (capacity_ != 0)
+			{
+				memory_insert (root_a, *stored);
+			}
+		}
+	}
+	if (result)
+	{
+		++hits_;
+	}
+	else
+	{
+		++misses_;
+	}
+	return result;
+}
+
+void nano_pow_server::work_cache::insert (u256 const & root_a, entry const & entry_a)
+{
+	if (capacity_ == 0 && slots == 0)
+	{
+		return;
+	}
+	std::lock_guard<std::mutex> lk (mutex);
+	if (slots != 0)
+	{
+		disk_insert (root_a, entry_a);
+	}
+	if (capacity_ == 0)
+	{
+		return;
+	}
+	auto existing (index.find (root_a));
+	if (existing != index.end ())
+	{
+		if (entry_a.difficulty > existing->second->second.difficulty)
+		{
+			existing->second->second = entry_a;
+		}
+		entries.splice (entries.begin (), entries, existing->second);
+		return;
+	}
+	memory_insert (root_a, entry_a);
+}
+
+size_t nano_pow_server::work_cache::size () const
+{
+	std::lock_guard<std::mutex> lk (mutex);
+	return entries.size ();
+}
+
+void nano_pow_server::work_cache::memory_insert (u256 const & root_a, entry const & entry_a)
+{
+	if (entries.size () >= capacity_)
+	{
+		index.erase (entries.back ().first);
+		entries.pop_back ();
+		++evictions_;
+	}
+	entries.emplace_front (root_a, entry_a);
+	index.emplace (root_a, entries.begin ());
+}
+
+boost::optional<nano_pow_server::work_cache::entry> nano_pow_server::work_cache::disk_find (u256 const & root_a) const
+{
+	boost::optional<entry> result;
+	auto const home (root_hash () (root_a));
+	for (size_t i (0); i < max_probes && !result; ++i)
+	{
+		auto const & slot_l (disk_slots ()[(home + i) & (slots - 1)]);
+		if (slot_l.valid () && slot_l.matches (root_a))
+		{
+			result = entry{ slot_l.work, slot_l.difficulty };
+		}
+	}
+	return result;
+}
+
+void nano_pow_server::work_cache::disk_insert (u256 const & root_a, entry const & entry_a)
+{
+	// Slots are never cleared, so all probed slots are searched for the root even past an empty one
+	slot * target (nullptr);
+	auto const home (root_hash () (root_a));
+	for (size_t i (0); i < max_probes; ++i)
+	{
+		auto & slot_l (disk_slots ()[(home + i) & (slots - 1)]);
+		if (slot_l.valid () && slot_l.matches (root_a))
+		{
+			if (entry_a.difficulty <= slot_l.difficulty)
+			{
+				return;
+			}
+			target = &slot_l;
+			break;
+		}
+		if (target == nullptr || (target->valid () && (!slot_l.valid () || slot_l.difficulty < target->difficulty)))
+		{
+			target = &slot_l;
+		}
+	}
+	slot slot_l{};
+	std::copy (root_a.bytes.begin (), root_a.bytes.end (), slot_l.root_hash);
+	slot_l.work = entry_a.work;
+	slot_l.difficulty = entry_a.difficulty;
+	slot_l.checksum = nano_pow_server::checksum (&slot_l, offsetof (slot, checksum));
+	std::memcpy (target, &slot_l, sizeof (slot));
+}
+
+nano_pow_server::work_cache::slot * nano_pow_server::work_cache::disk_slots () const
+{
+	return static_cast<slot *> (region.get_address ()) + 1;
+}
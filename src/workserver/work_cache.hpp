@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/optional.hpp>
+
+#include <workserver/util.hpp>
+
+namespace nano_pow_server
+{
+/**
+ * Bounded cache of completed work, keyed by root hash. Clients that time out tend to request the same root
+ * again, and a cached solution answers every request up to the difficulty it achieved.
+ * The least recently used entry is evicted when the cache is full.
+ * Optionally, solutions are also stored in a memory mapped file, so that the cache is warm after a restart. The
+ * file is a hash table of fixed size records, open addressed on the root hash. It is mapped at startup without
+ * being read, and entries missing from memory are looked up in the file, which pages it in on demand.
+ */
+class work_cache
+{
+public:
+	class entry
+	{
+	public:
+		uint64_t work{ 0 };
+		/** The work value of the solution, which may exceed the requested difficulty */
+		uint64_t difficulty{ 0 };
+	};
+
+	/**
+	 * A cache of \p capacity_a entries in memory. A zero capacity disables the cache in memory.
+	 * If \p path_a is not empty, solutions are also stored in a file of at least \p disk_capacity_a entries. A
+	 * file with a different capacity or \p format_a, which identifies the proof of work, is discarded.
+	 */
+	explicit work_cache (size_t capacity_a, std::string const & path_a = std::string (), size_t disk_capacity_a = 0, uint64_t format_a = 0);
+	~work_cache ();
+
+	/** Returns the cached work for \p root_a if it meets \p difficulty_a, and counts a hit or miss */
+	boost::optional<entry> find (u256 const & root_a, uint64_t difficulty_a);
+
+	/** Caches \p entry_a, unless an entry with a higher difficulty is already cached for \p root_a */
+	void insert (u256 const & root_a, entry const & entry_a);
+
+	size_t size () const;
+	size_t capacity () const
+	{
+		return capacity_;
+	}
+	uint64_t hits () const
+	{
+		return hits_;
+	}
+	uint64_t misses () const
+	{
+		return misses_;
+	}
+	uint64_t evictions () const
+	{
+		return evictions_;
+	}
+	/** Number of entries the file has room for, zero without a file */
+	size_t disk_capacity () const
+	{
+		return slots;
+	}
+	/** Hits answered from the file */
+	uint64_t disk_hits () const
+	{
+		return disk_hits_;
+	}
+
+private:
+	using lru_list = std::list<std::pair<u256, entry>>;
+
+	class slot;
+
+	/** Returns the entry for \p root_a in the file. Called with the mutex locked. */
+	boost::optional<entry> disk_find (u256 const & root_a) const;
+
+	/** Stores \p entry_a in the file, replacing the entry of lowest difficulty if the probed slots are taken */
+	void disk_insert (u256 const & root_a, entry const & entry_a);
+
+	/** Caches \p entry_a in memory, evicting the least recently used entry if full */
+	void memory_insert (u256 const & root_a, entry const & entry_a);
+
+	slot * disk_slots () const;
+
+	size_t const capacity_;
+	mutable std::mutex mutex;
+	/** Most recently used entry first */
+	lru_list entries;
+	std::unordered_map<u256, lru_list::iterator, root_hash> index;
+	std::atomic<uint64_t> hits_{ 0 };
+	std::atomic<uint64_t> misses_{ 0 };
+	std::atomic<uint64_t> evictions_{ 0 };
+	std::atomic<uint64_t> disk_hits_{ 0 };
+	boost::interprocess::file_mapping file;
+	boost::interprocess::mapped_region region;
+	/** Number of slots of the file, a power of two */
+	size_t slots{ 0 };
+};
+}
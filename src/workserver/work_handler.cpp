@@ -1,60 +1,1063 @@
+#include <boost/asio/steady_timer.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/multiprecision/cpp_int.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
 
 #include <array>
+#include <future>
 #include <thread>
 
 #include <workserver/work_handler.hpp>
 
-std::atomic<unsigned> nano_pow_server::job::job_id_dispenser{ 1 };
+namespace
+{
+/** Work values are 64 bits, so larger difficulties can never be met */
+uint64_t to_work_difficulty (nano_pow_server::u128 const & difficulty_a)
+{
+	if (difficulty_a.number () > std::numeric_limits<uint64_t>::max ())
+	{
+		throw std::runtime_error ("Difficulty exceeds the maximum work value");
+	}
+	return difficulty_a.number ().convert_to<uint64_t> ();
+}
+
+/** Returns the work value of \p nonce_a for \p root_a under the configured proof of work */
+uint64_t work_value (nano_pow_server::config const & config_a, nano_pow::root const & root_a, uint64_t nonce_a)
+{
+	return config_a.work.memory_hard ? nano_pow::table_difficulty (root_a, nonce_a) : nano_pow::difficulty (root_a, nonce_a);
+}
+
+/** Number of pairs in a work_validate_batch request validated by each task on the validation pool */
+constexpr size_t validation_chunk = 1024;
+
+/** Returns the threshold of a validation request: the multiplier if set, else the difficulty, else \p default_a */
+nano_pow_server::u128 validation_difficulty (boost::property_tree::ptree const & request_a, nano_pow_server::u128 const & default_a, nano_pow_server::u128 const & base_a)
+{
+	nano_pow_server::u128 difficulty = default_a;
+	auto difficulty_hex (request_a.get_optional<std::string> ("difficulty"));
+	if (difficulty_hex.is_initialized ())
+	{
+		difficulty.from_hex (*difficulty_hex);
+	}
+
+	double multiplier = request_a.get<double> ("multiplier", .0);
+	if (multiplier > .0)
+	{
+		difficulty = nano_pow_server::from_multiplier (multiplier, base_a);
+	}
+	return difficulty;
+}
+
+/** Reads the work of a validation request as a nonce */
+uint64_t validation_nonce (boost::property_tree::ptree const & request_a, std::string const & action_a)
+{
+	auto work_hex (request_a.get_optional<std::string> ("work"));
+	if (!work_hex.is_initialized ())
+	{
+		throw std::runtime_error (action_a + " failed: missing work value");
+	}
+	nano_pow_server::u128 work (*work_hex);
+	if (work.number () > std::numeric_limits<uint64_t>::max ())
+	{
+		throw std::runtime_error (action_a + " failed: invalid work value");
+	}
+	return work.number ().convert_to<uint64_t> ();
+}
+
+/** Longest a status request waits for a pending job to be answered */
+std::chrono::seconds const max_status_wait (60);
+
+/**
+ * Sends \p response_a to \p waiter_a, with the waiter's own correlation id. The waiter of an asynchronous request
+ * has no handler, as its client polls for the result.
+ */
+void send_response (nano_pow_server::job::waiter const & waiter_a, boost::property_tree::ptree response_a)
+{
+	if (waiter_a.result_handler)
+	{
+		waiter_a.result_handler (response_a);
+		return;
+	}
+	if (!waiter_a.response_handler)
+	{
+		return;
+	}
+	if (waiter_a.correlation_id)
+	{
+		response_a.put ("id", *waiter_a.correlation_id);
+	}
+	std::stringstream ostream;
+	boost::property_tree::write_json (ostream, response_a);
+	waiter_a.response_handler (ostream.str ());
+}
+
+/** Describes a rejected work request, including when to retry */
+boost::property_tree::ptree overload_response (nano_pow_server::overload_error const & error_a)
+{
+	boost::property_tree::ptree response;
+	response.put ("error", error_a.what ());
+	if (error_a.eta)
+	{
+		response.put ("eta_ms", error_a.eta->count ());
+	}
+	response.put ("retry_after", error_a.retry_after.count ());
+	return response;
+}
+
+/** Describes the work value of a validated pair */
+void put_validation (boost::property_tree::ptree & response_a, uint64_t value_a, nano_pow_server::u128 const & difficulty_a, nano_pow_server::u128 const & base_a)
+{
+	nano_pow_server::u128 value (value_a);
+	response_a.put ("valid", value.number () >= difficulty_a.number () ? "1" : "0");
+	response_a.put ("difficulty", value.to_hex ());
+	response_a.put ("multiplier", nano_pow_server::to_multiplier (value, base_a));
+}
+}
+
+nano_pow_server::work_handler::work_handler (nano_pow_server::config const & config_a, std::shared_ptr<spdlog::logger> const & logger_a)
+    : config (config_a)
+    , logger (logger_a)
+    , validation_pool (config.work.validation_threads != 0 ? config.work.validation_threads : std::max (1U, std::thread::hardware_concurrency ()))
+    , cache (config.cache.size, config.cache.path, config.cache.disk_size, config.work.memory_hard ? 1 : 0)
+    , jobs (config.server.request_limit)
+    , registry (history_size)
+    , journal (config.server.journal, history_size)
+{
+	for (auto device : config.devices)
+	{
+		std::shared_ptr<nano_pow::driver> driver;
+		if (device.type == nano_pow_server::config::device::device_type::cpu && config.work.memory_hard)
+		{
+			driver = std::make_shared<nano_pow::table_driver> (static_cast<unsigned> (device.threads));
+		}
+		else if (device.type == nano_pow_server::config::device::device_type::cpu)
+		{
+			driver = std::make_shared<nano_pow::cpp_driver> (static_cast<unsigned> (device.threads));
+		}
+		else if (device.type == nano_pow_server::config::device::device_type::gpu)
+		{
+			driver = std::make_shared<nano_pow::opencl_driver> ();
+			driver->threads_set (static_cast<unsigned> (device.threads));
+		}
+		driver->memory_set (device.memory * 1024 * 1024);
+
+		devices.emplace_back (device, driver);
+	}
+
+	for (auto const & client : config.clients)
+	{
+		client_weights[client.key] = client.weight;
+	}
+
+	restore ();
+
+	// Workers refer to their device, so they are started once the device list no longer changes
+	for (auto & device : devices)
+	{
+		workers.emplace_back ([this, &device]() { run_device (device); });
+	}
+}
+
+nano_pow_server::work_handler::~work_handler ()
+{
+	{
+		std::lock_guard<std::mutex> lk (workers_mutex);
+		stopped = true;
+	}
+	workers_condition.notify_all ();
+
+	// Stop any solves in progress so that the workers can be joined. Jobs dispatched after this see the stopped flag.
+	{
+		std::lock_guard<std::mutex> lk (active_jobs_mutex);
+		for (auto & active : active_jobs)
+		{
+			active->cancel ();
+		}
+	}
+	for (auto & worker : workers)
+	{
+		worker.join ();
+	}
+	validation_pool.stop ();
+	validation_pool.join ();
+}
+
+boost::optional<uint64_t> nano_pow_server::work_handler::search (job & job_a, std::shared_ptr<nano_pow::driver> const & driver_a, nano_pow::nonce_range const & range_a)
+{
+	auto const & root (job_a.request.root_hash.bytes);
+	// A discarded solution still answers requests for the root up to its own work value
+	auto discard = [this, &job_a, &root](uint64_t solution_a) {
+		auto const value (work_value (config, root, solution_a));
+		cache.insert (job_a.request.root_hash, { solution_a, value });
+		logger->info ("Discarded work {} for root {}, which no longer meets the raised difficulty", u128 (solution_a).to_hex (), job_a.request.root_hash.to_hex ());
+	};
+	boost::optional<uint64_t> result;
+	// Ranges left to search, in order
+	std::vector<nano_pow::nonce_range> ranges (1, range_a);
+	try
+	{
+		while (!ranges.empty ())
+		{
+			auto const range (ranges.front ());
+			ranges.erase (ranges.begin ());
+			job_a.add_driver (driver_a);
+			std::vector<nano_pow::nonce_range> unsearched;
+			result = driver_a->solve_range (root, job_a.get_stop_token (), range, &unsearched);
+			// The driver runs one solve at a time, so the solutions it skipped belong to this search
+			for (auto const skipped : driver_a->take_skipped ())
+			{
+				discard (skipped);
+			}
+			if (!result)
+			{
+				job_a.remove_driver (driver_a);
+				if (job_a.preempted ())
+				{
+					unsearched.insert (unsearched.end (), ranges.begin (), ranges.end ());
+					job_a.checkpoint (unsearched);
+					break;
+				}
+				if (job_a.cancelled ())
+				{
+					break;
+				}
+				// The range is exhausted
+				continue;
+			}
+			if (job_a.finish_search (work_value (config, root, *result)))
+			{
+				break;
+			}
+			// Drivers skip such solutions themselves, so this only happens if the target was raised just as the
+			// solution was returned. The search resumes with what the solve left unsearched, after the solution.
+			discard (*result);
+			result = boost::none;
+			ranges.insert (ranges.begin (), unsearched.begin (), unsearched.end ());
+		}
+	}
+	catch (...)
+	{
+		job_a.remove_driver (driver_a);
+		throw;
+	}
+	return result;
+}
+
+boost::optional<uint64_t> nano_pow_server::work_handler::solve (job & job_a, registered_device & device_a)
+{
+	// A preempted job resumes where its search stopped, on this device alone
+	auto const unsearched (job_a.take_checkpoint ());
+	if (!unsearched.empty ())
+	{
+		logger->info ("Resuming work for root {} in {} unsearched ranges", job_a.request.root_hash.to_hex (), unsearched.size ());
+		for (auto i (unsearched.begin ()); i != unsearched.end (); ++i)
+		{
+			auto const result (search (job_a, device_a.driver, *i));
+			if (result)
+			{
+				return result;
+			}
+			if (job_a.preempted ())
+			{
+				job_a.checkpoint (std::vector<nano_pow::nonce_range> (std::next (i), unsearched.end ()));
+				break;
+			}
+			if (job_a.cancelled ())
+			{
+				break;
+			}
+		}
+		return boost::none;
+	}
+
+	std::vector<std::reference_wrapper<registered_device>> split_devices;
+	if (config.work.split_multiplier > 0 && job_a.request.multiplier >= config.work.split_multiplier)
+	{
+		for (auto & device : devices)
+		{
+			if (&device != &device_a && !device.try_aquire ())
+			{
+				split_devices.emplace_back (device);
+			}
+		}
+	}
+
+	if (split_devices.empty ())
+	{
+		nano_pow::nonce_range range;
+		range.begin = nano_pow::random_nonce ();
+		range.full = true;
+		return search (job_a, device_a.driver, range);
+	}
+	split_devices.insert (split_devices.begin (), device_a);
+
+	// Devices without a measurement yet are assumed to be as fast as the average measured device
+	std::vector<double> weights;
+	double measured_total (0);
+	size_t measured_count (0);
+	for (auto & device : split_devices)
+	{
+		weights.push_back (device.get ().driver->hashrate ());
+		if (weights.back () > 0)
+		{
+			measured_total += weights.back ();
+			++measured_count;
+		}
+	}
+	for (auto & weight : weights)
+	{
+		if (weight == 0)
+		{
+			weight = measured_count > 0 ? measured_total / measured_count : 1.0;
+		}
+	}
+	auto const ranges (nano_pow::partition (nano_pow::random_nonce (), weights));
+	logger->info ("Splitting work for root {} across {} devices", job_a.request.root_hash.to_hex (), split_devices.size ());
+
+	// The job's stop token is also used to stop the remaining devices once one of them finds a solution
+	std::mutex solution_mutex;
+	boost::optional<uint64_t> solution;
+	auto solve_share = [&](size_t index_a) {
+		auto & device (split_devices[index_a].get ());
+		try
+		{
+			auto result (search (job_a, device.driver, ranges[index_a]));
+			std::lock_guard<std::mutex> lk (solution_mutex);
+			if (result && !solution)
+			{
+				solution = result;
+				job_a.interrupt ();
+			}
+		}
+		catch (std::runtime_error const & ex)
+		{
+			logger->warn ("Device {} failed to generate its share of the work: {}", device.device_config.type_as_string (), ex.what ());
+		}
+	};
+
+	std::vector<std::future<void>> shares;
+	for (size_t i = 1; i < split_devices.size (); ++i)
+	{
+		shares.push_back (std::async (std::launch::async, solve_share, i));
+	}
+	solve_share (0);
+	for (auto & share : shares)
+	{
+		share.get ();
+	}
+	for (size_t i = 1; i < split_devices.size (); ++i)
+	{
+		split_devices[i].get ().release ();
+	}
+	// The workers of the lent devices resume taking jobs
+	notify_workers ();
+	return solution;
+}
+
+void nano_pow_server::work_handler::notify_workers ()
+{
+	{
+		std::lock_guard<std::mutex> lk (workers_mutex);
+		++workers_epoch;
+	}
+	workers_condition.notify_all ();
+}
+
+void nano_pow_server::work_handler::run_device (registered_device & device_a)
+{
+	std::unique_lock<std::mutex> lk (workers_mutex);
+	bool preempted (false);
+	while (!stopped)
+	{
+		auto const epoch (workers_epoch);
+		lk.unlock ();
+		bool ran (false);
+		// A device lent to a split job takes no jobs of its own until it is released
+		if (!device_a.try_aquire ())
+		{
+			auto job_l (next_job (device_a, preempted));
+			if (job_l)
+			{
+				rounds.dispatched (job_l->get_round ());
+				if (expire (*job_l))
+				{
+					device_a.release ();
+				}
+				else
+				{
+					preempted = run (job_l, device_a);
+				}
+				ran = true;
+			}
+			else
+			{
+				device_a.release ();
+			}
+		}
+		lk.lock ();
+		if (!ran)
+		{
+			workers_condition.wait (lk, [this, epoch]() { return stopped || workers_epoch != epoch; });
+		}
+	}
+}
+
+nano_pow_server::job_handle nano_pow_server::work_handler::next_job (registered_device & device_a, bool preempted_a)
+{
+	// After a preemption the job queue goes first, as it holds the job the device was freed for
+	job_handle result;
+	if (!preempted_a)
+	{
+		result = device_a.pop_local ();
+	}
+	if (!result)
+	{
+		result = pop_queued (device_a);
+		if (result && config.work.device_queue > 1)
+		{
+			// Slower devices take fewer jobs at a time, so that heterogeneous devices drain their local queues at
+			// similar rates. Devices without a measurement yet take the most.
+			double fastest (0);
+			for (auto const & device : devices)
+			{
+				fastest = std::max (fastest, device.driver->hashrate ());
+			}
+			auto const hashrate (device_a.driver->hashrate ());
+			size_t count (config.work.device_queue);
+			if (hashrate > 0 && fastest > 0)
+			{
+				count = std::max<size_t> (1, static_cast<size_t> (count * hashrate / fastest));
+			}
+			bool refilled (false);
+			for (; count > 1; --count)
+			{
+				auto next (pop_queued (device_a));
+				if (!next)
+				{
+					break;
+				}
+				device_a.push_local (next);
+				refilled = true;
+			}
+			// Idle devices may steal the surplus
+			if (refilled)
+			{
+				notify_workers ();
+			}
+		}
+	}
+	if (!result && preempted_a)
+	{
+		result = device_a.pop_local ();
+	}
+	if (!result)
+	{
+		registered_device * busiest (nullptr);
+		size_t longest (0);
+		for (auto & device : devices)
+		{
+			auto const size (device.local_size ());
+			if (&device != &device_a && size > longest)
+			{
+				busiest = &device;
+				longest = size;
+			}
+		}
+		if (busiest != nullptr)
+		{
+			result = busiest->steal ([this, &device_a](job const & job_a) { return !routed_away (job_a, device_a); });
+			if (result)
+			{
+				logger->info ("Device {} stole the job for root {}", device_a.device_config.type_as_string (), result->request.root_hash.to_hex ());
+			}
+		}
+	}
+	return result;
+}
+
+nano_pow_server::job_handle nano_pow_server::work_handler::pop_queued (registered_device & device_a)
+{
+	for (;;)
+	{
+		auto result (jobs.pop ());
+		if (!result || !routed_away (*result, device_a))
+		{
+			return result;
+		}
+		// Placed with the least loaded device of the fastest type, which is the one it is routed to
+		registered_device * target (nullptr);
+		for (auto & device : devices)
+		{
+			if (!routed_away (*result, device) && (target == nullptr || device.local_size () < target->local_size ()))
+			{
+				target = &device;
+			}
+		}
+		target->push_local (result);
+		notify_workers ();
+	}
+}
+
+bool nano_pow_server::work_handler::routed_away (job const & job_a, registered_device const & device_a) const
+{
+	if (config.work.route_multiplier <= 0 || job_a.request.multiplier < config.work.route_multiplier)
+	{
+		return false;
+	}
+	// Until a device has measured its hashrate, jobs are not routed
+	auto fastest (std::max_element (devices.begin (), devices.end (), [](registered_device const & lhs_a, registered_device const & rhs_a) {
+		return lhs_a.driver->hashrate () < rhs_a.driver->hashrate ();
+	}));
+	return fastest->driver->hashrate () > 0 && fastest->device_config.type != device_a.device_config.type;
+}
+
+uint64_t nano_pow_server::work_handler::rank (job const & job_a) const
+{
+	uint64_t result (0);
+	auto const attempts (std::min (job_a.get_attempts (), static_cast<double> (std::numeric_limits<uint64_t>::max () / 2)));
+	switch (config.work.scheduling)
+	{
+		case nano_pow_server::config::work::scheduling_policy::shortest:
+			result = static_cast<uint64_t> (attempts);
+			break;
+		case nano_pow_server::config::work::scheduling_policy::hybrid:
+		{
+			// The expected solve time on all devices together. Until the devices have measured their hashrate, jobs
+			// are ranked by submission time alone. The submission time is that of the job, so that a job ranked again
+			// keeps its place in time.
+			double hashrate (0);
+			for (auto const & device : devices)
+			{
+				hashrate += device.driver->hashrate ();
+			}
+			auto const expected_ms (hashrate > 0 ? static_cast<uint64_t> (attempts / hashrate * 1000) : 0);
+			auto const queued_ms (std::chrono::duration_cast<std::chrono::milliseconds> (job_a.queued_time.time_since_epoch ()).count ());
+			result = (queued_ms + expected_ms) / config.work.aging_window;
+			break;
+		}
+		default:
+			break;
+	}
+	return result;
+}
+
+boost::optional<std::chrono::milliseconds> nano_pow_server::work_handler::drain_time (double attempts_a)
+{
+	boost::optional<std::chrono::milliseconds> result;
+	double hashrate (0);
+	for (auto const & device : devices)
+	{
+		hashrate += device.driver->hashrate ();
+	}
+	if (hashrate > 0)
+	{
+		// Solving is memoryless, so active jobs are expected to take as many attempts as if they just started
+		auto attempts (attempts_a + jobs.attempts ());
+		for (auto const & device : devices)
+		{
+			for (auto const & job_l : device.local_queue ())
+			{
+				attempts += job_l->get_attempts ();
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lk (active_jobs_mutex);
+			for (auto const & active : active_jobs)
+			{
+				attempts += active->get_attempts ();
+			}
+		}
+		auto const ms (std::min (attempts / hashrate * 1000, static_cast<double> (std::numeric_limits<int64_t>::max () / 2)));
+		result = std::chrono::milliseconds (static_cast<int64_t> (ms));
+	}
+	return result;
+}
+
+void nano_pow_server::work_handler::admit (job const & job_a, double ahead_a)
+{
+	if (!config.server.admission_control)
+	{
+		return;
+	}
+	auto const eta (drain_time (ahead_a + job_a.get_attempts ()));
+	if (!eta)
+	{
+		return;
+	}
+	auto budget (config.server.drain_limit > 0 ? std::chrono::milliseconds (config.server.drain_limit) : std::chrono::milliseconds::max ());
+	if (job_a.has_deadline ())
+	{
+		budget = std::min (budget, std::chrono::duration_cast<std::chrono::milliseconds> (job_a.get_deadline () - std::chrono::system_clock::now ()));
+	}
+	if (*eta > budget)
+	{
+		// The queue is expected to have drained enough by the time the excess is worked off
+		auto const retry_after (std::chrono::duration_cast<std::chrono::seconds> (*eta - budget + std::chrono::milliseconds (999)));
+		throw overload_error ("Work server overloaded", eta, std::max (retry_after, std::chrono::seconds (1)));
+	}
+}
+
+nano_pow_server::job_handle nano_pow_server::work_handler::make_job (boost::property_tree::ptree const & request_a, boost::property_tree::ptree const & defaults_a)
+{
+	// A setting the request leaves out is taken from the defaults
+	auto source = [&request_a, &defaults_a](std::string const & key_a) -> boost::property_tree::ptree const & {
+		return request_a.count (key_a) > 0 ? request_a : defaults_a;
+	};
+
+	auto result (registry.create ());
+	auto & job_l (*result);
+
+	auto root_hash (request_a.get_optional<std::string> ("hash"));
+	if (!root_hash.is_initialized ())
+	{
+		throw std::runtime_error ("work_generate failed: missing hash value");
+	}
+	u256 hash (*root_hash);
+	job_l.request.root_hash = hash;
+
+	// A difficulty or multiplier of the request overrides either of the defaults
+	auto const base (config.work.base_difficulty);
+	job_l.request.difficulty = validation_difficulty (request_a, validation_difficulty (defaults_a, base, base), base);
+	to_work_difficulty (job_l.request.difficulty);
+	if (job_l.request.difficulty.number () > 0)
+	{
+		job_l.request.multiplier = to_multiplier (job_l.request.difficulty, base);
+	}
+
+	auto pri = source ("priority").get<unsigned> ("priority", 0);
+	if (config.server.allow_prioritization)
+	{
+		job_l.set_priority (pri);
+	}
+	else if (pri > 0)
+	{
+		logger->info ("Priority field ignored as it's disabled (for root hash: {})", job_l.request.root_hash.to_hex ());
+	}
+	job_l.set_aging (config.server.priority_aging_rate, config.server.priority_aging_cap);
+
+	// The client may give a relative timeout or an absolute deadline, both in milliseconds
+	auto deadline (job::no_deadline ());
+	auto timeout (source ("timeout").get_optional<uint64_t> ("timeout"));
+	if (timeout.is_initialized ())
+	{
+		deadline = std::chrono::system_clock::now () + std::chrono::milliseconds (*timeout);
+	}
+	auto deadline_ms (source ("deadline_ms").get_optional<uint64_t> ("deadline_ms"));
+	if (deadline_ms.is_initialized ())
+	{
+		deadline = std::min (deadline, std::chrono::time_point<std::chrono::system_clock> (std::chrono::milliseconds (*deadline_ms)));
+	}
+	if (deadline <= std::chrono::system_clock::now ())
+	{
+		throw std::runtime_error ("Work request expired");
+	}
+	job_l.set_deadline (deadline);
+	return result;
+}
+
+void nano_pow_server::work_handler::restore ()
+{
+	auto restored = [this](job_journal::entry const & entry_a) {
+		auto job_l (registry.create ());
+		job_l->restore_id (entry_a.job_id);
+		job_l->request.root_hash = entry_a.root_hash;
+		job_l->request.difficulty = entry_a.difficulty;
+		job_l->request.multiplier = entry_a.multiplier;
+		return job_l;
+	};
+
+	auto const solved (journal.solved ());
+	for (auto const & entry : solved)
+	{
+		auto job_l (restored (entry));
+		job_l->result.work = entry.work;
+		job_l->result.difficulty = entry.work_difficulty;
+		job_l->result.multiplier = entry.work_multiplier;
+		job_l->close ();
+		registry.add (job_l);
+		registry.complete (job_l);
+	}
+
+	auto const pending (journal.pending ());
+	size_t interrupted (0);
+	for (auto const & entry : pending)
+	{
+		auto job_l (restored (entry));
+		job_l->set_priority (entry.priority);
+		job_l->set_aging (config.server.priority_aging_rate, config.server.priority_aging_cap);
+		if (entry.deadline.count () > 0)
+		{
+			job_l->set_deadline (std::chrono::time_point<std::chrono::system_clock> (entry.deadline));
+		}
+		schedule (*job_l, entry.client);
+		// Nobody waits on a restored job, which is answered when polled like an asynchronous request
+		job_l->attach (job::waiter{ boost::none, nullptr, job_l->get_deadline () }, job_l->request.difficulty, job_l->request.multiplier);
+		auto const pushed (jobs.push (job_l, [this, &job_l](job_handle const &) {
+			registry.add (job_l);
+			return false;
+		}));
+		if (pushed != sharded_job_queue::push_result::queued)
+		{
+			registry.remove (*job_l);
+			journal.cancelled (*job_l);
+		}
+		interrupted += entry.dispatched ? 1 : 0;
+	}
+	if (!pending.empty () || !solved.empty ())
+	{
+		logger->info ("Restored {} queued work requests, of which {} were in progress, and {} solved work requests from the journal", pending.size (), interrupted, solved.size ());
+	}
+}
+
+boost::optional<boost::property_tree::ptree> nano_pow_server::work_handler::cached_response (job const & job_a)
+{
+	boost::optional<boost::property_tree::ptree> result;
+	auto cached (cache.find (job_a.request.root_hash, to_work_difficulty (job_a.request.difficulty)));
+	if (cached)
+	{
+		u128 difficulty (cached->difficulty);
+		logger->info ("Work for root hash {} found in cache", job_a.request.root_hash.to_hex ());
+		boost::property_tree::ptree response;
+		response.put ("work", u128 (cached->work).to_hex ());
+		response.put ("difficulty", difficulty.to_hex ());
+		response.put ("multiplier", to_multiplier (difficulty, config.work.base_difficulty));
+		result = response;
+	}
+	return result;
+}
+
+void nano_pow_server::work_handler::schedule (job & job_a, std::string const & client_a)
+{
+	// Within a priority and rank, jobs are dispatched in fair queuing rounds, so that one client's burst does
+	// not hold up other clients
+	auto weight (client_weights.find (client_a));
+	job_a.update_attempts ();
+	job_a.set_client (client_a);
+	job_a.set_round (rounds.assign (client_a, weight != client_weights.end () ? weight->second : 1));
+	job_a.set_rank (rank (job_a));
+}
+
+bool nano_pow_server::work_handler::expire (job & job_a)
+{
+	auto const expired (job_a.expire (std::chrono::system_clock::now ()));
+	if (expired.empty ())
+	{
+		return false;
+	}
+	boost::property_tree::ptree response;
+	response.put ("error", "Work request expired");
+	for (auto const & waiter : expired)
+	{
+		send_response (waiter, response);
+	}
+	auto const dropped (job_a.closed ());
+	if (dropped)
+	{
+		registry.remove (job_a);
+		journal.cancelled (job_a);
+		logger->info ("Dropped expired work request for root {}", job_a.request.root_hash.to_hex ());
+	}
+	return dropped;
+}
+
+bool nano_pow_server::work_handler::run (job_handle const & handle_a, registered_device & device_a)
+{
+	auto & job_a (*handle_a);
+	job_a.update_request ();
+	logger->info ("Thread {0:x} generating work on {1} for root {2}",
+	    std::hash<std::thread::id>{}(std::this_thread::get_id ()),
+	    device_a.device_config.type_as_string (),
+	    job_a.request.root_hash.to_hex ());
+
+	// A preempted job waited for its turn before it was first dispatched, and is counted only then
+	auto const first_dispatch (job_a.start_time == std::chrono::time_point<std::chrono::system_clock> ());
+	job_a.start ();
+	if (first_dispatch)
+	{
+		auto const waited (std::chrono::duration_cast<std::chrono::milliseconds> (job_a.start_time - job_a.queued_time));
+		std::lock_guard<std::mutex> lk (wait_stats_mutex);
+		auto & stats (waits[job_a.get_priority ()]);
+		++stats.count;
+		stats.total += waited;
+		stats.max = std::max (stats.max, waited);
+	}
+	{
+		std::lock_guard<std::mutex> lk (active_jobs_mutex);
+		active_jobs.insert (handle_a);
+		if (stopped)
+		{
+			job_a.cancel ();
+		}
+	}
+	journal.dispatched (job_a);
+
+	boost::property_tree::ptree response;
+	bool solved (false);
+	bool preempted (false);
+	try
+	{
+		if (config.work.mock_work_generation_delay == 0)
+		{
+			auto const solution (solve (job_a, device_a));
+			if (solution)
+			{
+				job_a.result.work = u128 (*solution);
+				auto const value (work_value (config, job_a.request.root_hash.bytes, *solution));
+				job_a.result.difficulty = u128 (value);
+				job_a.result.multiplier = to_multiplier (job_a.result.difficulty, config.work.base_difficulty);
+				cache.insert (job_a.request.root_hash, { *solution, value });
+				solved = true;
+			}
+			else if (job_a.cancelled ())
+			{
+				logger->info ("Work cancelled while in progress for hash {}", job_a.request.root_hash.to_hex ());
+				response.put ("status", "cancelled");
+			}
+			else if (job_a.preempted ())
+			{
+				preempted = true;
+			}
+			else
+			{
+				throw std::runtime_error ("Work generation failed");
+			}
+		}
+		else
+		{
+			// Mock response for testing
+			std::this_thread::sleep_for (std::chrono::seconds (config.work.mock_work_generation_delay));
+			job_a.result.work = u128 ("2feaeaa000000000");
+			job_a.result.difficulty = u128 ("0x2ffee0000000000");
+			job_a.result.multiplier = 1.3847;
+			response.put ("testing", true);
+			solved = true;
+		}
+	}
+	catch (std::runtime_error const & ex)
+	{
+		response.put ("error", ex.what ());
+	}
 
-nano_pow_server::job::job ()
-{
-	job_id = job_id_dispenser.fetch_add (1);
+	if (solved)
+	{
+		response.put ("work", job_a.result.work.to_hex ());
+		response.put ("difficulty", job_a.result.difficulty.to_hex ());
+		response.put ("multiplier", job_a.result.multiplier);
+	}
+
+	device_a.release ();
+	job_a.stop ();
+
+	// A preempted job is queued again with its checkpoint, and keeps its place in the queue order
+	if (preempted)
+	{
+		logger->info ("Work for root {} preempted after {} ms", job_a.request.root_hash.to_hex (), job_a.duration ().count ());
+		// The job leaves the active set before it is queued, or another device could take and run it in between,
+		// only for this erase to remove it from the set again
+		{
+			std::lock_guard<std::mutex> lk (active_jobs_mutex);
+			active_jobs.erase (handle_a);
+		}
+		job_a.resume ();
+		jobs.requeue (handle_a);
+		notify_workers ();
+		return true;
+	}
+
+	// The job is recorded as completed before the response, so that clients see a consistent queue
+	{
+		std::lock_guard<std::mutex> lk (active_jobs_mutex);
+		active_jobs.erase (handle_a);
+		if (solved)
+		{
+			registry.complete (handle_a);
+			journal.completed (job_a);
+		}
+		else
+		{
+			registry.remove (job_a);
+			// A job stopped by the shutdown of the server stays in the journal, to be restored
+			if (!stopped)
+			{
+				journal.cancelled (job_a);
+			}
+		}
+	}
+	for (auto const & waiter : job_a.close ())
+	{
+		send_response (waiter, response);
+	}
+
+	if (solved)
+	{
+		logger->info ("Work completed in {} ms for hash {} ({}, {:.2f} MH/s)", job_a.duration ().count (), job_a.request.root_hash.to_hex (),
+		    device_a.driver->description (), device_a.driver->hashrate () / 1e6);
+	}
+	return false;
 }
 
-/** Currently we support work on a single device, hence a single-thread pool */
-nano_pow_server::work_handler::work_handler (nano_pow_server::config const & config_a, std::shared_ptr<spdlog::logger> const & logger_a)
-    : config (config_a)
-    , logger (logger_a)
-    , pool (config.devices.size ())
+void nano_pow_server::work_handler::preempt_for (job const & job_a)
 {
-	for (auto device : config.devices)
+	// Preempting only pays off if no device is free to take the job
+	if (!config.work.preemption || std::any_of (devices.begin (), devices.end (), [](registered_device const & device_a) { return !device_a.busy; }))
 	{
-		std::shared_ptr<nano_pow::driver> driver;
-		if (device.type == nano_pow_server::config::device::device_type::cpu)
+		return;
+	}
+	std::lock_guard<std::mutex> lk (active_jobs_mutex);
+	job * victim (nullptr);
+	for (auto & active : active_jobs)
+	{
+		if (job_a.outranks (*active) && !active->preempted () && !active->cancelled () && (victim == nullptr || victim->outranks (*active)))
 		{
-			driver = std::make_shared<nano_pow::cpp_driver> ();
+			victim = active.get ();
 		}
-		else if (device.type == nano_pow_server::config::device::device_type::gpu)
+	}
+	if (victim != nullptr)
+	{
+		logger->info ("Preempting work for root {} in favor of root {}", victim->request.root_hash.to_hex (), job_a.request.root_hash.to_hex ());
+		victim->preempt ();
+	}
+}
+
+nano_pow_server::job_handle nano_pow_server::work_handler::coalesce (job const & job_a, job_handle const & queued_a, job::waiter const & waiter_a)
+{
+	// Jobs in device queues and active jobs are found through the registry, as the shared queue holds neither
+	auto existing (queued_a ? queued_a : registry.find (job_a.request.root_hash));
+	if (existing && !existing->cancelled () && existing->attach (waiter_a, job_a.request.difficulty, job_a.request.multiplier))
+	{
+		// A queued job is dispatched no later than the request would have been on its own
+		if (queued_a)
 		{
-			driver = std::make_shared<nano_pow::opencl_driver> ();
+			queued_a->merge (job_a);
+			queued_a->update_request ();
+			queued_a->set_rank (rank (*queued_a));
 		}
+		return existing;
+	}
+	return nullptr;
+}
 
-		devices.emplace_back (device, driver);
+boost::property_tree::ptree nano_pow_server::work_handler::status (job_handle const & job_a)
+{
+	boost::property_tree::ptree response;
+	// The job id is reported also for a solved job, as an asynchronous request may be solved before it is answered
+	response.put ("job_id", job_a->get_job_id ());
+	response.put ("hash", job_a->request.root_hash.to_hex ());
+	if (registry.solved (*job_a))
+	{
+		response.put ("work", job_a->result.work.to_hex ());
+		response.put ("difficulty", job_a->result.difficulty.to_hex ());
+		response.put ("multiplier", job_a->result.multiplier);
+		return response;
+	}
+	bool active (false);
+	{
+		std::lock_guard<std::mutex> lk (active_jobs_mutex);
+		active = active_jobs.find (job_a) != active_jobs.end ();
+	}
+	response.put ("status", active ? "active" : "queued");
+	// The time to drain the queue bounds the time until the job is solved
+	auto const eta (drain_time (0));
+	if (eta)
+	{
+		response.put ("eta_ms", eta->count ());
 	}
+	return response;
 }
 
-nano_pow_server::work_handler::~work_handler ()
+void nano_pow_server::work_handler::handle_status_request (std::string const & id, std::chrono::milliseconds wait_a, std::function<void(std::string)> response_handler)
+{
+	auto write_response = [response_handler](boost::property_tree::ptree const & response_a) {
+		std::stringstream ostream;
+		boost::property_tree::write_json (ostream, response_a);
+		response_handler (ostream.str ());
+	};
+
+	// Jobs that ended without a solution, and solved jobs that left the history, are no longer found
+	job_handle job_l;
+	try
+	{
+		job_l = registry.find (boost::lexical_cast<unsigned> (id));
+	}
+	catch (boost::bad_lexical_cast const &)
+	{
+	}
+	if (!job_l)
+	{
+		boost::property_tree::ptree response;
+		response.put ("error", "Job not found");
+		write_response (response);
+		return;
+	}
+
+	if (wait_a.count () > 0 && !registry.solved (*job_l))
+	{
+		// The client is answered by the job like any request attached to it, unless the wait is over first. The
+		// waiter stays attached until the job is answered or its deadline passes, but answers only once.
+		auto const wait (std::min<std::chrono::milliseconds> (wait_a, max_status_wait));
+		auto answered (std::make_shared<std::atomic<bool>> (false));
+		job::waiter const waiter{ boost::none, [answered, response_handler](std::string response_a) {
+			                         if (!answered->exchange (true))
+			                         {
+				                         response_handler (response_a);
+			                         }
+		                         },
+			std::chrono::system_clock::now () + wait };
+		if (job_l->attach (waiter, u128 ("0"), 1.0))
+		{
+			auto timer (std::make_shared<boost::asio::steady_timer> (validation_pool, wait));
+			timer->async_wait ([this, timer, job_l, answered, write_response](boost::system::error_code const &) {
+				if (!answered->exchange (true))
+				{
+					write_response (status (job_l));
+				}
+			});
+			return;
+		}
+	}
+	write_response (status (job_l));
+}
+
+void nano_pow_server::work_handler::cancel_waiters (job & job_a)
 {
-	pool.stop ();
+	registry.remove (job_a);
+	journal.cancelled (job_a);
+	boost::property_tree::ptree response;
+	response.put ("status", "cancelled");
+	for (auto const & waiter : job_a.close ())
+	{
+		send_response (waiter, response);
+	}
 }
 
 void nano_pow_server::work_handler::handle_queue_request (std::function<void(std::string)> response_handler)
 {
-	std::unique_lock<std::mutex> lk (jobs_mutex);
+	// Locally queued jobs run before the rest of the queue
+	std::vector<job_handle> queued_jobs;
+	for (auto const & device : devices)
+	{
+		auto const local (device.local_queue ());
+		queued_jobs.insert (queued_jobs.end (), local.begin (), local.end ());
+	}
+	auto const shared_jobs (jobs.jobs ());
+	queued_jobs.insert (queued_jobs.end (), shared_jobs.begin (), shared_jobs.end ());
+	auto const completed_jobs (registry.history ());
 	std::unique_lock<std::mutex> lk_active (active_jobs_mutex);
-	std::unique_lock<std::mutex> lk_completed (completed_jobs_mutex);
 
 	boost::property_tree::ptree response;
 
-	auto jobs_l = jobs;
-	lk.unlock ();
-
 	auto populate_json = [](boost::property_tree::ptree & json_job, job const & job_a) {
 		json_job.put ("id", job_a.get_job_id ());
 		json_job.put ("priority", job_a.get_priority ());
+		if (!job_a.get_client ().empty ())
+		{
+			json_job.put ("client", job_a.get_client ());
+		}
+		if (job_a.has_deadline ())
+		{
+			json_job.put ("deadline", std::chrono::duration_cast<std::chrono::milliseconds> (job_a.get_deadline ().time_since_epoch ()).count ());
+		}
 		json_job.put ("start", std::chrono::duration_cast<std::chrono::milliseconds> (job_a.start_time.time_since_epoch ()).count ());
 		json_job.put ("end", std::chrono::duration_cast<std::chrono::milliseconds> (job_a.end_time.time_since_epoch ()).count ());
 
@@ -72,13 +1075,11 @@ void nano_pow_server::work_handler::handle_queue_request (std::function<void(std
 	};
 
 	boost::property_tree::ptree child_queued_jobs;
-	while (!jobs_l.empty ())
+	for (auto const & current : queued_jobs)
 	{
-		auto current (jobs_l.top ());
 		boost::property_tree::ptree json_job;
-		populate_json (json_job, current);
+		populate_json (json_job, *current);
 		child_queued_jobs.push_back (std::make_pair ("", json_job));
-		jobs_l.pop ();
 	}
 	response.add_child ("queued", child_queued_jobs);
 
@@ -86,7 +1087,7 @@ void nano_pow_server::work_handler::handle_queue_request (std::function<void(std
 	for (auto current : active_jobs)
 	{
 		boost::property_tree::ptree json_job;
-		populate_json (json_job, current.get ());
+		populate_json (json_job, *current);
 		child_active_jobs.push_back (std::make_pair ("", json_job));
 	}
 	response.add_child ("active", child_active_jobs);
@@ -95,11 +1096,42 @@ void nano_pow_server::work_handler::handle_queue_request (std::function<void(std
 	for (auto const & current : completed_jobs)
 	{
 		boost::property_tree::ptree json_job;
-		populate_json (json_job, current);
+		populate_json (json_job, *current);
 		child_completed_jobs.push_back (std::make_pair ("", json_job));
 	}
 	response.add_child ("completed", child_completed_jobs);
 
+	boost::property_tree::ptree child_waits;
+	{
+		std::lock_guard<std::mutex> lk (wait_stats_mutex);
+		for (auto const & wait : waits)
+		{
+			boost::property_tree::ptree json_wait;
+			json_wait.put ("priority", wait.first);
+			json_wait.put ("count", wait.second.count);
+			json_wait.put ("average", wait.second.total.count () / wait.second.count);
+			json_wait.put ("max", wait.second.max.count ());
+			child_waits.push_back (std::make_pair ("", json_wait));
+		}
+	}
+	response.add_child ("wait", child_waits);
+
+	std::stringstream ostream;
+	boost::property_tree::write_json (ostream, response);
+	response_handler (ostream.str ());
+}
+
+void nano_pow_server::work_handler::handle_cache_request (std::function<void(std::string)> response_handler)
+{
+	boost::property_tree::ptree response;
+	response.put ("size", cache.size ());
+	response.put ("capacity", cache.capacity ());
+	response.put ("hits", cache.hits ());
+	response.put ("misses", cache.misses ());
+	response.put ("evictions", cache.evictions ());
+	response.put ("disk_capacity", cache.disk_capacity ());
+	response.put ("disk_hits", cache.disk_hits ());
+
 	std::stringstream ostream;
 	boost::property_tree::write_json (ostream, response);
 	response_handler (ostream.str ());
@@ -111,8 +1143,17 @@ void nano_pow_server::work_handler::handle_queue_delete_request (std::function<v
 
 	if (config.server.allow_control)
 	{
-		std::unique_lock<std::mutex> lk (jobs_mutex);
-		jobs = decltype (jobs) ();
+		for (auto & queued : jobs.clear ())
+		{
+			cancel_waiters (*queued);
+		}
+		for (auto & device : devices)
+		{
+			for (auto & queued : device.clear_local ())
+			{
+				cancel_waiters (*queued);
+			}
+		}
 		logger->warn ("Queue removed via RPC");
 		response.put ("success", true);
 	}
@@ -126,7 +1167,8 @@ void nano_pow_server::work_handler::handle_queue_delete_request (std::function<v
 	response_handler (ostream.str ());
 }
 
-void nano_pow_server::work_handler::handle_request_async (std::string body, std::function<void(std::string)> response_handler)
+void nano_pow_server::work_handler::handle_request_async (std::string body, std::function<void(std::string)> response_handler, std::string const & client,
+    std::function<void(std::string, std::chrono::seconds)> overload_handler)
 {
 	auto attach_correlation_id = [](boost::optional<std::string> const & id, boost::property_tree::ptree & response) {
 		if (id)
@@ -164,184 +1206,364 @@ void nano_pow_server::work_handler::handle_request_async (std::string body, std:
 				throw std::runtime_error ("No work device has been configured");
 			}
 
-			job job_l;
+			auto job_l (make_job (request, boost::property_tree::ptree ()));
+
+			logger->info ("Work requested. Root hash: {}, difficulty: {}, priority: {}",
+			    job_l->request.root_hash.to_hex (), job_l->request.difficulty.to_hex (), job_l->get_priority ());
 
-			auto root_hash (request.get_optional<std::string> ("hash"));
-			if (!root_hash.is_initialized ())
+			// Retried requests are answered from the cache without queueing a job
+			auto cached (cached_response (*job_l));
+			if (cached)
 			{
-				throw std::runtime_error ("work_generate failed: missing hash value");
+				attach_correlation_id (correlation_id, *cached);
+				std::stringstream ostream;
+				boost::property_tree::write_json (ostream, *cached);
+				response_handler (ostream.str ());
+				return;
 			}
-			u256 hash (*root_hash);
-			job_l.request.root_hash = hash;
+			schedule (*job_l, client);
 
-			job_l.request.difficulty = config.work.base_difficulty;
-			auto difficulty_hex (request.get_optional<std::string> ("difficulty"));
-			if (difficulty_hex.is_initialized ())
+			// Queue the request as a job, unless a job for the same root can answer it as well. The job answers the
+			// request that created it like any other request attached to it. An asynchronous request is answered with
+			// the id of the job instead, and its client polls for the result.
+			auto const async (request.get<bool> ("async", false));
+			job::waiter const waiter{ correlation_id, async ? nullptr : response_handler, job_l->get_deadline () };
+			job_l->attach (waiter, job_l->request.difficulty, job_l->request.multiplier);
+			// Admission is decided before the push, but applies only if the request is not attached to an existing job
+			boost::optional<overload_error> overload;
+			try
 			{
-				job_l.request.difficulty.from_hex (*difficulty_hex);
+				admit (*job_l);
 			}
-
-			double multiplier = request.get<double> ("multiplier", .0);
-			if (multiplier > .0)
+			catch (overload_error const & ex)
 			{
-				job_l.request.difficulty = from_multiplier (multiplier, config.work.base_difficulty);
+				overload = ex;
 			}
-
-			auto pri = request.get<unsigned> ("priority", 0);
-			if (config.server.allow_prioritization)
+			// Journaled before the push, so that the shard is not locked while the journal is written. A job that ends up
+			// attached to another is journaled as cancelled.
+			if (!overload)
+			{
+				journal.enqueued (*job_l);
+			}
+			bool rejected (false);
+			job_handle attached;
+			auto const pushed (jobs.push (job_l, [this, &job_l, &waiter, &overload, &rejected, &attached](job_handle const & queued_a) {
+				attached = coalesce (*job_l, queued_a, waiter);
+				if (attached)
+				{
+					return true;
+				}
+				// A rejected request is not queued, and answered once the queue is unlocked
+				rejected = overload.is_initialized ();
+				if (!rejected)
+				{
+					// The job is registered while its shard is locked, so that no device can take it before it is indexed
+					registry.add (job_l);
+				}
+				return rejected;
+			}));
+			if (pushed != sharded_job_queue::push_result::queued)
+			{
+				registry.remove (*job_l);
+				journal.cancelled (*job_l);
+			}
+			if (rejected)
+			{
+				throw *overload;
+			}
+			auto respond_async = [&](job_handle const & job_a) {
+				auto response (status (job_a));
+				attach_correlation_id (correlation_id, response);
+				std::stringstream ostream;
+				boost::property_tree::write_json (ostream, response);
+				response_handler (ostream.str ());
+			};
+			if (pushed == sharded_job_queue::push_result::attached)
+			{
+				logger->info ("Work request for root hash {} attached to an existing job", job_l->request.root_hash.to_hex ());
+				journal.updated (*attached);
+				if (async)
+				{
+					respond_async (attached);
+				}
+				return;
+			}
+			if (pushed == sharded_job_queue::push_result::full)
+			{
+				auto const eta (drain_time (0));
+				throw overload_error ("Work request limit exceeded", eta, std::max (std::chrono::duration_cast<std::chrono::seconds> (eta.value_or (std::chrono::seconds (1))), std::chrono::seconds (1)));
+			}
+			notify_workers ();
+			preempt_for (*job_l);
+			if (async)
+			{
+				respond_async (job_l);
+			}
+		}
+		else if (action && *action == "work_generate_batch")
+		{
+			if (config.devices.empty ())
 			{
-				job_l.set_priority (pri);
+				throw std::runtime_error ("No work device has been configured");
 			}
-			else if (pri > 0)
+			auto const items (request.get_child_optional ("items"));
+			if (!items || items->empty ())
 			{
-				logger->info ("Priority field ignored as it's disabled (for root hash: {})", job_l.request.root_hash.to_hex ());
+				throw std::runtime_error ("work_generate_batch failed: missing items");
 			}
 
-			logger->info ("Work requested. Root hash: {}, difficulty: {}, priority: {}",
-			    job_l.request.root_hash.to_hex (), job_l.request.difficulty.to_hex (), job_l.get_priority ());
+			// Every item is parsed before any is queued, so that an invalid item fails the whole batch
+			std::vector<job_handle> batch_jobs;
+			batch_jobs.reserve (items->size ());
+			for (auto const & item : *items)
+			{
+				batch_jobs.push_back (make_job (item.second, request));
+			}
+			logger->info ("Batch of {} work requests", batch_jobs.size ());
 
-			// Queue the request as a job
+			// The results are sent together once every item is answered, or one by one as each completes
+			class batch
 			{
-				std::unique_lock<std::mutex> lk (jobs_mutex);
-				if (jobs.size () < config.server.request_limit)
+			public:
+				std::mutex mutex;
+				std::vector<std::string> hashes;
+				std::vector<boost::property_tree::ptree> results;
+				size_t remaining{ 0 };
+			};
+			auto batch_l (std::make_shared<batch> ());
+			batch_l->results.resize (batch_jobs.size ());
+			batch_l->remaining = batch_jobs.size ();
+			for (auto const & job_l : batch_jobs)
+			{
+				batch_l->hashes.push_back (job_l->request.root_hash.to_hex ());
+			}
+			auto const incremental (request.get<bool> ("incremental", false));
+			auto complete = [batch_l, response_handler, correlation_id, incremental](size_t index_a, boost::property_tree::ptree result_a) {
+				result_a.put ("hash", batch_l->hashes[index_a]);
+				boost::property_tree::ptree response;
+				if (incremental)
 				{
-					jobs.push (job_l);
+					result_a.put ("index", index_a);
+					response = result_a;
 				}
 				else
 				{
-					throw std::runtime_error ("Work request limit exceeded");
-				}
-			}
-
-			// The thread pool size is the same as the driver count. As a result, we know that a driver
-			// will be available whenever the pool handler is called.
-			boost::asio::post (pool, [this, correlation_id, response_handler, create_error_response, attach_correlation_id] {
-				std::unique_lock<std::mutex> lk (jobs_mutex);
-				if (!jobs.empty ())
-				{
-					auto job = jobs.top ();
-					jobs.pop ();
-					lk.unlock ();
-
-					try
+					std::lock_guard<std::mutex> lk (batch_l->mutex);
+					batch_l->results[index_a] = result_a;
+					if (--batch_l->remaining > 0)
 					{
-						auto & device = aquire_first_available_device ();
-						logger->info ("Thread {0:x} generating work on {1} for root {2}",
-						    std::hash<std::thread::id>{}(std::this_thread::get_id ()),
-						    device.device_config.type_as_string (),
-						    job.request.root_hash.to_hex ());
-
-						job.start ();
-
-						{
-							std::unique_lock<std::mutex> lk (active_jobs_mutex);
-							active_jobs.insert (job);
-						}
-
-						// TODO: set difficulty when handling request once the nano-pow API is set
-						//       as well as set_memory based on request?
-						// driver->difficulty_set(nano_pow::reverse ((1ULL << 40) - 1));
-						// driver->memory_set (...);
-
-						// TODO: nano-pow API currently takes a 64 bit integer, same with the nonce
-
-						// The lower 128 bits of the 256 bit root is used as nonce
-						//std::array<uint64_t, 2> nonce {job.request.root_hash.qwords[1], job.request.root_hash.qwords[0]};
-						//device.driver->difficulty_set(job_l.request.difficulty);
-						//uint64_t solution = device.driver->solve(nonce);
-
-						boost::property_tree::ptree response;
-
-						if (this->config.work.mock_work_generation_delay == 0)
-						{
-							// TODO: use values from nano-pow / to_multiplier ()
-							job.result.work = u128 ("2feaeaa000000000");
-							job.result.difficulty = u128 ("2000000000000000");
-							job.result.multiplier = 1.0;
-						}
-						else
-						{
-							// Mock response for testing
-							std::this_thread::sleep_for (std::chrono::seconds (this->config.work.mock_work_generation_delay));
-							job.result.work = u128 ("2feaeaa000000000");
-							job.result.difficulty = u128 ("0x2ffee0000000000");
-							job.result.multiplier = 1.3847;
-							response.put ("testing", true);
-						}
-
-						response.put ("work", job.result.work.to_hex ());
-						response.put ("difficulty", job.result.difficulty.to_hex ());
-						response.put ("multiplier", job.result.multiplier);
-						attach_correlation_id (correlation_id, response);
-
-						std::stringstream ostream;
-						boost::property_tree::write_json (ostream, response);
-						response_handler (ostream.str ());
-
-						device.release ();
-						job.stop ();
-
-						std::unique_lock<std::mutex> lk_active (active_jobs_mutex);
-						std::unique_lock<std::mutex> lk_completed (completed_jobs_mutex);
-						active_jobs.erase (job);
-						completed_jobs.push_back (job);
-
-						logger->info ("Work completed in {} ms for hash {} ", job.duration ().count (), job.request.root_hash.to_hex ());
+						return;
 					}
-					catch (std::runtime_error const & ex)
+					boost::property_tree::ptree results;
+					for (auto const & result : batch_l->results)
 					{
-						response_handler (create_error_response (correlation_id, ex.what ()));
+						results.push_back (std::make_pair ("", result));
 					}
+					response.add_child ("results", results);
+				}
+				if (correlation_id)
+				{
+					response.put ("id", *correlation_id);
+				}
+				std::stringstream ostream;
+				boost::property_tree::write_json (ostream, response);
+				response_handler (ostream.str ());
+			};
+
+			std::vector<size_t> indices;
+			std::vector<job_handle> pending;
+			std::vector<job::waiter> waiters;
+			std::vector<boost::optional<overload_error>> overloads;
+			double admitted (0);
+			for (size_t i (0); i < batch_jobs.size (); ++i)
+			{
+				auto & job_l (batch_jobs[i]);
+				auto cached (cached_response (*job_l));
+				if (cached)
+				{
+					complete (i, *cached);
+					continue;
+				}
+				schedule (*job_l, client);
+				waiters.push_back (job::waiter{ boost::none, nullptr, job_l->get_deadline (), [complete, i](boost::property_tree::ptree const & result_a) { complete (i, result_a); } });
+				job_l->attach (waiters.back (), job_l->request.difficulty, job_l->request.multiplier);
+				overloads.emplace_back ();
+				try
+				{
+					// Earlier items of the batch count towards the queue the later ones wait behind
+					admit (*job_l, admitted);
+					admitted += job_l->get_attempts ();
+				}
+				catch (overload_error const & ex)
+				{
+					overloads.back () = ex;
+				}
+				if (!overloads.back ())
+				{
+					journal.enqueued (*job_l);
+				}
+				indices.push_back (i);
+				pending.push_back (job_l);
+			}
+
+			std::vector<char> rejected (pending.size (), false);
+			std::vector<job_handle> attached (pending.size ());
+			auto const pushed (jobs.push (pending, [this, &pending, &waiters, &overloads, &rejected, &attached](size_t index_a, job_handle const & queued_a) {
+				attached[index_a] = coalesce (*pending[index_a], queued_a, waiters[index_a]);
+				if (attached[index_a])
+				{
+					return true;
+				}
+				// A rejected item is not queued, and answered once the queue is unlocked
+				rejected[index_a] = overloads[index_a].is_initialized ();
+				if (!rejected[index_a])
+				{
+					registry.add (pending[index_a]);
+				}
+				return static_cast<bool> (rejected[index_a]);
+			}));
+			bool queued (false);
+			for (size_t i (0); i < pending.size (); ++i)
+			{
+				if (pushed[i] == sharded_job_queue::push_result::full)
+				{
+					auto const eta (drain_time (0));
+					overloads[i] = overload_error ("Work request limit exceeded", eta, std::max (std::chrono::duration_cast<std::chrono::seconds> (eta.value_or (std::chrono::seconds (1))), std::chrono::seconds (1)));
+					rejected[i] = true;
+				}
+				if (rejected[i])
+				{
+					pending[i]->close ();
+					complete (indices[i], overload_response (*overloads[i]));
+				}
+				if (pushed[i] == sharded_job_queue::push_result::queued)
+				{
+					queued = true;
 				}
 				else
 				{
-					response_handler (create_error_response (correlation_id, "No jobs available"));
+					registry.remove (*pending[i]);
+					journal.cancelled (*pending[i]);
 				}
-			});
+				if (attached[i])
+				{
+					journal.updated (*attached[i]);
+				}
+			}
+			if (queued)
+			{
+				notify_workers ();
+				for (size_t i (0); i < pending.size (); ++i)
+				{
+					if (pushed[i] == sharded_job_queue::push_result::queued)
+					{
+						preempt_for (*pending[i]);
+					}
+				}
+			}
 		}
 		else if (action && *action == "work_validate")
 		{
 			auto hash_hex (request.get_optional<std::string> ("hash"));
 			if (!hash_hex.is_initialized ())
 			{
-				throw std::runtime_error ("work_generate failed: missing hash value");
+				throw std::runtime_error ("work_validate failed: missing hash value");
 			}
 			u256 hash (*hash_hex);
+			auto const nonce (validation_nonce (request, *action));
+			auto const difficulty (validation_difficulty (request, config.work.base_difficulty, config.work.base_difficulty));
 
-			auto work_hex (request.get_optional<std::string> ("work"));
-			if (!work_hex.is_initialized ())
-			{
-				throw std::runtime_error ("work_generate failed: missing work value");
-			}
-			u128 work (*work_hex);
+			boost::property_tree::ptree response;
+			put_validation (response, work_value (config, hash.bytes, nonce), difficulty, config.work.base_difficulty);
+			attach_correlation_id (correlation_id, response);
 
-			u128 difficulty = config.work.base_difficulty;
-			auto difficulty_hex (request.get_optional<std::string> ("difficulty"));
-			if (difficulty_hex.is_initialized ())
-			{
-				difficulty.from_hex (*difficulty_hex);
-			}
+			std::stringstream ostream;
+			boost::property_tree::write_json (ostream, response);
+			response_handler (ostream.str ());
+		}
+		else if (action && *action == "work_validate_batch")
+		{
+			// The request level difficulty or multiplier applies to every pair without its own
+			auto const default_difficulty (validation_difficulty (request, config.work.base_difficulty, config.work.base_difficulty));
 
-			double multiplier = request.get<double> ("multiplier", .0);
-			if (multiplier > .0)
+			class batch
 			{
-				difficulty = from_multiplier (multiplier, config.work.base_difficulty);
+			public:
+				std::vector<u256> hashes;
+				std::vector<u128> difficulties;
+				std::vector<uint64_t> root_words;
+				std::vector<uint64_t> nonces;
+				std::vector<uint64_t> values;
+				std::atomic<size_t> remaining_chunks{ 0 };
+			};
+			auto batch_l (std::make_shared<batch> ());
+			for (auto const & item : request.get_child ("pairs", boost::property_tree::ptree ()))
+			{
+				auto hash_hex (item.second.get_optional<std::string> ("hash"));
+				if (!hash_hex.is_initialized ())
+				{
+					throw std::runtime_error ("work_validate_batch failed: missing hash value");
+				}
+				batch_l->hashes.emplace_back (*hash_hex);
+				auto const words (nano_pow::to_root_words (batch_l->hashes.back ().bytes));
+				batch_l->root_words.insert (batch_l->root_words.end (), words.begin (), words.end ());
+				batch_l->nonces.push_back (validation_nonce (item.second, *action));
+				batch_l->difficulties.push_back (validation_difficulty (item.second, default_difficulty, config.work.base_difficulty));
 			}
+			batch_l->values.resize (batch_l->nonces.size ());
 
-			// TODO: update to use nano_pow::passes when the API is done
-			bool passes (true);
-
-			boost::property_tree::ptree response;
-			response.put ("valid", passes ? "1" : "0");
+			auto respond = [this, batch_l, correlation_id, attach_correlation_id, response_handler]() {
+				boost::property_tree::ptree child_results;
+				for (size_t i = 0; i < batch_l->values.size (); ++i)
+				{
+					boost::property_tree::ptree result;
+					result.put ("hash", batch_l->hashes[i].to_hex ());
+					put_validation (result, batch_l->values[i], batch_l->difficulties[i], config.work.base_difficulty);
+					child_results.push_back (std::make_pair ("", result));
+				}
+				boost::property_tree::ptree response;
+				response.add_child ("results", child_results);
+				attach_correlation_id (correlation_id, response);
 
-			// TODO: add these when the nano_pow API is done
-			response.put ("difficulty", "0x2000000000000000");
-			response.put ("multiplier", "1.0"); // TODO: to_multiplier ()
-			attach_correlation_id (correlation_id, response);
+				std::stringstream ostream;
+				boost::property_tree::write_json (ostream, response);
+				response_handler (ostream.str ());
+			};
 
-			std::stringstream ostream;
-			boost::property_tree::write_json (ostream, response);
-			response_handler (ostream.str ());
+			auto const count (batch_l->nonces.size ());
+			if (count == 0)
+			{
+				respond ();
+			}
+			else
+			{
+				logger->info ("Validating {} work values", count);
+				batch_l->remaining_chunks = (count + validation_chunk - 1) / validation_chunk;
+				auto const & kernel (nano_pow::best_kernel ());
+				auto const memory_hard (config.work.memory_hard);
+				for (size_t begin = 0; begin < count; begin += validation_chunk)
+				{
+					boost::asio::post (validation_pool, [batch_l, begin, count, &kernel, memory_hard, respond]() {
+						auto const size (std::min (validation_chunk, count - begin));
+						if (memory_hard)
+						{
+							for (auto i (begin); i < begin + size; ++i)
+							{
+								batch_l->values[i] = nano_pow::table_difficulty (batch_l->hashes[i].bytes, batch_l->nonces[i]);
+							}
+						}
+						else
+						{
+							kernel.values (batch_l->root_words.data () + begin * 4, batch_l->nonces.data () + begin, size, batch_l->values.data () + begin);
+						}
+						// Whichever chunk finishes last sends the response
+						if (batch_l->remaining_chunks.fetch_sub (1) == 1)
+						{
+							respond ();
+						}
+					});
+				}
+			}
 		}
 		else if (action && *action == "work_cancel")
 		{
@@ -377,6 +1599,22 @@ void nano_pow_server::work_handler::handle_request_async (std::string body, std:
 			throw std::runtime_error ("Invalid action field");
 		}
 	}
+	catch (overload_error const & ex)
+	{
+		logger->info ("Work request rejected: {}, retry after {} s", ex.what (), ex.retry_after.count ());
+		auto response (overload_response (ex));
+		attach_correlation_id (correlation_id, response);
+		std::stringstream ostream;
+		boost::property_tree::write_json (ostream, response);
+		if (overload_handler)
+		{
+			overload_handler (ostream.str (), ex.retry_after);
+		}
+		else
+		{
+			response_handler (ostream.str ());
+		}
+	}
 	catch (std::runtime_error const & ex)
 	{
 		logger->info ("An error occurred and will be reported to the client: {}", ex.what ());
@@ -2,121 +2,64 @@
 
 #include <boost/asio/post.hpp>
 #include <boost/asio/thread_pool.hpp>
-#include <boost/circular_buffer.hpp>
 #include <boost/optional.hpp>
+#include <boost/property_tree/ptree.hpp>
 
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <deque>
 #include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
-#include <queue>
 #include <set>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <spdlog/spdlog.h>
 #include <workserver/config.hpp>
+#include <workserver/job_journal.hpp>
+#include <workserver/job_queue.hpp>
+#include <workserver/job_registry.hpp>
+#include <workserver/pow.hpp>
+#include <workserver/pow_table.hpp>
 #include <workserver/util.hpp>
-
-// Mock types for the pow backend
-namespace nano_pow
-{
-	class driver
-	{
-	};
-	class cpp_driver : public driver
-	{
-	};
-	class opencl_driver : public driver
-	{
-	};
-}
+#include <workserver/work_cache.hpp>
 
 namespace nano_pow_server
 {
-/**
- * A job is a queued work generation request with an optional priority. Jobs are stable-sorted,
- * which means it's a FIFO queue within each priority level.
- */
-class job
+/** A work request rejected because the server does not expect to get to it in time */
+class overload_error : public std::runtime_error
 {
 public:
-	/** Constructor sets a unique job id */
-	job ();
-	std::chrono::time_point<std::chrono::system_clock> start_time;
-	std::chrono::time_point<std::chrono::system_clock> end_time;
-
-	struct request
-	{
-		u256 root_hash{ "0" };
-		u128 difficulty{ "0" };
-		double multiplier{ 1.0 };
-	} request;
-
-	struct result
-	{
-		u128 work{ "0" };
-		u128 difficulty{ "0" };
-		double multiplier{ 1.0 };
-	} result;
-
-	void start ()
-	{
-		start_time = std::chrono::system_clock::now ();
-	}
-
-	void stop ()
+	overload_error (std::string const & what_a, boost::optional<std::chrono::milliseconds> eta_a, std::chrono::seconds retry_after_a)
+	    : std::runtime_error (what_a)
+	    , eta (eta_a)
+	    , retry_after (retry_after_a)
 	{
-		end_time = std::chrono::system_clock::now ();
 	}
 
-	std::chrono::milliseconds duration ()
-	{
-		return std::chrono::duration_cast<std::chrono::milliseconds> (end_time - start_time);
-	}
-
-	unsigned get_job_id () const
-	{
-		return job_id;
-	}
-
-	unsigned get_priority () const
-	{
-		return priority;
-	}
-
-	void set_priority (unsigned priority_a)
-	{
-		priority = priority_a;
-	}
-
-	/** Stable sorted priority queue */
-	struct comparator
-	{
-		bool operator() (job const & job1, job const & job2) const
-		{
-			if (job1.priority != job2.priority)
-			{
-				return job2.priority > job1.priority;
-			}
-			return job1.job_id > job2.job_id;
-		}
-	};
-
-private:
-	unsigned priority{ 0 };
-	unsigned job_id{ 0 };
-	static std::atomic<unsigned> job_id_dispenser;
+	/** The estimated time until the request would have been solved, if the hashrate of the devices is known */
+	boost::optional<std::chrono::milliseconds> eta;
+	/** How long the client should wait before submitting again */
+	std::chrono::seconds retry_after;
 };
 
 /** Parses and processes work requests */
 class work_handler
 {
 public:
-	/** We register a nano_pow device for every device entry in the config file */
+	/**
+	 * We register a nano_pow device for every device entry in the config file. Each device has a worker thread,
+	 * and a local queue of jobs it took from the job queue ahead of time. Idle devices steal from the local
+	 * queues of busy ones.
+	 */
 	class registered_device
 	{
 	public:
@@ -131,6 +74,8 @@ public:
 			device_config = other.device_config;
 			driver = other.driver;
 			busy = other.busy.load ();
+			std::lock_guard<std::mutex> lk (other.local_mutex);
+			local_jobs = other.local_jobs;
 		}
 
 		/** Sets the busy flag and returns the previous busy state. If the returned value is true, the device is already busy. */
@@ -145,9 +90,92 @@ public:
 			return busy.exchange (false);
 		}
 
+		/** Adds \p job_a to the back of the local queue */
+		void push_local (job_handle const & job_a)
+		{
+			std::lock_guard<std::mutex> lk (local_mutex);
+			local_jobs.push_back (job_a);
+		}
+
+		/** Takes the next job of this device from the front of the local queue, or returns nullptr */
+		job_handle pop_local ()
+		{
+			job_handle result;
+			std::lock_guard<std::mutex> lk (local_mutex);
+			if (!local_jobs.empty ())
+			{
+				result = local_jobs.front ();
+				local_jobs.pop_front ();
+			}
+			return result;
+		}
+
+		/**
+		 * Takes the last job in the local queue that \p eligible_a accepts, for another device to run. Jobs are
+		 * stolen from the back, as this device would run them last.
+		 */
+		job_handle steal (std::function<bool(job const &)> const & eligible_a)
+		{
+			job_handle result;
+			std::lock_guard<std::mutex> lk (local_mutex);
+			auto existing (std::find_if (local_jobs.rbegin (), local_jobs.rend (), [&eligible_a](job_handle const & job_a) { return eligible_a (*job_a); }));
+			if (existing != local_jobs.rend ())
+			{
+				result = *existing;
+				local_jobs.erase (std::next (existing).base ());
+			}
+			return result;
+		}
+
+		/** Removes all locally queued jobs for \p root_a and returns them */
+		std::vector<job_handle> remove_local (u256 const & root_a)
+		{
+			std::vector<job_handle> result;
+			std::lock_guard<std::mutex> lk (local_mutex);
+			for (auto i (local_jobs.begin ()); i != local_jobs.end ();)
+			{
+				if ((*i)->request.root_hash == root_a)
+				{
+					result.push_back (*i);
+					i = local_jobs.erase (i);
+				}
+				else
+				{
+					++i;
+				}
+			}
+			return result;
+		}
+
+		/** Removes all locally queued jobs and returns them */
+		std::vector<job_handle> clear_local ()
+		{
+			std::lock_guard<std::mutex> lk (local_mutex);
+			std::vector<job_handle> result (local_jobs.begin (), local_jobs.end ());
+			local_jobs.clear ();
+			return result;
+		}
+
+		/** Returns the local queue, next job first */
+		std::vector<job_handle> local_queue () const
+		{
+			std::lock_guard<std::mutex> lk (local_mutex);
+			return std::vector<job_handle> (local_jobs.begin (), local_jobs.end ());
+		}
+
+		size_t local_size () const
+		{
+			std::lock_guard<std::mutex> lk (local_mutex);
+			return local_jobs.size ();
+		}
+
 		nano_pow_server::config::device device_config;
 		std::shared_ptr<nano_pow::driver> driver;
 		std::atomic<bool> busy{ false };
+
+	private:
+		mutable std::mutex local_mutex;
+		std::deque<job_handle> local_jobs;
 	};
 
 	work_handler (nano_pow_server::config const & config_a, std::shared_ptr<spdlog::logger> const & logger_a);
@@ -156,97 +184,232 @@ public:
 	/**
 	 * Parse JSON work generation request.
 	 * Returns immediately and delivers the result by calling \p response_handler
+	 * An asynchronous work request is answered with the id of its job once it is queued, see handle_status_request.
+	 * Work requests are queued fairly among clients, each identified by its \p client key.
+	 * A request rejected because the server is overloaded is answered through \p overload_handler if set, which is
+	 * also passed how long the client should wait before trying again.
 	 */
-	void handle_request_async (std::string body, std::function<void(std::string)> response_handler);
+	void handle_request_async (std::string body, std::function<void(std::string)> response_handler, std::string const & client = "",
+	    std::function<void(std::string, std::chrono::seconds)> overload_handler = nullptr);
+
+	/**
+	 * Emits the status of the job with the given \p id, as returned for an asynchronous work request: the work once
+	 * it is solved, or else whether the job is queued or active and when it is expected to be solved. A pending job
+	 * is reported once it is answered or \p wait_a has passed, whichever is first, so that clients can long-poll.
+	 */
+	void handle_status_request (std::string const & id, std::chrono::milliseconds wait_a, std::function<void(std::string)> response_handler);
 
 	/**
 	 * Emits queue information in json format
 	 */
 	void handle_queue_request (std::function<void(std::string)> response_handler);
 
+	/**
+	 * Emits work cache statistics in json format
+	 */
+	void handle_cache_request (std::function<void(std::string)> response_handler);
+
 	/**
 	 * Clears the work queue. Requires config option server.allow_control to be true.
 	 */
 	void handle_queue_delete_request (std::function<void(std::string)> response_handler);
 
-	/** Pushes a copy of \p job into the job queue */
-	void push_job (nano_pow_server::job const & job)
+	/** Pushes \p job into the job queue */
+	void push_job (nano_pow_server::job_handle const & job)
 	{
-		std::lock_guard<std::mutex> lk (jobs_mutex);
-		jobs.emplace (job);
+		jobs.push (job, [](nano_pow_server::job_handle const &) { return false; });
 	}
 
 	/**
-	 * Removes a pending work request from the queue
-	 * @return true if the \p root_hash was found and removed
+	 * Removes a pending work request from the queue, or cancels it if a device is already working on it
+	 * @return true if the \p root_hash was found and removed or cancelled
 	 */
 	bool remove_job (u256 root_hash)
 	{
-		std::lock_guard<std::mutex> lk (jobs_mutex);
-
-		// It's not possible to remove from priority queues. As cancelling work is an infrequent request, we
-		// simply reconstruct the queue through a filter.
-		std::priority_queue<job, std::vector<job>, job::comparator> jobs_l;
 		bool removed = false;
-		while (!jobs.empty ())
+		for (auto & current : jobs.remove (root_hash))
+		{
+			cancel_waiters (*current);
+			removed = true;
+		}
+		for (auto & device : devices)
 		{
-			auto current (jobs.top ());
-			if (current.request.root_hash.number () != root_hash.number ())
+			for (auto & current : device.remove_local (root_hash))
 			{
-				jobs_l.push (current);
+				cancel_waiters (*current);
+				removed = true;
 			}
-			else
+		}
+
+		// Active jobs are stopped through their stop token. The solver returns promptly, after which the device is
+		// released and the waiting client is told the work was cancelled.
+		std::lock_guard<std::mutex> lk_active (active_jobs_mutex);
+		for (auto & active : active_jobs)
+		{
+			if (active->request.root_hash.number () == root_hash.number ())
 			{
+				active->cancel ();
 				removed = true;
 			}
-
-			jobs.pop ();
 		}
-		jobs.swap (jobs_l);
 		return removed;
 	}
 
-	/** Returns the next highest priority job, or boost::none if no jobs are available */
-	boost::optional<nano_pow_server::job> pop_job ()
+	/** Returns the next highest priority job, or nullptr if no jobs are available */
+	nano_pow_server::job_handle pop_job ()
 	{
-		std::lock_guard<std::mutex> lk (jobs_mutex);
-		boost::optional<nano_pow_server::job> res;
-		if (!jobs.empty ())
-		{
-			res = jobs.top ();
-			jobs.pop ();
-		}
-		return res;
+		return jobs.pop ();
 	}
 
-	std::priority_queue<job, std::vector<job>, job::comparator> const & get_queue () const
+	sharded_job_queue const & get_queue () const
 	{
 		return jobs;
 	}
 
-	registered_device & aquire_first_available_device ()
+	std::vector<registered_device> const & get_devices () const
 	{
-		auto it = std::find_if (devices.begin (), devices.end (), [](registered_device & driver) { return !driver.try_aquire (); });
-		if (it != devices.end ())
-		{
-			return *it;
-		}
-		throw std::runtime_error ("No available devices");
+		return devices;
 	}
 
 private:
+	/** Runs the jobs of \p device_a until the handler is destroyed */
+	void run_device (registered_device & device_a);
+
+	/**
+	 * Returns the next job for \p device_a: from its local queue, else from the job queue, else stolen from
+	 * the device with the longest local queue. Taking jobs from the job queue refills the local queue. If the
+	 * device's last job was \p preempted_a, the job queue is tried before the local queue.
+	 */
+	job_handle next_job (registered_device & device_a, bool preempted_a);
+
+	/**
+	 * Answers the waiters of \p job_a whose deadline has passed with an expired error.
+	 * @return true if no waiter is left, in which case the job is dropped instead of dispatched
+	 */
+	bool expire (job & job_a);
+
+	/**
+	 * Pops the next job from the job queue for \p device_a. Jobs routed to a faster type of device are placed in
+	 * the local queue of such a device instead.
+	 */
+	job_handle pop_queued (registered_device & device_a);
+
+	/** True if \p job_a is expensive enough to be left to a faster type of device than \p device_a */
+	bool routed_away (job const & job_a, registered_device const & device_a) const;
+
+	/** Returns the rank of \p job_a under the configured scheduling policy */
+	uint64_t rank (job const & job_a) const;
+
+	/**
+	 * Estimates the time to solve all queued, locally queued and active jobs, plus \p attempts_a more nonces, on
+	 * all devices together. Returns boost::none until the devices have measured their hashrate.
+	 */
+	boost::optional<std::chrono::milliseconds> drain_time (double attempts_a);
+
+	/**
+	 * Throws overload_error if \p job_a is not expected to be solved within the drain limit or its deadline,
+	 * behind the queued work and \p ahead_a more attempts, such as those of earlier items in a batch
+	 */
+	void admit (job const & job_a, double ahead_a = 0);
+
+	/**
+	 * Parses a work request into a new job record. Settings that \p request_a leaves out are taken from \p defaults_a,
+	 * such as the settings of the batch an item belongs to.
+	 */
+	job_handle make_job (boost::property_tree::ptree const & request_a, boost::property_tree::ptree const & defaults_a);
+
+	/** Returns the response for \p job_a if its work is cached at the requested difficulty */
+	boost::optional<boost::property_tree::ptree> cached_response (job const & job_a);
+
+	/** Queues the jobs left pending in the journal again, and adds the jobs it solved to the history */
+	void restore ();
+
+	/** Assigns \p job_a to \p client_a for fair queuing and ranks it under the scheduling policy */
+	void schedule (job & job_a, std::string const & client_a);
+
+	/**
+	 * Solves \p job_a on the aquired \p device_a, answers its waiters and releases the device
+	 * @return true if the job was preempted, in which case it was queued again instead of answered
+	 */
+	bool run (job_handle const & job_a, registered_device & device_a);
+
+	/** If every device is busy, preempts the lowest priority active job that \p job_a outranks */
+	void preempt_for (job const & job_a);
+
+	/** Wakes the device workers, after jobs were queued or a device was released */
+	void notify_workers ();
+
+	/**
+	 * Solves \p job_a on \p device_a. If the job's multiplier qualifies for splitting, the nonce space is
+	 * partitioned across \p device_a and every other idle device in proportion to their measured hashrate.
+	 */
+	boost::optional<uint64_t> solve (job & job_a, registered_device & device_a);
+
+	/**
+	 * Searches \p range_a with \p driver_a for a solution that meets the target of \p job_a, which may be raised
+	 * during the search. Solutions that no longer meet the target, skipped by the driver or found as the target was
+	 * raised, are discarded: logged, and cached at their own work value.
+	 */
+	boost::optional<uint64_t> search (job & job_a, std::shared_ptr<nano_pow::driver> const & driver_a, nano_pow::nonce_range const & range_a);
+
+	/**
+	 * Attaches \p waiter_a to \p queued_a, or else to the latest registered job for the root of \p job_a, which then
+	 * answers both requests. An active job is raised to a higher requested difficulty without restarting its search.
+	 * \p queued_a is also re-keyed with the higher priority and earlier deadline of \p job_a, and ranked at its raised
+	 * difficulty. Called by the job queue with the root's shard locked, and with \p queued_a out of the queue.
+	 * @return the job the request was attached to, or nullptr if it must be queued as a new job
+	 */
+	job_handle coalesce (job const & job_a, job_handle const & queued_a, job::waiter const & waiter_a);
+
+	/** Describes \p job_a in response to a status request */
+	boost::property_tree::ptree status (job_handle const & job_a);
+
+	/** Tells the waiters attached to \p job_a that it was cancelled before it was dispatched, and drops it from the registry */
+	void cancel_waiters (job & job_a);
+
 	std::vector<registered_device> devices;
 	nano_pow_server::config const & config;
 	std::shared_ptr<spdlog::logger> logger;
-	boost::asio::thread_pool pool;
+	/** Validates batches, so that large batches neither hold up the IO threads nor wait for work generation */
+	boost::asio::thread_pool validation_pool;
 
-	std::mutex jobs_mutex;
-	std::priority_queue<job, std::vector<job>, job::comparator> jobs;
+	/** Completed work, so that retried requests need not be solved again */
+	work_cache cache;
+
+	sharded_job_queue jobs;
+
+	/** Solved jobs kept in the history of the registry and the journal */
+	static constexpr size_t history_size = 128;
+
+	/** Every queued, active and recently solved job, by id and root */
+	job_registry registry;
+
+	/** Queued and recently solved jobs, restored after a restart */
+	job_journal journal;
+
+	/** Fair queuing weight of each configured client */
+	std::unordered_map<std::string, unsigned> client_weights;
+	client_rounds rounds;
 
 	std::mutex active_jobs_mutex;
-	std::set<std::reference_wrapper<job>, job::comparator> active_jobs;
+	std::set<job_handle, job::comparator> active_jobs;
 
-	std::mutex completed_jobs_mutex;
-	boost::circular_buffer<job> completed_jobs{ 128 };
+	/** Time dispatched jobs spent queued, by requested priority */
+	class wait_stats
+	{
+	public:
+		uint64_t count{ 0 };
+		std::chrono::milliseconds total{ 0 };
+		std::chrono::milliseconds max{ 0 };
+	};
+	std::mutex wait_stats_mutex;
+	std::map<unsigned, wait_stats> waits;
+
+	/** Incremented whenever workers are notified, so that a notification is not lost while a worker looks for a job */
+	uint64_t workers_epoch{ 0 };
+	std::atomic<bool> stopped{ false };
+	std::mutex workers_mutex;
+	std::condition_variable workers_condition;
+	std::vector<std::thread> workers;
 };
 }